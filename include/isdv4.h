@@ -42,16 +42,117 @@
 #define DATA_ID_MASK    0x3F
 #define TOUCH_CONTROL_BIT 0x10
 
-/* Only for touch devices: use serial ID as index to get packet length for device */
-int ISDV4PacketLengths[] = {
-	/* 0x00 => */ ISDV4_PKGLEN_TOUCH93,
-	/* 0x01 => */ ISDV4_PKGLEN_TOUCH9A,
-	/* 0x02 => */ ISDV4_PKGLEN_TOUCH93,
-	/* 0x03 => */ ISDV4_PKGLEN_TOUCH9A,
-	/* 0x04 => */ ISDV4_PKGLEN_TOUCH9A,
-	/* 0x05 => */ ISDV4_PKGLEN_TOUCH2FG
+/* Layout of the touch data packets of a sensor. Contact i is at byte
+ * offset + i * stride: x in two 7-bit bytes, then y. Its touch down bit is
+ * bit i of the status byte. */
+typedef struct {
+	uint8_t sensor_id;	/* as reported by the touch query */
+	uint8_t tablet_id;	/* tablet id implied by the sensor */
+	uint8_t pktlen;
+	uint8_t contacts;	/* number of contacts per packet */
+	uint8_t offset;		/* first byte of contact 0 */
+	uint8_t stride;		/* bytes per contact */
+	uint8_t status;		/* byte holding the touch down bits */
+	uint8_t capacity;	/* first byte of the capacity, 0 for none */
+} ISDV4TouchLayout;
+
+/* A new sensor is one more row here. */
+static const ISDV4TouchLayout isdv4TouchLayouts[] = {
+	/* sensor tablet pktlen               contacts offset stride status capacity */
+	{ 0x00, 0x93, ISDV4_PKGLEN_TOUCH93,  1, 1, 4, 0, 0 }, /* resistive touch & pen */
+	{ 0x01, 0x9A, ISDV4_PKGLEN_TOUCH9A,  1, 1, 6, 0, 5 }, /* capacitive touch & pen */
+	{ 0x02, 0x93, ISDV4_PKGLEN_TOUCH93,  1, 1, 4, 0, 0 }, /* resistive touch */
+	{ 0x03, 0x9F, ISDV4_PKGLEN_TOUCH9A,  1, 1, 6, 0, 5 }, /* capacitive touch */
+	{ 0x04, 0x9F, ISDV4_PKGLEN_TOUCH9A,  1, 1, 6, 0, 5 }, /* capacitive touch */
+	{ 0x05, 0xE3, ISDV4_PKGLEN_TOUCH2FG, 2, 1, 6, 0, 0 }, /* 2FGT, 0xE2 without pen */
 };
 
+#define ISDV4_TOUCH_LAYOUTS (sizeof(isdv4TouchLayouts) / sizeof(isdv4TouchLayouts[0]))
+
+/* @return The layout of the sensor, or NULL if it is unknown */
+static inline const ISDV4TouchLayout *isdv4TouchLayout(unsigned int sensor_id)
+{
+	size_t i;
+
+	for (i = 0; i < ISDV4_TOUCH_LAYOUTS; i++)
+		if (isdv4TouchLayouts[i].sensor_id == sensor_id)
+			return &isdv4TouchLayouts[i];
+
+	return NULL;
+}
+
+/* For tablets whose sensor wasn't queried or is unknown, the id comes
+ * from sysfs. Unknown tablets use the first layout. */
+static inline const ISDV4TouchLayout *isdv4TouchLayoutByTablet(int tablet_id)
+{
+	size_t i;
+
+	/* the 2FGT sensor without pen */
+	if (tablet_id == 0xE2)
+		tablet_id = 0xE3;
+
+	for (i = 0; i < ISDV4_TOUCH_LAYOUTS; i++)
+		if (isdv4TouchLayouts[i].tablet_id == tablet_id)
+			return &isdv4TouchLayouts[i];
+
+	return &isdv4TouchLayouts[0];
+}
+
+static inline const ISDV4TouchLayout *isdv4TouchLayoutByLength(size_t pktlen)
+{
+	size_t i;
+
+	for (i = 0; i < ISDV4_TOUCH_LAYOUTS; i++)
+		if (isdv4TouchLayouts[i].pktlen == pktlen)
+			return &isdv4TouchLayouts[i];
+
+	return &isdv4TouchLayouts[0];
+}
+
+/* Only for touch devices: use serial ID to get packet length for device */
+static inline int isdv4TouchPacketLength(unsigned int sensor_id)
+{
+	const ISDV4TouchLayout *layout = isdv4TouchLayout(sensor_id);
+
+	return layout ? layout->pktlen : ISDV4_PKGLEN_TOUCH93;
+}
+
+/**
+ * Find the first byte with HEADER_BIT set. Scans a machine word at a time
+ * and only looks at single bytes around the match and at the tail.
+ *
+ * @return The index of the header byte, or len if there is none.
+ */
+static inline size_t isdv4FindHeader(const unsigned char *data, size_t len)
+{
+	const unsigned long mask = (unsigned long)0x8080808080808080ULL;
+	unsigned long word;
+	size_t i = 0;
+
+	for (; i + sizeof(word) <= len; i += sizeof(word))
+	{
+		memcpy(&word, data + i, sizeof(word));
+		if (word & mask)
+			break;
+	}
+
+	for (; i < len; i++)
+		if (data[i] & HEADER_BIT)
+			break;
+
+	return i;
+}
+
+/**
+ * @return Non-zero if data is a single packet of len bytes: a header byte
+ * followed by len - 1 bytes without HEADER_BIT.
+ */
+static inline int isdv4ValidPacket(const unsigned char *data, size_t len)
+{
+	return len && (data[0] & HEADER_BIT) &&
+		isdv4FindHeader(data + 1, len - 1) == len - 1;
+}
+
 /* ISDV4 protocol parsing structs. */
 
 /* Query reply data */
@@ -103,6 +204,43 @@ typedef struct {
 	uint8_t tilt_y;
 } ISDV4CoordinateData;
 
+/* Fields of pen coordinate and touch data packets. The parsers below and
+ * the driver, which decodes straight into its device state, share these. */
+static inline int isdv4PenX(const unsigned char *buffer)
+{
+	return (buffer[1] << 9) | (buffer[2] << 2) | ((buffer[6] >> 5) & 0x3);
+}
+
+static inline int isdv4PenY(const unsigned char *buffer)
+{
+	return (buffer[3] << 9) | (buffer[4] << 2) | ((buffer[6] >> 3) & 0x3);
+}
+
+static inline int isdv4PenPressure(const unsigned char *buffer)
+{
+	return ((buffer[6] & 0x7) << 7) | buffer[5];
+}
+
+static inline int isdv4TouchStatus(const unsigned char *buffer,
+				   const ISDV4TouchLayout *layout, int contact)
+{
+	return (buffer[layout->status] >> contact) & 0x1;
+}
+
+static inline int isdv4TouchX(const unsigned char *buffer,
+			      const ISDV4TouchLayout *layout, int contact)
+{
+	buffer += layout->offset + contact * layout->stride;
+	return buffer[0] << 7 | buffer[1];
+}
+
+static inline int isdv4TouchY(const unsigned char *buffer,
+			      const ISDV4TouchLayout *layout, int contact)
+{
+	buffer += layout->offset + contact * layout->stride;
+	return buffer[2] << 7 | buffer[3];
+}
+
 static inline int isdv4ParseQuery(const unsigned char *buffer, const size_t len,
 				  ISDV4QueryReply *reply)
 {
@@ -160,6 +298,7 @@ static inline int isdv4ParseTouchQuery(const unsigned char *buffer, const size_t
 static inline int isdv4ParseTouchData(const unsigned char *buffer, const size_t buff_len,
 				      const size_t pktlen, ISDV4TouchData *touchdata)
 {
+	const ISDV4TouchLayout *layout = isdv4TouchLayoutByLength(pktlen);
 	int header, touch;
 
 	if (!touchdata || buff_len < pktlen)
@@ -173,18 +312,18 @@ static inline int isdv4ParseTouchData(const unsigned char *buffer, const size_t
 
 	memset(touchdata, 0, sizeof(*touchdata));
 
-	touchdata->status = buffer[0] & 0x1;
-	/* FIXME: big endian */
-	touchdata->x = buffer[1] << 7 | buffer[2];
-	touchdata->y = buffer[3] << 7 | buffer[4];
-	if (pktlen == ISDV4_PKGLEN_TOUCH9A)
-		touchdata->capacity = buffer[5] << 7 | buffer[6];
+	touchdata->status = isdv4TouchStatus(buffer, layout, 0);
+	touchdata->x = isdv4TouchX(buffer, layout, 0);
+	touchdata->y = isdv4TouchY(buffer, layout, 0);
+	if (layout->capacity)
+		touchdata->capacity = buffer[layout->capacity] << 7 |
+				      buffer[layout->capacity + 1];
 
-	if (pktlen == ISDV4_PKGLEN_TOUCH2FG)
+	if (layout->contacts > 1)
 	{
-		touchdata->finger2.x = buffer[7] << 7 | buffer[8];
-		touchdata->finger2.y = buffer[9] << 7 | buffer[10];
-		touchdata->finger2.status = !!(buffer[0] & 0x2);
+		touchdata->finger2.x = isdv4TouchX(buffer, layout, 1);
+		touchdata->finger2.y = isdv4TouchY(buffer, layout, 1);
+		touchdata->finger2.status = isdv4TouchStatus(buffer, layout, 1);
 		/* FIXME: is there a fg2 capacity? */
 	}
 
@@ -209,11 +348,10 @@ static inline int isdv4ParseCoordinateData(const unsigned char *buffer, const si
 	coord->tip = buffer[0] & 0x1;
 	coord->side = (buffer[0] >> 1) & 0x1;
 	coord->eraser = (buffer[0] >> 2) & 0x1;
-	/* FIXME: big endian */
-	coord->x = (buffer[1] << 9) | (buffer[2] << 2) | ((buffer[6] >> 5) & 0x3);
-	coord->y = (buffer[3] << 9) | (buffer[4] << 2) | ((buffer[6] >> 3) & 0x3);
+	coord->x = isdv4PenX(buffer);
+	coord->y = isdv4PenY(buffer);
 
-	coord->pressure = ((buffer[6] & 0x7) << 7) | buffer[5];
+	coord->pressure = isdv4PenPressure(buffer);
 	coord->tilt_x = buffer[7];
 	coord->tilt_y = buffer[8];
 
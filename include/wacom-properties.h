@@ -27,12 +27,24 @@
 /* 32 bit, 4 values, top x, top y, bottom x, bottom y */
 #define WACOM_PROP_TABLET_AREA "Wacom Tablet Area"
 
+/* 32 bit, 9 values, row-major 3x3 calibration matrix in 16.16 fixed
+   point, applied to tablet coordinates normalized to 0..1 */
+#define WACOM_PROP_CALIBRATION "Wacom Calibration Matrix"
+
 /* 8 bit, 1 value, [0 - 3] (NONE, CW, CCW, HALF) */
 #define WACOM_PROP_ROTATION "Wacom Rotation"
 
-/* 32 bit, 4 values */
+/* 32 bit, 4 values, Bezier control points x1 y1 x2 y2, or 6 to 32 values,
+   3 to 16 points x y of a monotone curve through them. Ranges 0..100 */
 #define WACOM_PROP_PRESSURECURVE "Wacom Pressurecurve"
 
+/* 32 bit, 1 to 33 values, tool serial followed by a curve as in
+   WACOM_PROP_PRESSURECURVE. The tool uses it on any device of the tablet
+   whenever it is in proximity. The serial alone removes its curve.
+   write-mostly, reads back what was last written
+ */
+#define WACOM_PROP_TOOL_PRESSURECURVE "Wacom Tool Pressurecurve"
+
 /* CARD32, 5 values, tablet id, old serial, old hw device id,
    current serial, current device id
    read-only
@@ -75,6 +87,13 @@
 /* 32 bit, 2 values, suppress, sample */
 #define WACOM_PROP_SAMPLE "Wacom Sample and Suppress"
 
+/* 32 bit, 3 values, filter mode (0 average, 1 1euro, 2 kalman),
+   2 filter parameters */
+#define WACOM_PROP_FILTER "Wacom Coordinate Filter"
+
+/* 32 bit, 1 value, position look-ahead in ms, 0 disables prediction */
+#define WACOM_PROP_PREDICTION "Wacom Prediction"
+
 /* BOOL, 1 value */
 #define WACOM_PROP_TOUCH "Wacom Enable Touch"
 
@@ -111,6 +130,34 @@
 */
 #define WACOM_PROP_PRESSURE_RECAL "Wacom Pressure Recalibration"
 
+/* CARD32, 7 values, wakeups, reads, bytes read, max reads per wakeup,
+   max bytes per wakeup, wakeups that hit the read loop limit,
+   SYN_DROPPED events seen
+   read-only
+ */
+#define WACOM_PROP_READ_STATS "Wacom Read Statistics"
+
+/* CARD32, 6 values, events posted, events posted in the last second,
+   events suppressed, frames lost to a full event queue, tools that found
+   no free channel, times the parser skipped bad data
+   read-only
+ */
+#define WACOM_PROP_EVENT_STATS "Wacom Event Statistics"
+
+/* CARD32, 6 * 20 values, latency histogram of the input path stages
+   kernel, read, dispatch, event, device, send. Value n of a stage counts
+   latencies below 2^n us, the last one everything above. Latencies are
+   measured from the read, the kernel stage up to it.
+   read-only, only present if the driver was built with --enable-trace
+ */
+#define WACOM_PROP_TRACE_HISTOGRAM "Wacom Latency Histogram"
+
+/* CARD32, 3 values per record for the last 256 records, oldest first:
+   stage (as above), time in us (low 32 bits), latency in us
+   read-only, only present if the driver was built with --enable-trace
+ */
+#define WACOM_PROP_TRACE_LOG "Wacom Latency Trace"
+
 /* The following are tool types used by the driver in WACOM_PROP_TOOL_TYPE
  * or in the 'type' field for XI1 clients. Clients may check for one of
  * these types to identify tool types.
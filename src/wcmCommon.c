@@ -27,6 +27,11 @@
 #include "wcmTouchFilter.h"
 #include <xkbsrv.h>
 #include <xf86_OSproc.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
 
 
 struct _WacomDriverRec WACOM_DRIVER = {
@@ -55,6 +60,44 @@ static int *VCOPY(const int *valuators, int nvals)
  ****************************************************************************/
 
 static int applyPressureCurve(WacomDevicePtr pDev, const WacomDeviceStatePtr pState);
+#define PREDICT_AGE 3	/* age of the state the velocity is estimated from */
+
+/**
+ * Extrapolate the tool position priv->prediction ms ahead to hide the
+ * latency between the pen and the cursor. The velocity is taken from the
+ * channel history since the tool came into proximity (nSamples is reset
+ * on proximity changes), so nothing is predicted for the first sample.
+ *
+ * @param priv The wacom device
+ * @param pChannel The channel the state belongs to
+ * @param ds The state to move, this is not the stored channel state
+ */
+static void wcmPredictPosition(WacomDevicePtr priv,
+			       const WacomChannelPtr pChannel,
+			       WacomDeviceState *ds)
+{
+	WacomCommonPtr common = priv->common;
+	const WacomDeviceState *old;
+	int age = min(pChannel->nSamples - 1, PREDICT_AGE);
+	int64_t dt;
+
+	if (age < 1 || !ds->proximity)
+		return;
+
+	old = wcmChannelState(pChannel, age);
+	dt = ds->time_us - old->time_us;
+	if (dt <= 0 || !old->proximity)
+		return;
+
+	ds->x += (int64_t)(ds->x - old->x) * priv->prediction * 1000 / dt;
+	ds->y += (int64_t)(ds->y - old->y) * priv->prediction * 1000 / dt;
+
+	ds->x = min(max(ds->x, common->wcmMinX), common->wcmMaxX);
+	ds->y = min(max(ds->y, common->wcmMinY), common->wcmMaxY);
+
+	DBG(10, priv, "predicted %d,%d from %d us of motion\n", ds->x, ds->y, (int)dt);
+}
+
 static void commonDispatchDevice(InputInfoPtr pInfo,
 				 const WacomChannelPtr pChannel,
 				 enum WacomSuppressMode suppress);
@@ -147,12 +190,15 @@ void wcmEmitKeycode (DeviceIntPtr keydev, int keycode, int state)
 	xf86PostKeyboardEvent (keydev, keycode, state);
 }
 
+/* compiled actions in use, shared between devices */
+static WacomAction *actionPrograms;
+
 /*****************************************************************************
  * countPresses
  *   Count the number of key/button presses not released for the given key
  *   array.
  ****************************************************************************/
-static int countPresses(int keybtn, unsigned int* keys, int size)
+static int countPresses(int keybtn, const unsigned int* keys, int size)
 {
 	int i, act, count = 0;
 
@@ -166,26 +212,149 @@ static int countPresses(int keybtn, unsigned int* keys, int size)
 	return count;
 }
 
-static void sendAction(InputInfoPtr pInfo, int press,
-		       unsigned int *keys, int nkeys,
-		       int first_val, int num_val, int *valuators)
+/*
+ * Collect one release for every key or button press in the array that no
+ * later action releases, in array order. With a NULL release only count.
+ */
+static int compileReleases(const unsigned int *keys, int nkeys,
+			   unsigned int *release)
 {
-	int i;
+	int i, n = 0;
 
-	/* Actions only trigger on press, not release */
-	for (i = 0; press && i < nkeys; i++)
+	for (i = 0; i < nkeys; i++)
 	{
 		unsigned int action = keys[i];
+		int type = action & AC_TYPE;
+
+		/* don't care about releases here */
+		if ((type != AC_BUTTON && type != AC_KEY) ||
+		    !(action & AC_KEYBTNPRESS))
+			continue;
+
+		if (!countPresses(action & AC_CODE, &keys[i], nkeys - i))
+			continue;
+
+		if (release)
+			release[n] = action & ~AC_KEYBTNPRESS;
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * Compile an action array as the action properties set it into the lists
+ * sendAction runs: the actions up to the first empty one for a press and
+ * the releases compileReleases finds for a release. Neither needs to look
+ * at the array again.
+ *
+ * @return The program, for the caller to free, or NULL if out of memory.
+ */
+static WacomAction *wcmCompileAction(const unsigned int *keys, int nkeys)
+{
+	WacomAction *prog;
+	int npress, nrelease;
+
+	for (npress = 0; npress < nkeys && keys[npress]; npress++)
+		;
+	nrelease = compileReleases(keys, nkeys, NULL);
+
+	prog = malloc(sizeof(*prog) +
+		      (npress + nrelease) * sizeof(*prog->actions));
+	if (!prog)
+		return NULL;
+
+	prog->npress = npress;
+	prog->nrelease = nrelease;
+	memcpy(prog->actions, keys, npress * sizeof(*keys));
+	compileReleases(keys, nkeys, prog->actions + npress);
+
+	return prog;
+}
+
+/**
+ * Find the program for an action array or build a new one. Almost all
+ * buttons of all devices run one of a few short programs, so devices
+ * share them and setting an action only ever replaces a device's
+ * reference.
+ *
+ * @return The program with a reference taken, or NULL if out of memory.
+ */
+WacomAction *wcmGetAction(const unsigned int *keys, int nkeys)
+{
+	WacomAction *prog, *shared;
+
+	prog = wcmCompileAction(keys, nkeys);
+	if (!prog)
+		return NULL;
+
+	for (shared = actionPrograms; shared; shared = shared->next)
+	{
+		if (shared->npress == prog->npress &&
+		    shared->nrelease == prog->nrelease &&
+		    !memcmp(shared->actions, prog->actions,
+			    (prog->npress + prog->nrelease) * sizeof(*prog->actions)))
+		{
+			free(prog);
+			shared->refs++;
+			return shared;
+		}
+	}
+
+	prog->refs = 1;
+	prog->next = actionPrograms;
+	actionPrograms = prog;
+
+	return prog;
+}
+
+/* Drop a reference to a program, freeing it with the last one */
+void wcmReleaseAction(WacomAction *prog)
+{
+	WacomAction **prev;
 
-		if (!action)
+	if (!prog || --prog->refs > 0)
+		return;
+
+	for (prev = &actionPrograms; *prev; prev = &(*prev)->next)
+	{
+		if (*prev == prog)
+		{
+			*prev = prog->next;
 			break;
+		}
+	}
+	free(prog);
+}
 
-		switch ((action & AC_TYPE))
+static void sendAction(InputInfoPtr pInfo, int press,
+		       const WacomAction *prog,
+		       int first_val, int num_val, int *valuators)
+{
+	const unsigned int *action, *end;
+
+	if (!prog)
+		return;
+
+	/* Actions only trigger on press, release only lets go of them */
+	if (press)
+	{
+		action = prog->actions;
+		end = action + prog->npress;
+	} else
+	{
+		action = prog->actions + prog->npress;
+		end = action + prog->nrelease;
+	}
+
+	for (; action < end; action++)
+	{
+		switch ((*action & AC_TYPE))
 		{
 			case AC_BUTTON:
 				{
-					int btn_no = (action & AC_CODE);
-					int is_press = (action & AC_KEYBTNPRESS);
+					int btn_no = (*action & AC_CODE);
+					int is_press = (*action & AC_KEYBTNPRESS);
 					xf86PostButtonEventP(pInfo->dev,
 							    is_absolute(pInfo), btn_no,
 							    is_press, first_val, num_val,
@@ -194,55 +363,17 @@ static void sendAction(InputInfoPtr pInfo, int press,
 				break;
 			case AC_KEY:
 				{
-					int key_code = (action & AC_CODE);
-					int is_press = (action & AC_KEYBTNPRESS);
+					int key_code = (*action & AC_CODE);
+					int is_press = (*action & AC_KEYBTNPRESS);
 					wcmEmitKeycode(pInfo->dev, key_code, is_press);
 				}
 				break;
 			case AC_MODETOGGLE:
-				if (press)
-					wcmDevSwitchModeCall(pInfo,
-							(is_absolute(pInfo)) ? Relative : Absolute); /* not a typo! */
+				wcmDevSwitchModeCall(pInfo,
+						(is_absolute(pInfo)) ? Relative : Absolute); /* not a typo! */
 				break;
 		}
 	}
-
-	/* Release all non-released keys for this button. */
-	for (i = 0; !press && i < nkeys; i++)
-	{
-		unsigned int action = keys[i];
-
-		switch ((action & AC_TYPE))
-		{
-			case AC_BUTTON:
-				{
-					int btn_no = (action & AC_CODE);
-
-					/* don't care about releases here */
-					if (!(action & AC_KEYBTNPRESS))
-						break;
-
-					if (countPresses(btn_no, &keys[i], nkeys - i))
-						xf86PostButtonEventP(pInfo->dev,
-								is_absolute(pInfo), btn_no,
-								0, first_val, num_val,
-								VCOPY(valuators, num_val));
-				}
-				break;
-			case AC_KEY:
-				{
-					int key_code = (action & AC_CODE);
-
-					/* don't care about releases here */
-					if (!(action & AC_KEYBTNPRESS))
-						break;
-
-					if (countPresses(key_code, &keys[i], nkeys - i))
-						wcmEmitKeycode(pInfo->dev, key_code, 0);
-				}
-		}
-
-	}
 }
 
 /*****************************************************************************
@@ -260,11 +391,10 @@ static void sendAButton(InputInfoPtr pInfo, int button, int mask,
 	DBG(4, priv, "TPCButton(%s) button=%d state=%d\n",
 	    common->wcmTPCButton ? "on" : "off", button, mask);
 
-	if (!priv->keys[button][0])
+	if (!priv->btn_prog[button] || !priv->btn_prog[button]->npress)
 		return;
 
-	sendAction(pInfo, (mask != 0), priv->keys[button],
-		   ARRAY_SIZE(priv->keys[button]),
+	sendAction(pInfo, (mask != 0), priv->btn_prog[button],
 		   first_val, num_val, valuators);
 }
 
@@ -337,19 +467,17 @@ TEST_NON_STATIC int getWheelButton(int delta, int action_up, int action_dn)
 /**
  * Send button or actions for a scrolling axis.
  *
- * @param button     X button number to send if no action is defined
- * @param action     Action to send
- * @param nactions   Length of action array
+ * @param action     Compiled action to send
  * @param pInfo
  * @param first_val  
  * @param num_vals
  * @param valuators
  */
-static void sendWheelStripEvent(unsigned int *action, int nactions, InputInfoPtr pInfo,
+static void sendWheelStripEvent(const WacomAction *action, InputInfoPtr pInfo,
                                 int first_val, int num_vals, int *valuators)
 {
-	sendAction(pInfo, 1, action, nactions, first_val, num_vals, valuators);
-	sendAction(pInfo, 0, action, nactions, first_val, num_vals, valuators);
+	sendAction(pInfo, 1, action, first_val, num_vals, valuators);
+	sendAction(pInfo, 0, action, first_val, num_vals, valuators);
 }
 
 /*****************************************************************************
@@ -372,7 +500,7 @@ static void sendWheelStripEvents(InputInfoPtr pInfo, const WacomDeviceState* ds,
 	if (idx >= 0 && IsPad(priv) && priv->oldState.proximity == ds->proximity)
 	{
 		DBG(10, priv, "Left touch strip scroll delta = %d\n", delta);
-		sendWheelStripEvent(priv->strip_keys[idx], ARRAY_SIZE(priv->strip_keys[idx]),
+		sendWheelStripEvent(priv->strip_prog[idx],
 		                    pInfo, first_val, num_vals, valuators);
 	}
 
@@ -382,7 +510,7 @@ static void sendWheelStripEvents(InputInfoPtr pInfo, const WacomDeviceState* ds,
 	if (idx >= 0 && IsPad(priv) && priv->oldState.proximity == ds->proximity)
 	{
 		DBG(10, priv, "Right touch strip scroll delta = %d\n", delta);
-		sendWheelStripEvent(priv->strip_keys[idx], ARRAY_SIZE(priv->strip_keys[idx]),
+		sendWheelStripEvent(priv->strip_prog[idx],
 		                    pInfo, first_val, num_vals, valuators);
 	}
 
@@ -392,7 +520,7 @@ static void sendWheelStripEvents(InputInfoPtr pInfo, const WacomDeviceState* ds,
 	if (idx >= 0 && (IsCursor(priv) || IsPad(priv)) && priv->oldState.proximity == ds->proximity)
 	{
 		DBG(10, priv, "Relative wheel scroll delta = %d\n", delta);
-		sendWheelStripEvent(priv->wheel_keys[idx], ARRAY_SIZE(priv->wheel_keys[idx]),
+		sendWheelStripEvent(priv->wheel_prog[idx],
 		                    pInfo, first_val, num_vals, valuators);
 	}
 
@@ -402,7 +530,7 @@ static void sendWheelStripEvents(InputInfoPtr pInfo, const WacomDeviceState* ds,
 	if (idx >= 0 && IsPad(priv) && priv->oldState.proximity == ds->proximity)
 	{
 		DBG(10, priv, "Left touch wheel scroll delta = %d\n", delta);
-		sendWheelStripEvent(priv->wheel_keys[idx], ARRAY_SIZE(priv->wheel_keys[idx]),
+		sendWheelStripEvent(priv->wheel_prog[idx],
 		                    pInfo, first_val, num_vals, valuators);
 	}
 
@@ -412,7 +540,7 @@ static void sendWheelStripEvents(InputInfoPtr pInfo, const WacomDeviceState* ds,
 	if (idx >= 0 && IsPad(priv) && priv->oldState.proximity == ds->proximity)
 	{
 		DBG(10, priv, "Right touch wheel scroll delta = %d\n", delta);
-		sendWheelStripEvent(priv->wheel_keys[idx], ARRAY_SIZE(priv->wheel_keys[idx]),
+		sendWheelStripEvent(priv->wheel_prog[idx],
 		                    pInfo, first_val, num_vals, valuators);
 	}
 }
@@ -439,52 +567,236 @@ static void sendCommonEvents(InputInfoPtr pInfo, const WacomDeviceState* ds,
 		sendWheelStripEvents(pInfo, ds, first_val, num_vals, valuators);
 }
 
-/* rotate x and y before post X inout events */
-void wcmRotateAndScaleCoordinates(InputInfoPtr pInfo, int* x, int* y)
+/**
+ * Precompute the transform wcmRotateAndScaleCoordinates applies: scale
+ * the topX/topY..bottomX/bottomY area into the range of the X and Y
+ * axes, then rotate within that range. Must be called whenever the area,
+ * the rotation or the axis ranges change.
+ */
+void wcmUpdateTransform(InputInfoPtr pInfo)
 {
 	WacomDevicePtr priv = (WacomDevicePtr) pInfo->private;
 	WacomCommonPtr common = priv->common;
 	DeviceIntPtr dev = pInfo->dev;
 	AxisInfoPtr axis_x, axis_y;
-	int tmp_coord;
+	double m[2][3] = { { 1, 0, 0 }, { 0, 1, 0 } };
+	double row[3];
+	int i;
+
+	/* axes not set up yet, wcmDevInit will call us again */
+	if (!dev || !dev->valuator)
+		return;
 
-	/* scale into on topX/topY area */
 	axis_x = &dev->valuator->axes[0];
 	axis_y = &dev->valuator->axes[1];
 
-	/* Don't try to scale relative axes */
+	/* keep to the axis ranges, relative axes have none */
+	priv->transformClip[0][0] = INT_MIN;
+	priv->transformClip[0][1] = INT_MAX;
+	priv->transformClip[1][0] = INT_MIN;
+	priv->transformClip[1][1] = INT_MAX;
 	if (axis_x->max_value > axis_x->min_value)
-		*x = xf86ScaleAxis(*x, axis_x->max_value, axis_x->min_value,
-				   priv->bottomX, priv->topX);
+	{
+		priv->transformClip[0][0] = axis_x->min_value;
+		priv->transformClip[0][1] = axis_x->max_value;
+	}
+	if (axis_y->max_value > axis_y->min_value)
+	{
+		priv->transformClip[1][0] = axis_y->min_value;
+		priv->transformClip[1][1] = axis_y->max_value;
+	}
+
+	/* scale into on topX/topY area. Don't try to scale relative axes */
+	if (axis_x->max_value > axis_x->min_value)
+	{
+		double sx = (priv->bottomX != priv->topX) ?
+			(double)(axis_x->max_value - axis_x->min_value) /
+				(priv->bottomX - priv->topX) : 0;
+
+		m[0][0] = sx;
+		m[0][2] = (sx != 0) ? axis_x->min_value - priv->topX * sx : 0;
+	}
 
 	if (axis_y->max_value > axis_y->min_value)
-		*y = xf86ScaleAxis(*y, axis_y->max_value, axis_y->min_value,
-				   priv->bottomY, priv->topY);
+	{
+		double sy = (priv->bottomY != priv->topY) ?
+			(double)(axis_y->max_value - axis_y->min_value) /
+				(priv->bottomY - priv->topY) : 0;
+
+		m[1][1] = sy;
+		m[1][2] = (sy != 0) ? axis_y->min_value - priv->topY * sy : 0;
+	}
 
 	/* coordinates are now in the axis rage we advertise for the device */
 
 	if (common->wcmRotate == ROTATE_CW || common->wcmRotate == ROTATE_CCW)
 	{
-		tmp_coord = *x;
+		double rx = (double)(axis_x->max_value - axis_x->min_value) /
+			    (axis_y->max_value - axis_y->min_value);
+		double ry = 1 / rx;
+
+		/* swap x and y, scaling each into the other axis' range */
+		for (i = 0; i < 3; i++)
+		{
+			row[i] = m[0][i];
+			m[0][i] = m[1][i] * rx;
+			m[1][i] = row[i] * ry;
+		}
+		m[0][2] += axis_x->min_value - axis_y->min_value * rx;
+		m[1][2] += axis_y->min_value - axis_x->min_value * ry;
+	}
+
+	/* mirror within the axis range */
+	if (common->wcmRotate == ROTATE_CCW || common->wcmRotate == ROTATE_HALF)
+	{
+		for (i = 0; i < 3; i++)
+			m[0][i] = -m[0][i];
+		m[0][2] += axis_x->max_value + axis_x->min_value;
+	}
 
-		*x = xf86ScaleAxis(*y,
-				   axis_x->max_value, axis_x->min_value,
-				   axis_y->max_value, axis_y->min_value);
-		*y = xf86ScaleAxis(tmp_coord,
-				   axis_y->max_value, axis_y->min_value,
-				   axis_x->max_value, axis_x->min_value);
+	if (common->wcmRotate == ROTATE_CW || common->wcmRotate == ROTATE_HALF)
+	{
+		for (i = 0; i < 3; i++)
+			m[1][i] = -m[1][i];
+		m[1][2] += axis_y->max_value + axis_y->min_value;
 	}
 
-	if (common->wcmRotate == ROTATE_CW)
-		*y = axis_y->max_value - (*y - axis_y->min_value);
-	else if (common->wcmRotate == ROTATE_CCW)
-		*x = axis_x->max_value - (*x - axis_x->min_value);
-	else if (common->wcmRotate == ROTATE_HALF)
+	for (i = 0; i < 3; i++)
 	{
-		*x = axis_x->max_value - (*x - axis_x->min_value);
-		*y = axis_y->max_value - (*y - axis_y->min_value);
+		priv->transform[0][i] = llround(m[0][i] * (1 << WCM_TRANSFORM_SHIFT));
+		priv->transform[1][i] = llround(m[1][i] * (1 << WCM_TRANSFORM_SHIFT));
+	}
+
+	DBG(10, priv, "transform x = %f*x + %f*y + %f, y = %f*x + %f*y + %f\n",
+	    m[0][0], m[0][1], m[0][2], m[1][0], m[1][1], m[1][2]);
+}
+
+/**
+ * Check a calibration matrix as stored in priv->calibMatrix.
+ *
+ * @return TRUE unless the matrix collapses the tablet onto a line or point.
+ */
+Bool wcmCheckCalibration(const int *matrix)
+{
+	double m[9], det;
+	int i;
+
+	for (i = 0; i < 9; i++)
+		m[i] = matrix[i];
+
+	det = m[0] * (m[4] * m[8] - m[5] * m[7]) -
+	      m[1] * (m[3] * m[8] - m[5] * m[6]) +
+	      m[2] * (m[3] * m[7] - m[4] * m[6]);
+
+	return det != 0;
+}
+
+/**
+ * Precompute the calibration matrix for device coordinates. The user
+ * matrix in priv->calibMatrix works on coordinates normalized to 0..1
+ * over the tool's range, so it is wrapped into the conversion from and to
+ * device coordinates. Affine matrices are applied in fixed point,
+ * projective ones (keystone) in floating point.
+ */
+void wcmUpdateCalibration(WacomDevicePtr priv)
+{
+	double m[3][3], tmp[3][3];
+	double w[2] = { max(priv->maxX - priv->minX, 1),
+			max(priv->maxY - priv->minY, 1) };
+	double o[2] = { priv->minX, priv->minY };
+	int i, j;
+
+	for (i = 0; i < 9; i++)
+		m[i / 3][i % 3] = (double)priv->calibMatrix[i] / (1 << WCM_TRANSFORM_SHIFT);
+
+	/* m * normalize */
+	for (i = 0; i < 3; i++)
+	{
+		tmp[i][0] = m[i][0] / w[0];
+		tmp[i][1] = m[i][1] / w[1];
+		tmp[i][2] = m[i][2] - m[i][0] * o[0] / w[0] - m[i][1] * o[1] / w[1];
+	}
+
+	/* denormalize * m * normalize */
+	for (j = 0; j < 3; j++)
+	{
+		priv->calib[0][j] = w[0] * tmp[0][j] + o[0] * tmp[2][j];
+		priv->calib[1][j] = w[1] * tmp[1][j] + o[1] * tmp[2][j];
+		priv->calib[2][j] = tmp[2][j];
+	}
+
+	if (m[2][0] != 0 || m[2][1] != 0 || m[2][2] != 1)
+		priv->calibMode = CALIB_PROJECTIVE;
+	else if (m[0][0] != 1 || m[0][1] != 0 || m[0][2] != 0 ||
+		 m[1][0] != 0 || m[1][1] != 1 || m[1][2] != 0)
+		priv->calibMode = CALIB_AFFINE;
+	else
+		priv->calibMode = CALIB_NONE;
+
+	for (i = 0; i < 2; i++)
+		for (j = 0; j < 3; j++)
+			priv->calibFixed[i][j] = llround(priv->calib[i][j] *
+							 (1 << WCM_TRANSFORM_SHIFT));
+
+	DBG(10, priv, "calibration mode %d\n", priv->calibMode);
+}
+
+/* apply the user calibration to a tablet position, keeping it within the
+ * range of the tool */
+static void wcmApplyCalibration(WacomDevicePtr priv, WacomDeviceState *ds)
+{
+	if (priv->calibMode == CALIB_AFFINE)
+	{
+		const int64_t (*m)[3] = (const int64_t (*)[3])priv->calibFixed;
+		const int64_t half = 1 << (WCM_TRANSFORM_SHIFT - 1);
+		int64_t x = ds->x, y = ds->y;
+		int64_t rx, ry;
+
+		rx = (m[0][0] * x + m[0][1] * y + m[0][2] + half) >> WCM_TRANSFORM_SHIFT;
+		ry = (m[1][0] * x + m[1][1] * y + m[1][2] + half) >> WCM_TRANSFORM_SHIFT;
+
+		ds->x = min(max(rx, priv->minX), priv->maxX);
+		ds->y = min(max(ry, priv->minY), priv->maxY);
+	}
+	else
+	{
+		const double (*m)[3] = (const double (*)[3])priv->calib;
+		double x = ds->x, y = ds->y;
+		double w = m[2][0] * x + m[2][1] * y + m[2][2];
+		double rx, ry;
+
+		if (fabs(w) < 1e-9)
+			return;
+
+		rx = (m[0][0] * x + m[0][1] * y + m[0][2]) / w;
+		ry = (m[1][0] * x + m[1][1] * y + m[1][2]) / w;
+
+		/* on the vanishing line of a keystone the position runs off
+		 * to infinity, leave it alone as for w == 0 */
+		if (!isfinite(rx) || !isfinite(ry))
+			return;
+
+		ds->x = lround(min(max(rx, priv->minX), priv->maxX));
+		ds->y = lround(min(max(ry, priv->minY), priv->maxY));
 	}
+}
+
+/* rotate x and y before post X inout events */
+void wcmRotateAndScaleCoordinates(InputInfoPtr pInfo, int* x, int* y)
+{
+	WacomDevicePtr priv = (WacomDevicePtr) pInfo->private;
+	const int64_t (*m)[3] = (const int64_t (*)[3])priv->transform;
+	const int64_t half = 1 << (WCM_TRANSFORM_SHIFT - 1);
+	const int (*clip)[2] = (const int (*)[2])priv->transformClip;
+	int64_t tx = *x, ty = *y;
+	int64_t rx, ry;
+
+	rx = (m[0][0] * tx + m[0][1] * ty + m[0][2] + half) >> WCM_TRANSFORM_SHIFT;
+	ry = (m[1][0] * tx + m[1][1] * ty + m[1][2] + half) >> WCM_TRANSFORM_SHIFT;
 
+	/* outside the area is the edge of the axis, like xf86ScaleAxis */
+	*x = min(max(rx, clip[0][0]), clip[0][1]);
+	*y = min(max(ry, clip[1][0]), clip[1][1]);
 
 	DBG(10, priv, "rotate/scaled to %d/%d\n", *x, *y);
 }
@@ -609,6 +921,21 @@ wcmSendNonPadEvents(InputInfoPtr pInfo, const WacomDeviceState *ds,
  *   Send events according to the device state.
  ****************************************************************************/
 
+/* Count a posted state, the rate is taken over whole seconds of event time */
+static void wcmCountEvent(WacomEventStats *stats, int time)
+{
+	stats->posted++;
+
+	if (time - stats->window_start >= 1000)
+	{
+		/* a gap of a second or more means nothing was posted */
+		stats->rate = (time - stats->window_start < 2000) ? stats->window : 0;
+		stats->window = 0;
+		stats->window_start = time;
+	}
+	stats->window++;
+}
+
 void wcmSendEvents(InputInfoPtr pInfo, const WacomDeviceState* ds)
 {
 #ifdef DEBUG
@@ -634,6 +961,7 @@ void wcmSendEvents(InputInfoPtr pInfo, const WacomDeviceState* ds)
 		return;
 	}
 
+	wcmCountEvent(&priv->common->wcmEventStats, ds->time);
 	wcmUpdateSerial(pInfo, serial, id);
 
 	/* don't move the cursor when going out-prox */
@@ -690,6 +1018,8 @@ void wcmSendEvents(InputInfoPtr pInfo, const WacomDeviceState* ds)
 		x, y, z, v3, v4, v5, v6, id, serial,
 		is_button ? "true" : "false", ds->buttons);
 
+	WCM_TRACE_PROBE(priv->common, TRACE_SEND);
+
 	/* when entering prox, replace the zeroed-out oldState with a copy of
 	 * the current state to prevent jumps. reset the prox and button state
 	 * to zero to properly detect changes.
@@ -905,13 +1235,15 @@ void wcmEvent(WacomCommonPtr common, unsigned int channel,
 	WacomToolPtr tool;
 	WacomDevicePtr priv;
 	pChannel = common->wcmChannel + channel;
-	pLast = &pChannel->valid.state;
+	pLast = wcmChannelState(pChannel, 0);
 
 	DBG(10, common, "channel = %d\n", channel);
 
 	/* sanity check the channel */
 	if (channel >= MAX_CHANNELS)
 		return;
+
+	WCM_TRACE_PROBE(common, TRACE_EVENT);
 	
 	/* we must copy the state because certain types of filtering
 	 * will need to change the values (ie. for error correction) */
@@ -943,7 +1275,7 @@ void wcmEvent(WacomCommonPtr common, unsigned int channel,
 	/* Tool on the tablet when driver starts. This sometime causes
 	 * access errors to the device */
 	if (!tool->enabled) {
-		LogMessageVerbSigSafe(X_ERROR, 0, "tool not initialized yet. Skipping event. \n");
+		LOG_RATELIMITED(common, X_ERROR, "tool not initialized yet. Skipping event. \n");
 		return;
 	}
 
@@ -969,13 +1301,16 @@ void wcmEvent(WacomCommonPtr common, unsigned int channel,
 		if (!pLast->proximity)
 			wcmResetSampleCounter(pChannel);
 
-		wcmFilterCoord(common,pChannel,&ds);
+		wcmFilterCoord(priv,pChannel,&ds);
 	}
 
 	/* skip event if we don't have enough movement */
 	suppress = wcmCheckSuppress(common, pLast, &ds);
 	if (suppress == SUPPRESS_ALL)
+	{
+		common->wcmEventStats.suppressed++;
 		return;
+	}
 
 	/* JEJ - Do not move this code without discussing it with me.
 	 * The device state is invariant of any filtering performed below.
@@ -984,11 +1319,8 @@ void wcmEvent(WacomCommonPtr common, unsigned int channel,
 	 * unnecessary quantization, and other annoying effects. */
 
 	/* save channel device state and device to which last event went */
-	memmove(pChannel->valid.states + 1,
-		pChannel->valid.states,
-		sizeof(WacomDeviceState) * (common->wcmRawSample - 1));
-	pChannel->valid.state = ds; /*save last raw sample */
-	if (pChannel->nSamples < common->wcmRawSample) ++pChannel->nSamples;
+	wcmChannelPushState(pChannel, &ds); /*save last raw sample */
+	if (pChannel->nSamples < MAX_SAMPLES) ++pChannel->nSamples;
 
 	/* arbitrate pointer control */
 	if (check_arbitrated_control(pInfo, &ds)) {
@@ -1024,6 +1356,161 @@ void wcmEvent(WacomCommonPtr common, unsigned int channel,
 		commonDispatchDevice(pInfo, pChannel, suppress);
 }
 
+/**
+ * Look up the base pressure the pen with the given serial number and end
+ * last rested at.
+ *
+ * @return The raw pressure, or -1 for a pen that is not known.
+ */
+int wcmLookupPenPressure(const WacomCommonPtr common, unsigned int serial,
+			 int device_type)
+{
+	const WacomPenPressure *store = common->wcmPenPressure;
+	int i;
+
+	for (i = 0; i < PRESSURE_STORE_SIZE && store[i].serial; i++)
+		if (store[i].serial == serial && store[i].device_type == device_type)
+			return store[i].pressure;
+
+	return -1;
+}
+
+/**
+ * Remember the base pressure of a pen, dropping the pen that was seen
+ * longest ago if the store is full. Called from the input path, so this
+ * only moves the entries around.
+ */
+void wcmStorePenPressure(WacomCommonPtr common, unsigned int serial,
+			 int device_type, int pressure)
+{
+	WacomPenPressure *store = common->wcmPenPressure;
+	int i;
+
+	/* tools without a serial can't be told apart */
+	if (!serial)
+		return;
+
+	for (i = 0; i < PRESSURE_STORE_SIZE - 1 && store[i].serial; i++)
+		if (store[i].serial == serial && store[i].device_type == device_type)
+			break;
+
+	if (i == 0 && store[0].serial == serial &&
+	    store[0].device_type == device_type && store[0].pressure == pressure)
+		return;
+
+	memmove(&store[1], &store[0], i * sizeof(*store));
+	store[0].serial = serial;
+	store[0].device_type = device_type;
+	store[0].pressure = pressure;
+	common->wcmPenPressureChanged = TRUE;
+}
+
+/**
+ * Read the pen base pressures from the PressureStore file, one pen per line
+ * as serial number, "stylus" or "eraser" and the raw pressure. Lines
+ * starting with '#' are ignored, as is a missing file.
+ */
+void wcmLoadPenPressure(WacomCommonPtr common)
+{
+	char line[128], type[16];
+	unsigned int serial;
+	int pressure, n = 0;
+	FILE *f;
+
+	f = fopen(common->wcmPressureStore, "r");
+	if (!f)
+		return;
+
+	/* the file lists the most recent pen first */
+	while (n < PRESSURE_STORE_SIZE && fgets(line, sizeof(line), f))
+	{
+		WacomPenPressure *pen = &common->wcmPenPressure[n];
+
+		if (line[0] == '#' ||
+		    sscanf(line, "%u %15s %d", &serial, type, &pressure) != 3)
+			continue;
+
+		if (!serial || pressure < 0 ||
+		    (strcmp(type, "stylus") && strcmp(type, "eraser")))
+		{
+			xf86Msg(X_WARNING, "%s: ignoring bad entry in %s: %s",
+				common->device_path, common->wcmPressureStore,
+				line);
+			continue;
+		}
+
+		pen->serial = serial;
+		pen->device_type = strcmp(type, "eraser") ? STYLUS_ID : ERASER_ID;
+		pen->pressure = pressure;
+		n++;
+	}
+
+	fclose(f);
+	xf86Msg(X_CONFIG, "%s: loaded the base pressure of %d pen(s) from %s\n",
+		common->device_path, n, common->wcmPressureStore);
+}
+
+/**
+ * Write the pen base pressures to the PressureStore file if any changed.
+ * A temporary file is moved in place, a crash must not leave half a store
+ * behind.
+ */
+void wcmSavePenPressure(WacomCommonPtr common)
+{
+	WacomPenPressure store[PRESSURE_STORE_SIZE];
+	char *tmp;
+	FILE *f;
+	int i;
+
+	if (!common->wcmPressureStore || !common->wcmPenPressureChanged)
+		return;
+
+	/* the input thread may be storing a pen right now */
+#if HAVE_THREADED_INPUT
+	input_lock();
+#endif
+	memcpy(store, common->wcmPenPressure, sizeof(store));
+	common->wcmPenPressureChanged = FALSE;
+#if HAVE_THREADED_INPUT
+	input_unlock();
+#endif
+
+	if (asprintf(&tmp, "%s.tmp", common->wcmPressureStore) < 0)
+		return;
+
+	f = fopen(tmp, "w");
+	if (!f)
+		goto error;
+
+	fprintf(f, "# serial tool base-pressure, written by the wacom driver\n");
+	for (i = 0; i < PRESSURE_STORE_SIZE && store[i].serial; i++)
+		fprintf(f, "%u %s %d\n", store[i].serial,
+			store[i].device_type == ERASER_ID ? "eraser" : "stylus",
+			store[i].pressure);
+
+	if (fclose(f) || rename(tmp, common->wcmPressureStore))
+		goto error;
+
+	free(tmp);
+	return;
+
+error:
+	xf86Msg(X_WARNING, "%s: failed to write %s: %s\n", common->device_path,
+		common->wcmPressureStore, strerror(errno));
+	unlink(tmp);
+	free(tmp);
+}
+
+/* the press threshold in raw pressure units */
+static int rawThreshold(const WacomDevicePtr priv)
+{
+	WacomCommonPtr common = priv->common;
+
+	if (!priv->maxCurve)
+		return 0;
+
+	return (int64_t)common->wcmThreshold * common->wcmMaxZ / priv->maxCurve;
+}
 
 /**
  * Return the minimum pressure based on the current minimum pressure and the
@@ -1031,7 +1518,11 @@ void wcmEvent(WacomCommonPtr common, unsigned int channel,
  * stylus may have a "pre-loaded" initial pressure. In that case, the tool
  * comes into proximity with a pressure > 0 to begin with and thus offsets
  * the pressure values. This preloaded pressure must be known for pressure
- * normalisation to work.
+ * normalisation to work. A pen that was seen before starts out with the
+ * pressure it last rested at, so pressing it down right away still
+ * registers. One that comes in more than the press threshold above that
+ * may have worn further, so the stored pressure is only taken once the
+ * pressure moves, see updatePressure.
  *
  * @param priv The wacom device
  * @param ds Current device state
@@ -1047,10 +1538,30 @@ rebasePressure(const WacomDevicePtr priv, const WacomDeviceState *ds)
 
 	/* set the minimum pressure when in prox */
 	if (!priv->oldState.proximity)
+	{
+		int known = ds->serial_num ?
+			wcmLookupPenPressure(priv->common, ds->serial_num,
+					     ds->device_type) : -1;
+
 		min_pressure = ds->pressure;
+
+		/* only if it still rests there, a pen that wore further
+		 * would otherwise press while hovering */
+		if (known >= 0 && known < min_pressure &&
+		    min_pressure - known <= rawThreshold(priv))
+			min_pressure = known;
+	}
 	else
+	{
 		min_pressure = min(priv->minPressure, ds->pressure);
 
+		/* A pen resting in proximity gives a steady pressure, one
+		 * that moves was pressed down as it came in */
+		if (priv->basePending &&
+		    abs(ds->pressure - priv->entryPressure) > rawThreshold(priv))
+			min_pressure = min(min_pressure, priv->storedBase);
+	}
+
 	return min_pressure;
 }
 
@@ -1160,6 +1671,13 @@ static void detectPressureIssue(WacomDevicePtr priv,
 				"\tThis indicates a worn out pen, it is time to change your tool. Also see:\n"
 				"\thttp://sourceforge.net/apps/mediawiki/linuxwacom/index.php?title=Pen_Wear.\n",
 				priv->pInfo->name, priv->serial, priv->minPressure, LIMIT_LOW_PRESSURE, common->wcmMaxZ);
+
+		/* long enough in proximity to have rested, remember the
+		 * pen for the next time it comes in */
+		if (IsPen(priv) && priv->eventCnt > MIN_EVENT_COUNT)
+			wcmStorePenPressure(common, priv->oldState.serial_num,
+					    priv->oldState.device_type,
+					    priv->rawMinPressure);
 	} else if (!priv->oldState.proximity)
 		priv->eventCnt = 0;
 
@@ -1167,15 +1685,106 @@ static void detectPressureIssue(WacomDevicePtr priv,
 	priv->eventCnt++;
 }
 
+/**
+ * Rebase, normalise and curve the pressure of a pen or touch state and set
+ * the pressure button of a pen.
+ *
+ * @param priv The wacom device
+ * @param ds The state to update, this is not the stored channel state
+ */
+TEST_NON_STATIC void
+updatePressure(WacomDevicePtr priv, WacomDeviceStatePtr ds)
+{
+	WacomCommonPtr common = priv->common;
+	int prev_min_pressure = priv->oldState.proximity ? priv->minPressure : 0;
+	int raw_pressure;
+
+	detectPressureIssue(priv, common, ds);
+
+	raw_pressure = ds->pressure;
+	if (!priv->oldState.proximity)
+	{
+		int known = ds->serial_num ?
+			wcmLookupPenPressure(common, ds->serial_num,
+					     ds->device_type) : -1;
+
+		priv->minPressure = rebasePressure(priv, ds);
+
+		/* a known pen's base pressure needs no guessing. One that
+		 * comes in above it was pressed down or wore further, see
+		 * rebasePressure */
+		priv->maxRawPressure = raw_pressure;
+		priv->basePending = FALSE;
+		if (known >= 0 && priv->minPressure == known)
+			priv->maxRawPressure = 0;
+		else if (known >= 0 && known < raw_pressure)
+		{
+			priv->basePending = TRUE;
+			priv->storedBase = known;
+			priv->entryPressure = raw_pressure;
+		}
+		priv->rawMinPressure = raw_pressure;
+		wcmSelectToolPressureCurve(priv, ds->serial_num);
+	} else
+	{
+		if (ds->proximity)
+			priv->rawMinPressure = min(priv->rawMinPressure, raw_pressure);
+
+		priv->minPressure = rebasePressure(priv, ds);
+
+		/* a pen that sat still long enough wore further */
+		if (priv->basePending &&
+		    (priv->minPressure <= priv->storedBase ||
+		     priv->eventCnt > MIN_EVENT_COUNT))
+			priv->basePending = FALSE;
+	}
+
+	ds->pressure = normalizePressure(priv, ds->pressure);
+	if (IsPen(priv)) {
+		ds->buttons = setPressureButton(priv, ds->buttons, ds->pressure);
+
+		/* Here we run some heuristics to avoid losing button events if the
+		 * pen gets pushed onto the tablet so quickly that the first pressure
+		 * event read is non-zero and is thus interpreted as a pressure bias */
+		if (ds->buttons & PRESSURE_BUTTON) {
+			/* If we triggered 'normally' reset max pressure to
+			 * avoid to trigger again while this device is in proximity */
+			priv->maxRawPressure = 0;
+		} else if (priv->maxRawPressure) {
+			int norm_max_pressure;
+
+			/* If we haven't triggered normally we record the maximal pressure
+			 * and see if this would have triggered with a lowered bias. */
+			if (priv->maxRawPressure < raw_pressure)
+				priv->maxRawPressure = raw_pressure;
+			norm_max_pressure = normalizePressure(priv, priv->maxRawPressure);
+			ds->buttons = setPressureButton(priv, ds->buttons,
+							norm_max_pressure);
+
+			/* If minPressure is not decrementing any more or a button
+			 * press has been generated or minPressure has just become zero
+			 * reset maxRawPressure to avoid that worn devices
+			 * won't report a button release until going out of proximity */
+			if ((ds->buttons & PRESSURE_BUTTON &&
+			     priv->minPressure == prev_min_pressure) ||
+			    !priv->minPressure)
+				priv->maxRawPressure = 0;
+
+		}
+	}
+	ds->pressure = applyPressureCurve(priv, ds);
+}
+
 static void commonDispatchDevice(InputInfoPtr pInfo,
 				 const WacomChannelPtr pChannel,
 				 enum WacomSuppressMode suppress)
 {
-	WacomDeviceState* ds = &pChannel->valid.states[0];
+	WacomDeviceState* ds = wcmChannelState(pChannel, 0);
 	WacomDevicePtr priv = pInfo->private;
 	WacomCommonPtr common = priv->common;
 	WacomDeviceState filtered;
-	int raw_pressure = 0;
+
+	WCM_TRACE_PROBE(common, TRACE_DEVICE);
 
 	/* device_type should have been retrieved and set in the respective
 	 * models, wcmISDV4.c or wcmUSB.c. Once it comes here, something
@@ -1190,7 +1799,7 @@ static void commonDispatchDevice(InputInfoPtr pInfo,
 
 	DBG(10, common, "device type = %d\n", ds->device_type);
 
-	filtered = pChannel->valid.state;
+	filtered = *ds;
 
 	/* Device transformations come first */
 	if (priv->serial && filtered.serial_num != priv->serial)
@@ -1202,62 +1811,19 @@ static void commonDispatchDevice(InputInfoPtr pInfo,
 	}
 
 	if ((IsPen(priv) || IsTouch(priv)) && common->wcmMaxZ)
-	{
-		int prev_min_pressure = priv->oldState.proximity ? priv->minPressure : 0;
-
-		detectPressureIssue(priv, common, &filtered);
-
-		raw_pressure = filtered.pressure;
-		if (!priv->oldState.proximity)
-			priv->maxRawPressure = raw_pressure;
-
-		priv->minPressure = rebasePressure(priv, &filtered);
-
-		filtered.pressure = normalizePressure(priv, filtered.pressure);
-		if (IsPen(priv)) {
-			filtered.buttons = setPressureButton(priv,
-							     filtered.buttons,
-							     filtered.pressure);
-
-			/* Here we run some heuristics to avoid losing button events if the
-			 * pen gets pushed onto the tablet so quickly that the first pressure
-			 * event read is non-zero and is thus interpreted as a pressure bias */
-			if (filtered.buttons & PRESSURE_BUTTON) {
-				/* If we triggered 'normally' reset max pressure to
-				 * avoid to trigger again while this device is in proximity */
-				priv->maxRawPressure = 0;
-			} else if (priv->maxRawPressure) {
-				int norm_max_pressure;
-
-				/* If we haven't triggered normally we record the maximal pressure
-				 * and see if this would have triggered with a lowered bias. */
-				if (priv->maxRawPressure < raw_pressure)
-					priv->maxRawPressure = raw_pressure;
-				norm_max_pressure = normalizePressure(priv, priv->maxRawPressure);
-				filtered.buttons = setPressureButton(priv, filtered.buttons,
-								     norm_max_pressure);
-
-				/* If minPressure is not decrementing any more or a button
-				 * press has been generated or minPressure has just become zero
-				 * reset maxRawPressure to avoid that worn devices
-				 * won't report a button release until going out of proximity */
-				if ((filtered.buttons & PRESSURE_BUTTON &&
-				     priv->minPressure == prev_min_pressure) ||
-				    !priv->minPressure)
-					priv->maxRawPressure = 0;
-
-			}
-		}
-		filtered.pressure = applyPressureCurve(priv,&filtered);
-	}
+		updatePressure(priv, &filtered);
 
 	/* Store cursor hardware prox for next use */
 	if (IsCursor(priv))
 		priv->oldCursorHwProx = ds->proximity;
 
 	/* User-requested filtering comes next */
+	if (priv->prediction && is_absolute(pInfo) && !IsPad(priv))
+		wcmPredictPosition(priv, pChannel, &filtered);
 
 	/* User-requested transformations come last */
+	if (priv->calibMode != CALIB_NONE && is_absolute(pInfo) && !IsPad(priv))
+		wcmApplyCalibration(priv, &filtered);
 
 	if (!is_absolute(pInfo) && !IsPad(priv))
 	{
@@ -1325,6 +1891,348 @@ static void commonDispatchDevice(InputInfoPtr pInfo,
 	wcmSendEvents(pInfo, &filtered);
 }
 
+static inline unsigned int wcmChannelHash(int device_type, unsigned int serial)
+{
+	return ((serial * 2654435761u) ^ device_type) & CHANNEL_MAP_MASK;
+}
+
+/**
+ * Look up the map entry for a tool.
+ *
+ * @return The index into map->map, or -1 if the tool has no entry.
+ */
+static int wcmChannelMapFind(const WacomChannelMap *map, int device_type,
+			     unsigned int serial)
+{
+	unsigned int i = wcmChannelHash(device_type, serial);
+
+	while (map->map[i].channel)
+	{
+		if (map->map[i].serial == serial &&
+		    map->map[i].device_type == device_type)
+			return i;
+		i = (i + 1) & CHANNEL_MAP_MASK;
+	}
+
+	return -1;
+}
+
+/**
+ * Drop the map entry of a channel. Entries following it in the same
+ * probe sequence are shifted back so lookups never need tombstones.
+ */
+static void wcmChannelUnmap(WacomChannelMap *map, int channel)
+{
+	const WacomChannelKey *key = &map->key[channel];
+	int i, j, k;
+
+	if (!(map->mapped & (1u << channel)))
+		return;
+
+	map->mapped &= ~(1u << channel);
+
+	i = wcmChannelMapFind(map, key->device_type, key->serial);
+	if (i < 0)
+		return;
+
+	for (j = (i + 1) & CHANNEL_MAP_MASK; map->map[j].channel;
+	     j = (j + 1) & CHANNEL_MAP_MASK)
+	{
+		k = wcmChannelHash(map->map[j].device_type,
+				   map->map[j].serial);
+
+		/* entry j stays if its home slot lies cyclically in (i, j] */
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		map->map[i] = map->map[j];
+		i = j;
+	}
+
+	map->map[i].channel = 0;
+}
+
+static void wcmChannelMapAdd(WacomChannelMap *map, int channel, int device_type,
+			     unsigned int serial)
+{
+	WacomChannelKey key = { serial, device_type, channel + 1 };
+	unsigned int i = wcmChannelHash(device_type, serial);
+
+	wcmChannelUnmap(map, channel);
+
+	while (map->map[i].channel)
+		i = (i + 1) & CHANNEL_MAP_MASK;
+
+	map->map[i] = key;
+	map->key[channel] = key;
+	map->mapped |= 1u << channel;
+}
+
+/**
+ * Find a channel that is not in use. Channels without a map entry are
+ * tried first; only when every channel has one do we reclaim the channels
+ * of tools that have since left proximity.
+ */
+static int wcmFindFreeChannel(WacomCommonPtr common)
+{
+	WacomChannelMap *map = &common->wcmChannelMap;
+	unsigned int candidates = ~map->mapped & map->channels;
+	int i, pass;
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		while (candidates)
+		{
+			i = ffs(candidates) - 1;
+			candidates &= ~(1u << i);
+
+			if (!common->wcmChannel[i].work.proximity)
+				return i;
+		}
+
+		for (i = 0; i < MAX_CHANNELS; i++)
+		{
+			if ((map->mapped & (1u << i)) &&
+			    !common->wcmChannel[i].work.proximity)
+				wcmChannelUnmap(map, i);
+		}
+		candidates = ~map->mapped & map->channels;
+	}
+
+	return -1;
+}
+
+/**
+ * @return The current CLOCK_MONOTONIC time in µs. This is the clock the
+ * kernel stamps evdev events with once asked to and the one GetTimeInMillis
+ * reads, so states stamped from either source can be compared.
+ */
+int64_t wcmMonotonicTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* rate limits of the messages not tied to a tablet */
+static WacomLogLimits wcmLogLimitsNoTablet;
+
+static WacomLogLimits *wcmGetLogLimits(WacomCommonPtr common)
+{
+	return common ? &common->wcmLogLimits : &wcmLogLimitsNoTablet;
+}
+
+static void wcmLogSuppressed(WacomCommonPtr common, WacomLogLimit *limit)
+{
+	if (limit->suppressed)
+		LogMessageVerbSigSafe(X_WARNING, 0,
+				      "%s: %s: %u similar messages suppressed\n",
+				      common && common->device_path ?
+				      common->device_path : "wacom",
+				      limit->func, limit->suppressed);
+	limit->suppressed = 0;
+}
+
+/**
+ * Log the number of messages suppressed so far for all call sites of a
+ * tablet, so a burst that stopped is reported too.
+ *
+ * @param common The tablet, or NULL for messages not tied to one
+ */
+void wcmLogLimitFlush(WacomCommonPtr common)
+{
+	WacomLogLimits *limits = wcmGetLogLimits(common);
+	int i;
+
+#if HAVE_THREADED_INPUT
+	input_lock();
+#else
+	int sigstate = xf86BlockSIGIO();
+#endif
+
+	TimerCancel(limits->timer);
+	limits->pending = FALSE;
+	for (i = 0; i < LOG_LIMIT_SITES; i++)
+		wcmLogSuppressed(common, &limits->sites[i]);
+
+#if HAVE_THREADED_INPUT
+	input_unlock();
+#else
+	xf86UnblockSIGIO(sigstate);
+#endif
+}
+
+static CARD32 wcmLogLimitTimer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	wcmLogLimitFlush(arg);
+	return 0;
+}
+
+/**
+ * Decide whether a rate-limited message may be logged, see
+ * LOG_RATELIMITED. The number of messages dropped is logged when the
+ * interval they were dropped in is over.
+ *
+ * @param common The tablet the message is about, or NULL
+ * @param site The call site
+ * @param func Name of the function logging, for the summary
+ * @return TRUE if the message should be logged
+ */
+Bool wcmLogLimit(WacomCommonPtr common, const void *site, const char *func)
+{
+	WacomLogLimits *limits = wcmGetLogLimits(common);
+	WacomLogLimit *limit = NULL;
+	CARD32 now = GetTimeInMillis();
+	int i;
+
+	for (i = 0; i < LOG_LIMIT_SITES; i++)
+	{
+		if (limits->sites[i].site == site)
+		{
+			limit = &limits->sites[i];
+			break;
+		}
+		/* otherwise take a free entry or the one idle longest */
+		if (!limit || (limit->site && (!limits->sites[i].site ||
+		    (int)(limits->sites[i].start - limit->start) < 0)))
+			limit = &limits->sites[i];
+	}
+
+	if (limit->site != site)
+	{
+		wcmLogSuppressed(common, limit);
+		limit->site = site;
+		limit->func = func;
+		limit->count = 0;
+	}
+
+	if (!limit->count || now - limit->start >= LOG_LIMIT_INTERVAL)
+	{
+		wcmLogSuppressed(common, limit);
+		limit->start = now;
+		limit->count = 0;
+	}
+
+	if (limit->count < LOG_LIMIT_BURST)
+	{
+		limit->count++;
+		return TRUE;
+	}
+
+	/* the timer is preallocated, see wcmNewCommon. One already armed
+	 * reports this site too */
+	if (!limit->suppressed++ && !limits->pending && limits->timer)
+	{
+		limits->pending = TRUE;
+		TimerSet(limits->timer, 0, limit->start + LOG_LIMIT_INTERVAL - now,
+			 wcmLogLimitTimer, common);
+	}
+	return FALSE;
+}
+
+/**
+ * Reset a channel for a new tool. Only the work state, the two most recent
+ * history entries and the filter counters are read before the new tool
+ * writes them, so the rest of the history is left alone.
+ */
+static void wcmResetChannel(WacomChannelPtr channel)
+{
+	memset(&channel->work, 0, sizeof(channel->work));
+	memset(wcmChannelState(channel, 0), 0, sizeof(WacomDeviceState));
+	memset(wcmChannelState(channel, 1), 0, sizeof(WacomDeviceState));
+	channel->dirty = 0;
+	channel->nSamples = 0;
+	channel->rawFilter.npoints = 0;
+}
+
+/**
+ * Find an appropriate channel to track the specified tool's state in.
+ * If the tool is already in proximity, the channel currently being used
+ * to store its state will be returned. Otherwise, an arbitrary available
+ * channel will be cleaned and returned. Up to MAX_CHANNEL tools can be
+ * tracked concurrently by driver.
+ *
+ * Channels are looked up through a (device_type, serial) map, so a tool
+ * that comes back into proximity usually gets its previous channel. Only
+ * the channels in common->wcmChannelMap.channels are handed out, backends
+ * that track some tools on fixed channels leave those out.
+ *
+ * @param[in] common
+ * @param[in] device_type  Type of tool (e.g. STYLUS_ID, TOUCH_ID, PAD_ID)
+ * @param[in] serial       Serial number of tool
+ * @return                 Channel number to track the tool's state
+ */
+int wcmChooseChannel(WacomCommonPtr common, int device_type, unsigned int serial)
+{
+	WacomChannelMap *map = &common->wcmChannelMap;
+	WacomDeviceState *ds;
+	int i, channel;
+
+	/* force events from PAD device to PAD_CHANNEL */
+	if (serial == -1)
+		return PAD_CHANNEL;
+
+	/* find existing channel */
+	i = wcmChannelMapFind(map, device_type, serial);
+	if (i >= 0)
+	{
+		channel = map->map[i].channel - 1;
+		ds = &common->wcmChannel[channel].work;
+
+		if (ds->proximity &&
+		    ds->device_type == device_type &&
+		    ds->serial_num == serial)
+			return channel;
+
+		/* tool left proximity since, reuse its old channel */
+		if (!ds->proximity)
+		{
+			wcmResetChannel(&common->wcmChannel[channel]);
+			return channel;
+		}
+
+		/* the channel was taken over by another tool */
+		wcmChannelUnmap(map, channel);
+	}
+
+	/* find and clean an empty channel */
+	channel = wcmFindFreeChannel(common);
+	if (channel >= 0)
+	{
+		wcmResetChannel(&common->wcmChannel[channel]);
+		wcmChannelMapAdd(map, channel, device_type, serial);
+		return channel;
+	}
+
+	/* fresh out of channels */
+
+	/* This should never happen in normal use.
+	 * Let's start over again. Force prox-out for all channels.
+	 */
+	for (i=0; i<MAX_CHANNELS; i++)
+	{
+		if (!(map->channels & (1u << i)))
+			continue;
+
+		if (common->wcmChannel[i].work.proximity &&
+		    (common->wcmChannel[i].work.serial_num != -1))
+		{
+			common->wcmChannel[i].work.proximity = 0;
+			/* dispatch event */
+			wcmEvent(common, i, &common->wcmChannel[i].work);
+			DBG(2, common, "free channels: dropping %u\n",
+					common->wcmChannel[i].work.serial_num);
+		}
+	}
+	common->wcmEventStats.no_channel++;
+	DBG(1, common, "device with serial number: %u"
+	    " at %d: Exceeded channel count; ignoring the events.\n",
+	    serial, (int)GetTimeInMillis());
+
+	return -1;
+}
+
 /*****************************************************************************
  * wcmInitTablet -- common initialization for all tablets
  ****************************************************************************/
@@ -1398,16 +2306,28 @@ void wcmSoftOutEvent(InputInfoPtr pInfo)
  */
 static int applyPressureCurve(WacomDevicePtr pDev, const WacomDeviceStatePtr pState)
 {
+	const WacomPressureCurve *curve = pDev->pPressCurve;
 	/* clip the pressure */
 	int p = max(0, pState->pressure);
 
 	p = min(pDev->maxCurve, p);
 
+	/* the curve of the tool in proximity wins over the device's */
+	if (pDev->pToolCurve)
+		curve = pDev->pToolCurve->curve;
+
 	/* apply pressure curve function */
-	if (pDev->pPressCurve == NULL)
+	if (curve == NULL)
 		return p;
+	else if (curve->max != pDev->maxCurve)
+	{
+		/* tool curves span the full pressure resolution */
+		p = (int64_t)p * curve->max / pDev->maxCurve;
+		return (int64_t)wcmApplyPressureCurve(curve, p) *
+			pDev->maxCurve / curve->max;
+	}
 	else
-		return pDev->pPressCurve[p];
+		return wcmApplyPressureCurve(curve, p);
 }
 
 /*****************************************************************************
@@ -1419,10 +2339,14 @@ void wcmRotateTablet(InputInfoPtr pInfo, int value)
 	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
 	WacomCommonPtr common = priv->common;
 	WacomToolPtr tool;
+	WacomDevicePtr other;
 
 	DBG(10, priv, "\n");
 	common->wcmRotate = value;
 
+	for (other = common->wcmDevices; other; other = other->next)
+		wcmUpdateTransform(other->pInfo);
+
 	/* Only try updating properties once we're enabled, no point
 	 * otherwise. */
 	tool = priv->tool;
@@ -1468,7 +2392,14 @@ WacomCommonPtr wcmNewCommon(void)
 			/* transmit position if increment is superior */
 	common->wcmRawSample = DEFAULT_SAMPLES;
 			/* number of raw data to be used to for filtering */
+	common->wcmChannelMap.channels = WCM_CHANNELS;
+			/* all but the pad channel */
 	common->wcmPressureRecalibration = 1;
+
+	/* no allocations on the input path, see wcmLogLimit */
+	common->wcmLogLimits.timer = TimerSet(NULL, 0, 0, NULL, NULL);
+	if (!wcmLogLimitsNoTablet.timer)
+		wcmLogLimitsNoTablet.timer = TimerSet(NULL, 0, 0, NULL, NULL);
 	return common;
 }
 
@@ -1497,6 +2428,9 @@ void wcmFreeCommon(WacomCommonPtr *ptr)
 			free(common->serials);
 			common->serials = next;
 		}
+		wcmFreeCurveProfiles(common);
+		TimerFree(common->wcmLogLimits.timer);
+		free(common->wcmPressureStore);
 		free(common->device_path);
 #if GET_ABI_MAJOR(ABI_XINPUT_VERSION) >= 16
 		free(common->touch_mask);
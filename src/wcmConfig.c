@@ -68,6 +68,11 @@ static int wcmAllocate(InputInfoPtr pInfo)
 	priv->nPressCtrl [1] = 0;    /* pressure curve y0 */
 	priv->nPressCtrl [2] = 100;  /* pressure curve x1 */
 	priv->nPressCtrl [3] = 100;  /* pressure curve y1 */
+	priv->nPressCtrlCount = 4;
+	wcmSetFilterMode(priv, FILTER_AVERAGE); /* coordinate filter */
+	priv->calibMatrix[0] = 1 << WCM_TRANSFORM_SHIFT; /* identity calibration */
+	priv->calibMatrix[4] = 1 << WCM_TRANSFORM_SHIFT;
+	priv->calibMatrix[8] = 1 << WCM_TRANSFORM_SHIFT;
 
 	/* Default button and expresskey values, offset buttons 4 and higher
 	 * by the 4 scroll buttons. */
@@ -102,6 +107,7 @@ static int wcmAllocate(InputInfoPtr pInfo)
 	priv->serial_timer = TimerSet(NULL, 0, 0, NULL, NULL);
 	priv->tap_timer = TimerSet(NULL, 0, 0, NULL, NULL);
 	priv->touch_timer = TimerSet(NULL, 0, 0, NULL, NULL);
+	priv->init_timer = TimerSet(NULL, 0, 0, NULL, NULL);
 
 	return 1;
 
@@ -120,6 +126,7 @@ error:
 static void wcmFree(InputInfoPtr pInfo)
 {
 	WacomDevicePtr priv = pInfo->private;
+	int i;
 
 	if (!priv)
 		return;
@@ -127,6 +134,14 @@ static void wcmFree(InputInfoPtr pInfo)
 	TimerFree(priv->serial_timer);
 	TimerFree(priv->tap_timer);
 	TimerFree(priv->touch_timer);
+	TimerFree(priv->init_timer);
+	wcmReleasePressureCurve(priv->pPressCurve);
+	for (i = 0; i < ARRAY_SIZE(priv->btn_prog); i++)
+		wcmReleaseAction(priv->btn_prog[i]);
+	for (i = 0; i < ARRAY_SIZE(priv->strip_prog); i++)
+		wcmReleaseAction(priv->strip_prog[i]);
+	for (i = 0; i < ARRAY_SIZE(priv->wheel_prog); i++)
+		wcmReleaseAction(priv->wheel_prog[i]);
 	free(priv->tool);
 	wcmFreeCommon(&priv->common);
 	free(priv);
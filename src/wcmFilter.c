@@ -29,12 +29,16 @@
  * Static functions
  ****************************************************************************/
 
-static void filterCurveToLine(int* pCurve, int nMax, double x0, double y0,
-		double x1, double y1, double x2, double y2,
-		double x3, double y3);
+static void filterCurveToLine(WacomPressureCurve *curve, int nMax, int depth,
+		double x0, double y0, double x1, double y1,
+		double x2, double y2, double x3, double y3);
 static int filterOnLine(double x0, double y0, double x1, double y1,
 		double a, double b);
-static void filterLine(int* pCurve, int nMax, int x0, int y0, int x1, int y1);
+static void filterKnotsToLine(WacomPressureCurve *curve, int nMax,
+		const int *ctrl, int n);
+
+/* curves in use, shared between devices */
+static WacomPressureCurve *pressureCurves;
 
 
 /*****************************************************************************
@@ -47,47 +51,300 @@ int wcmCheckPressureCurveValues(int x0, int y0, int x1, int y1)
 		 (x1 < 0) || (x1 > 100) || (y1 < 0) || (y1 > 100));
 }
 
+/**
+ * Check a pressure curve given either as the Bezier control points
+ * x1,y1,x2,y2 or as 3 to PRESSURE_CURVE_KNOTS points x,y the curve passes
+ * through. All values are in the range 0..100, the points' x must ascend
+ * and their y must not descend.
+ */
+Bool wcmCheckPressureCurve(const int *ctrl, int n)
+{
+	int i;
+
+	if (n == 4)
+		return wcmCheckPressureCurveValues(ctrl[0], ctrl[1],
+						   ctrl[2], ctrl[3]);
+
+	if (n < 6 || n > 2 * PRESSURE_CURVE_KNOTS || n % 2)
+		return FALSE;
+
+	for (i = 0; i < n; i++)
+		if (ctrl[i] < 0 || ctrl[i] > 100)
+			return FALSE;
+
+	for (i = 2; i < n; i += 2)
+		if (ctrl[i] <= ctrl[i - 2] || ctrl[i + 1] < ctrl[i - 1])
+			return FALSE;
+
+	return TRUE;
+}
+
+
+/**
+ * Find a curve with the given control points (see wcmCheckPressureCurve)
+ * for the given pressure range or build a new one. The curve is flattened
+ * into at most PRESSURE_CURVE_POINTS corners, which wcmApplyPressureCurve
+ * interpolates between the same way the old full-range table was
+ * rasterized.
+ *
+ * @return The curve with a reference taken, or NULL on allocation failure.
+ */
+static WacomPressureCurve *wcmGetPressureCurve(int max, const int *ctrl, int n)
+{
+	WacomPressureCurve *curve;
+
+	for (curve = pressureCurves; curve; curve = curve->next)
+	{
+		if (curve->max == max && curve->nctrl == n &&
+		    !memcmp(curve->ctrl, ctrl, n * sizeof(*ctrl)))
+		{
+			curve->refs++;
+			return curve;
+		}
+	}
+
+	curve = calloc(1, sizeof(*curve));
+	if (!curve)
+		return NULL;
+
+	curve->refs = 1;
+	curve->max = max;
+	curve->nctrl = n;
+	memcpy(curve->ctrl, ctrl, n * sizeof(*ctrl));
+	if (n == 4)
+		filterCurveToLine(curve, max, 0,
+				0.0, 0.0,                       /* bottom left  */
+				ctrl[0]/100.0, ctrl[1]/100.0,   /* control point 1 */
+				ctrl[2]/100.0, ctrl[3]/100.0,   /* control point 2 */
+				1.0, 1.0);                      /* top right */
+	else
+		filterKnotsToLine(curve, max, ctrl, n);
+
+	curve->next = pressureCurves;
+	pressureCurves = curve;
+
+	return curve;
+}
+
+/* Drop a reference to a curve, freeing it with the last one */
+void wcmReleasePressureCurve(WacomPressureCurve *curve)
+{
+	WacomPressureCurve **prev;
+
+	if (!curve || --curve->refs > 0)
+		return;
+
+	for (prev = &pressureCurves; *prev; prev = &(*prev)->next)
+	{
+		if (*prev == curve)
+		{
+			*prev = curve->next;
+			break;
+		}
+	}
+	free(curve);
+}
+
+/**
+ * Map a pressure in the range 0..curve->max through the curve. The
+ * polyline's segments are rasterized like Bresenham's algorithm does it,
+ * so steep segments give the highest value of the column.
+ */
+int wcmApplyPressureCurve(const WacomPressureCurve *curve, int p)
+{
+	const int *x = curve->x, *y = curve->y;
+	int lo = 0, hi = curve->npoints - 2;
+	int64_t dx, dy;
+	int v;
+
+	/* last segment that starts at or before p */
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) / 2;
+
+		if (x[mid] <= p)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	dx = x[lo + 1] - x[lo];
+	dy = y[lo + 1] - y[lo];
+	if (dx <= 0)
+		return y[lo + 1];
+
+	if (dy <= dx)
+		return y[lo] + ((p - x[lo]) * dy * 2 + dx) / (2 * dx);
+
+	v = y[lo] + ((2 * (p - x[lo]) + 1) * dy + 2 * dx - 1) / (2 * dx) - 1;
+	return min(v, y[lo + 1]);
+}
 
 /*****************************************************************************
- * wcmSetPressureCurve -- apply user-defined curve to pressure values
+ * wcmSetPressureCurvePoints -- apply user-defined curve to pressure values,
+ * in either form wcmCheckPressureCurve accepts
  ****************************************************************************/
-void wcmSetPressureCurve(WacomDevicePtr pDev, int x0, int y0,
-	int x1, int y1)
+void wcmSetPressureCurvePoints(WacomDevicePtr pDev, const int *ctrl, int n)
 {
+	static const int linear[4] = { 0, 0, 100, 100 };
+	WacomPressureCurve *curve = NULL, *old;
+
 	/* sanity check values */
-	if (!wcmCheckPressureCurveValues(x0, y0, x1, y1))
+	if (!wcmCheckPressureCurve(ctrl, n))
 		return;
 
 	/* A NULL pPressCurve indicates the (default) linear curve */
-	if (x0 == 0 && y0 == 0 && x1 == 100 && y1 == 100) {
-		free(pDev->pPressCurve);
-		pDev->pPressCurve = NULL;
-	}
-	else if (!pDev->pPressCurve) {
-		pDev->pPressCurve = calloc(FILTER_PRESSURE_RES+1, sizeof(*pDev->pPressCurve));
+	if (n != 4 || memcmp(ctrl, linear, sizeof(linear))) {
+		curve = wcmGetPressureCurve(pDev->maxCurve, ctrl, n);
 
-		if (!pDev->pPressCurve) {
+		if (!curve) {
 			LogMessageVerbSigSafe(X_WARNING, 0,
 			                      "Unable to allocate memory for pressure curve; using default.\n");
-			x0 = 0;
-			y0 = 0;
-			x1 = 100;
-			y1 = 100;
+			ctrl = linear;
+			n = 4;
+		}
+	}
+
+	/* the input thread may be applying the old curve */
+#if HAVE_THREADED_INPUT
+	input_lock();
+#endif
+	old = pDev->pPressCurve;
+	pDev->pPressCurve = curve;
+#if HAVE_THREADED_INPUT
+	input_unlock();
+#endif
+	wcmReleasePressureCurve(old);
+
+	memcpy(pDev->nPressCtrl, ctrl, n * sizeof(*ctrl));
+	pDev->nPressCtrlCount = n;
+}
+
+/*****************************************************************************
+ * wcmSetPressureCurve -- apply user-defined Bezier curve to pressure values
+ ****************************************************************************/
+void wcmSetPressureCurve(WacomDevicePtr pDev, int x0, int y0,
+	int x1, int y1)
+{
+	int ctrl[4] = { x0, y0, x1, y1 };
+
+	wcmSetPressureCurvePoints(pDev, ctrl, 4);
+}
+
+/**
+ * Set the pressure curve of the tool with the given serial number, in
+ * either form wcmCheckPressureCurve accepts. Whenever the tool is in
+ * proximity it overrides the curve of whichever device of the tablet it
+ * drives. A curve of no values removes the tool's curve again.
+ *
+ * Curves are built for the full FILTER_PRESSURE_RES range here, so
+ * switching tools never needs to build one.
+ *
+ * @return FALSE if the curve is not valid or memory ran out.
+ */
+Bool wcmSetToolPressureCurve(WacomCommonPtr common, unsigned int serial,
+			     const int *ctrl, int n)
+{
+	static const int linear[4] = { 0, 0, 100, 100 };
+	WacomCurveProfile **prev, *profile;
+	WacomPressureCurve *curve = NULL, *old;
+	WacomDevicePtr priv;
+
+	for (prev = &common->wcmCurveProfiles; *prev; prev = &(*prev)->next)
+		if ((*prev)->serial == serial)
+			break;
+	profile = *prev;
+
+	if (n == 0)
+	{
+		if (!profile)
+			return TRUE;
+
+#if HAVE_THREADED_INPUT
+		input_lock();
+#endif
+		*prev = profile->next;
+		for (priv = common->wcmDevices; priv; priv = priv->next)
+			if (priv->pToolCurve == profile)
+				priv->pToolCurve = NULL;
+#if HAVE_THREADED_INPUT
+		input_unlock();
+#endif
+		wcmReleasePressureCurve(profile->curve);
+		free(profile);
+		return TRUE;
+	}
+
+	if (!wcmCheckPressureCurve(ctrl, n))
+		return FALSE;
+
+	if (n != 4 || memcmp(ctrl, linear, sizeof(linear)))
+	{
+		curve = wcmGetPressureCurve(FILTER_PRESSURE_RES, ctrl, n);
+		if (!curve)
+			return FALSE;
+	}
+
+	if (!profile)
+	{
+		profile = calloc(1, sizeof(*profile));
+		if (!profile)
+		{
+			wcmReleasePressureCurve(curve);
+			return FALSE;
 		}
+		profile->serial = serial;
 	}
 
-	if (pDev->pPressCurve)
-		filterCurveToLine(pDev->pPressCurve,
-				pDev->maxCurve,
-				0.0, 0.0,               /* bottom left  */
-				x0/100.0, y0/100.0,     /* control point 1 */
-				x1/100.0, y1/100.0,     /* control point 2 */
-				1.0, 1.0);              /* top right */
-
-	pDev->nPressCtrl[0] = x0;
-	pDev->nPressCtrl[1] = y0;
-	pDev->nPressCtrl[2] = x1;
-	pDev->nPressCtrl[3] = y1;
+	/* the input thread may be applying the old curve */
+#if HAVE_THREADED_INPUT
+	input_lock();
+#endif
+	if (!*prev)
+		*prev = profile;
+	old = profile->curve;
+	profile->curve = curve;
+
+	/* a tool already in proximity switches right away */
+	for (priv = common->wcmDevices; priv; priv = priv->next)
+		if (priv->oldState.proximity &&
+		    priv->oldState.serial_num == serial)
+			priv->pToolCurve = profile;
+#if HAVE_THREADED_INPUT
+	input_unlock();
+#endif
+	wcmReleasePressureCurve(old);
+
+	return TRUE;
+}
+
+/**
+ * Pick the curve of the tool that just came into proximity, or the
+ * device's own curve if the tool has none. Called from the input path, so
+ * this only looks the tool up.
+ */
+void wcmSelectToolPressureCurve(WacomDevicePtr priv, unsigned int serial)
+{
+	WacomCurveProfile *profile;
+
+	for (profile = priv->common->wcmCurveProfiles; profile; profile = profile->next)
+		if (profile->serial == serial)
+			break;
+
+	priv->pToolCurve = profile;
+}
+
+/* Free all tool curves of a tablet that is going away */
+void wcmFreeCurveProfiles(WacomCommonPtr common)
+{
+	while (common->wcmCurveProfiles)
+	{
+		WacomCurveProfile *next = common->wcmCurveProfiles->next;
+
+		wcmReleasePressureCurve(common->wcmCurveProfiles->curve);
+		free(common->wcmCurveProfiles);
+		common->wcmCurveProfiles = next;
+	}
 }
 
 /*
@@ -143,19 +400,28 @@ static int filterOnLine(double x0, double y0, double x1, double y1,
 	return d < 0.00001; /* within 100th of a point (1E-2 squared) */
 }
 
-static void filterCurveToLine(int* pCurve, int nMax, double x0, double y0,
-		double x1, double y1, double x2, double y2,
-		double x3, double y3)
+static void filterCurveToLine(WacomPressureCurve *curve, int nMax, int depth,
+		double x0, double y0, double x1, double y1,
+		double x2, double y2, double x3, double y3)
 {
 	double x01,y01,x32,y32,xm,ym;
 	double c1,d1,c2,d2,e,f;
 
 	/* check if control points are on line */
-	if (filterOnLine(x0,y0,x3,y3,x1,y1) && filterOnLine(x0,y0,x3,y3,x2,y2))
+	if (depth == PRESSURE_CURVE_DEPTH ||
+	    (filterOnLine(x0,y0,x3,y3,x1,y1) && filterOnLine(x0,y0,x3,y3,x2,y2)))
 	{
-		filterLine(pCurve,nMax,
-			(int)(x0*nMax),(int)(y0*nMax),
-			(int)(x3*nMax),(int)(y3*nMax));
+		/* segments are added left to right, each starts where the
+		 * previous one ended */
+		if (!curve->npoints)
+		{
+			curve->x[0] = (int)(x0*nMax);
+			curve->y[0] = (int)(y0*nMax);
+			curve->npoints++;
+		}
+		curve->x[curve->npoints] = (int)(x3*nMax);
+		curve->y[curve->npoints] = (int)(y3*nMax);
+		curve->npoints++;
 		return;
 	}
 
@@ -172,150 +438,390 @@ static void filterCurveToLine(int* pCurve, int nMax, double x0, double y0,
 	e = (c1 + c2) / 2; f = (d1 + d2) / 2;
 
 	/* do each side */
-	filterCurveToLine(pCurve,nMax,x0,y0,x01,y01,c1,d1,e,f);
-	filterCurveToLine(pCurve,nMax,e,f,c2,d2,x32,y32,x3,y3);
+	filterCurveToLine(curve,nMax,depth+1,x0,y0,x01,y01,c1,d1,e,f);
+	filterCurveToLine(curve,nMax,depth+1,e,f,c2,d2,x32,y32,x3,y3);
 }
 
-static void filterLine(int* pCurve, int nMax, int x0, int y0, int x1, int y1)
+static void filterAddPoint(WacomPressureCurve *curve, int nMax,
+		double x, double y)
 {
-	int dx, dy, ax, ay, sx, sy, x, y, d;
+	curve->x[curve->npoints] = (int)(x*nMax);
+	curve->y[curve->npoints] = (int)(y*nMax);
+	curve->npoints++;
+}
 
-	/* sanity check */
-	if ((x0 < 0) || (y0 < 0) || (x1 < 0) || (y1 < 0) ||
-		(x0 > nMax) || (y0 > nMax) || (x1 > nMax) || (y1 > nMax))
-		return;
+/**
+ * Flatten a monotone cubic through the given points. The tangents follow
+ * Fritsch and Carlson, which keeps every piece between two points from
+ * overshooting them, so the curve never descends. Before the first and
+ * after the last point the curve stays flat.
+ */
+static void filterKnotsToLine(WacomPressureCurve *curve, int nMax,
+		const int *ctrl, int n)
+{
+	double x[PRESSURE_CURVE_KNOTS], y[PRESSURE_CURVE_KNOTS];
+	double m[PRESSURE_CURVE_KNOTS], d[PRESSURE_CURVE_KNOTS];
+	int k = n / 2;
+	/* leave room for both flat ends */
+	int steps = (PRESSURE_CURVE_POINTS - 3) / (k - 1);
+	int i, j;
+
+	for (i = 0; i < k; i++)
+	{
+		x[i] = ctrl[2 * i] / 100.0;
+		y[i] = ctrl[2 * i + 1] / 100.0;
+	}
 
-	dx = x1 - x0; ax = abs(dx) * 2; sx = (dx>0) ? 1 : -1;
-	dy = y1 - y0; ay = abs(dy) * 2; sy = (dy>0) ? 1 : -1;
-	x = x0; y = y0;
+	/* secants, and tangents averaged from them */
+	for (i = 0; i < k - 1; i++)
+		d[i] = (y[i + 1] - y[i]) / (x[i + 1] - x[i]);
+	m[0] = d[0];
+	m[k - 1] = d[k - 2];
+	for (i = 1; i < k - 1; i++)
+		m[i] = (d[i - 1] == 0 || d[i] == 0) ? 0 : (d[i - 1] + d[i]) / 2;
 
-	/* x dominant */
-	if (ax > ay)
+	/* limit the tangents where they would overshoot */
+	for (i = 0; i < k - 1; i++)
 	{
-		d = ay - ax / 2;
-		while (1)
+		double a, b, s;
+
+		if (d[i] == 0)
+		{
+			m[i] = m[i + 1] = 0;
+			continue;
+		}
+
+		a = m[i] / d[i];
+		b = m[i + 1] / d[i];
+		s = a * a + b * b;
+		if (s > 9)
 		{
-			pCurve[x] = y;
-			if (x == x1) break;
-			if (d >= 0)
-			{
-				y += sy;
-				d -= ax;
-			}
-			x += sx;
-			d += ay;
+			s = 3 / sqrt(s);
+			m[i] = s * a * d[i];
+			m[i + 1] = s * b * d[i];
 		}
 	}
 
-	/* y dominant */
-	else
+	filterAddPoint(curve, nMax, 0.0, y[0]);
+	if (x[0] > 0)
+		filterAddPoint(curve, nMax, x[0], y[0]);
+
+	for (i = 0; i < k - 1; i++)
 	{
-		d = ax - ay / 2;
-		while (1)
+		double h = x[i + 1] - x[i];
+
+		for (j = 1; j <= steps; j++)
 		{
-			pCurve[x] = y;
-			if (y == y1) break;
-			if (d >= 0)
-			{
-				x += sx;
-				d -= ay;
-			}
-			y += sy;
-			d += ax;
+			double t = (double)j / steps;
+			double t2 = t * t, t3 = t2 * t;
+			double v = (2 * t3 - 3 * t2 + 1) * y[i] +
+				   (t3 - 2 * t2 + t) * h * m[i] +
+				   (-2 * t3 + 3 * t2) * y[i + 1] +
+				   (t3 - t2) * h * m[i + 1];
+
+			filterAddPoint(curve, nMax, x[i] + t * h,
+				       min(max(v, y[i]), y[i + 1]));
 		}
 	}
+
+	if (x[k - 1] < 1)
+		filterAddPoint(curve, nMax, 1.0, y[k - 1]);
 }
-static void storeRawSample(WacomCommonPtr common, WacomChannelPtr pChannel,
+
+/**
+ * Add a sample to the channel's averaging window. The window is a ring of
+ * the last wcmRawSample samples with running sums, so neither storing a
+ * sample nor averaging depends on the window size. A fresh window (or one
+ * whose size changed) is filled with the sample.
+ */
+static void storeRawSample(WacomCommonPtr common, WacomFilterState *fs,
 			   WacomDeviceStatePtr ds)
 {
-	WacomFilterState *fs;
+	int n = common->wcmRawSample;
 	int i;
 
-	fs = &pChannel->rawFilter;
-	if (!fs->npoints)
+	if (!fs->npoints || fs->window != n)
 	{
 		DBG(10, common, "initialize channel data.\n");
 		/* Store initial value over whole average window */
-		for (i=common->wcmRawSample - 1; i>=0; i--)
+		for (i=n - 1; i>=0; i--)
 		{
 			fs->x[i]= ds->x;
 			fs->y[i]= ds->y;
+			fs->tiltx[i] = ds->tiltx;
+			fs->tilty[i] = ds->tilty;
 		}
-		if (HANDLE_TILT(common) && (ds->device_type == STYLUS_ID ||
-					    ds->device_type == ERASER_ID))
-		{
-			for (i=common->wcmRawSample - 1; i>=0; i--)
-			{
-				fs->tiltx[i] = ds->tiltx;
-				fs->tilty[i] = ds->tilty;
-			}
-		}
-		++fs->npoints;
+		fs->sum_x = n * ds->x;
+		fs->sum_y = n * ds->y;
+		fs->sum_tiltx = n * ds->tiltx;
+		fs->sum_tilty = n * ds->tilty;
+		fs->pos = n - 1;
+		fs->window = n;
+		fs->npoints = 1;
 	} else {
-		/* Shift window and insert latest sample */
-		for (i=common->wcmRawSample - 1; i>0; i--)
-		{
-			fs->x[i]= fs->x[i-1];
-			fs->y[i]= fs->y[i-1];
-		}
-		fs->x[0] = ds->x;
-		fs->y[0] = ds->y;
-		if (HANDLE_TILT(common) && (ds->device_type == STYLUS_ID ||
-					    ds->device_type == ERASER_ID))
-		{
-			for (i=common->wcmRawSample - 1; i>0; i--)
-			{
-				fs->tiltx[i]= fs->tiltx[i-1];
-				fs->tilty[i]= fs->tilty[i-1];
-			}
-			fs->tiltx[0] = ds->tiltx;
-			fs->tilty[0] = ds->tilty;
-		}
-		if (fs->npoints < common->wcmRawSample)
+		/* Replace the oldest sample in the window with the latest */
+		i = (fs->pos + 1) % n;
+		fs->sum_x += ds->x - fs->x[i];
+		fs->sum_y += ds->y - fs->y[i];
+		fs->sum_tiltx += ds->tiltx - fs->tiltx[i];
+		fs->sum_tilty += ds->tilty - fs->tilty[i];
+		fs->x[i] = ds->x;
+		fs->y[i] = ds->y;
+		fs->tiltx[i] = ds->tiltx;
+		fs->tilty[i] = ds->tilty;
+		fs->pos = i;
+		if (fs->npoints < n)
 			++fs->npoints;
 	}
 }
 
 /*****************************************************************************
- * wcmFilterCoord -- provide noise correction to all transducers
+ * Coordinate filter engines
  ****************************************************************************/
 
-int wcmFilterCoord(WacomCommonPtr common, WacomChannelPtr pChannel,
-	WacomDeviceStatePtr ds)
+#define FILTER_DEFAULT_DT 0.005	/* assumed sample interval in s, 200Hz */
+#define ONE_EURO_DCUTOFF 1.0	/* cutoff for the velocity estimate, in Hz */
+
+/* box average over the last RawSample samples */
+static void filterAverage(WacomDevicePtr priv, WacomFilterState *fs,
+			  WacomDeviceStatePtr ds, Bool tilt, double dt)
 {
-	int x=0, y=0, tx=0, ty=0, i;
-	WacomFilterState *state;
+	WacomCommonPtr common = priv->common;
 
-	DBG(10, common, "common->wcmRawSample = %d \n", common->wcmRawSample);
+	storeRawSample(common, fs, ds);
 
-	storeRawSample(common, pChannel, ds);
+	ds->x = fs->sum_x / common->wcmRawSample;
+	ds->y = fs->sum_y / common->wcmRawSample;
 
-	state = &pChannel->rawFilter;
+	if (tilt)
+	{
+		ds->tiltx = fs->sum_tiltx / common->wcmRawSample;
+		ds->tilty = fs->sum_tilty / common->wcmRawSample;
+	}
+}
+
+static double oneEuroAlpha(double cutoff, double dt)
+{
+	double tau = 1.0 / (2 * M_PI * cutoff);
+
+	return 1.0 / (1.0 + tau / dt);
+}
+
+/**
+ * 1 euro filter: a low-pass filter whose cutoff rises with speed, so the
+ * position is smoothed heavily at rest and barely lags during fast
+ * strokes.
+ *
+ * params[0] is the cutoff at rest in 1/100 Hz, params[1] the cutoff
+ * increase in 1/100 Hz per axis range/s of speed.
+ */
+static double filterOneEuroAxis(const int *params, WacomFilterAxis *axis,
+				double value, double range, Bool fresh,
+				double dt)
+{
+	double velocity, cutoff;
 
-	for ( i=0; i<common->wcmRawSample; i++ )
+	if (fresh)
 	{
-		x += state->x[i];
-		y += state->y[i];
-		if (HANDLE_TILT(common) && (ds->device_type == STYLUS_ID ||
-					    ds->device_type == ERASER_ID))
-		{
-			tx += state->tiltx[i];
-			ty += state->tilty[i];
-		}
+		axis->value = value;
+		axis->velocity = 0;
+		return value;
 	}
-	ds->x = x / common->wcmRawSample;
-	ds->y = y / common->wcmRawSample;
 
-	if (HANDLE_TILT(common) && (ds->device_type == STYLUS_ID ||
-				    ds->device_type == ERASER_ID))
+	velocity = (value - axis->value) / dt;
+	axis->velocity += oneEuroAlpha(ONE_EURO_DCUTOFF, dt) *
+			  (velocity - axis->velocity);
+
+	cutoff = (params[0] + params[1] * fabs(axis->velocity) / range) / 100.0;
+	axis->value += oneEuroAlpha(cutoff, dt) * (value - axis->value);
+
+	return axis->value;
+}
+
+/**
+ * Kalman filter with a constant velocity model and random acceleration.
+ *
+ * params[0] is the measurement noise sigma in 1/100000 of the axis range,
+ * params[1] the acceleration sigma in 1/1000 axis range/s^2.
+ */
+static double filterKalmanAxis(const int *params, WacomFilterAxis *axis,
+			       double value, double range, Bool fresh,
+			       double dt)
+{
+	double r = params[0] * range / 100000.0;
+	double q = params[1] * range / 1000.0;
+	double *P = axis->cov;
+	double s, k0, k1, residual;
+
+	r *= r;
+	q *= q;
+
+	if (fresh)
+	{
+		axis->value = value;
+		axis->velocity = 0;
+		P[0] = r;
+		P[1] = 0;
+		P[2] = range * range;
+		return value;
+	}
+
+	/* predict */
+	axis->value += axis->velocity * dt;
+	P[0] += dt * (2 * P[1] + dt * P[2]) + q * dt * dt * dt * dt / 4;
+	P[1] += dt * P[2] + q * dt * dt * dt / 2;
+	P[2] += q * dt * dt;
+
+	/* update */
+	s = P[0] + r;
+	k0 = P[0] / s;
+	k1 = P[1] / s;
+	residual = value - axis->value;
+	axis->value += k0 * residual;
+	axis->velocity += k1 * residual;
+	P[2] -= k1 * P[1];
+	P[1] *= 1 - k0;
+	P[0] *= 1 - k0;
+
+	return axis->value;
+}
+
+typedef double (*WacomFilterAxisFunc)(const int *params, WacomFilterAxis *axis,
+				      double value, double range, Bool fresh,
+				      double dt);
+
+/* run a per-axis filter over x/y and, if requested, tilt */
+static void filterAxes(WacomDevicePtr priv, WacomFilterState *fs,
+		       WacomDeviceStatePtr ds, Bool tilt, double dt,
+		       WacomFilterAxisFunc func)
+{
+	WacomCommonPtr common = priv->common;
+	int *values[FILTER_AXES] = { &ds->x, &ds->y, &ds->tiltx, &ds->tilty };
+	int range[FILTER_AXES] = {
+		common->wcmMaxX - common->wcmMinX,
+		common->wcmMaxY - common->wcmMinY,
+		common->wcmTiltMaxX - common->wcmTiltMinX,
+		common->wcmTiltMaxY - common->wcmTiltMinY,
+	};
+	Bool fresh = !fs->npoints;
+	int i;
+
+	for (i = 0; i < (tilt ? FILTER_AXES : 2); i++)
+		*values[i] = lround(func(priv->filterParams, &fs->axis[i],
+					 *values[i], max(range[i], 1),
+					 fresh, dt));
+
+	fs->npoints = 1;
+}
+
+static void filterOneEuro(WacomDevicePtr priv, WacomFilterState *fs,
+			  WacomDeviceStatePtr ds, Bool tilt, double dt)
+{
+	filterAxes(priv, fs, ds, tilt, dt, filterOneEuroAxis);
+}
+
+static void filterKalman(WacomDevicePtr priv, WacomFilterState *fs,
+			 WacomDeviceStatePtr ds, Bool tilt, double dt)
+{
+	filterAxes(priv, fs, ds, tilt, dt, filterKalmanAxis);
+}
+
+typedef struct {
+	const char *name;	/* name used by the "Filter" option */
+	int params[2];		/* default parameters */
+	/* filter ds in place, fs->npoints is 0 on a fresh start */
+	void (*Filter)(WacomDevicePtr priv, WacomFilterState *fs,
+		       WacomDeviceStatePtr ds, Bool tilt, double dt);
+} WacomFilterEngine;
+
+static const WacomFilterEngine filterEngines[FILTER_MODES] = {
+	[FILTER_AVERAGE]  = { "average", { 0, 0 }, filterAverage },
+	[FILTER_ONE_EURO] = { "1euro", { 100, 2500 }, filterOneEuro },
+	[FILTER_KALMAN]   = { "kalman", { 30, 30000 }, filterKalman },
+};
+
+/**
+ * Look up a coordinate filter by the name used in the configuration.
+ *
+ * @return The filter mode or -1 if the name is unknown.
+ */
+int wcmFilterModeFromName(const char *name)
+{
+	int i;
+
+	for (i = 0; i < FILTER_MODES; i++)
+		if (!xf86NameCmp(name, filterEngines[i].name))
+			return i;
+
+	return -1;
+}
+
+/**
+ * Check the parameters of a coordinate filter. The 1 euro filter stops
+ * following the tool with a zero cutoff at rest and the Kalman filter
+ * divides by zero without measurement noise.
+ *
+ * @return TRUE if the filter can run with these parameters.
+ */
+Bool wcmCheckFilterParams(enum WacomFilterMode mode, const int *params)
+{
+	if (params[0] < 0 || params[1] < 0)
+		return FALSE;
+
+	if (mode != FILTER_AVERAGE && params[0] == 0)
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * Select the coordinate filter of a tool, with the filter's default
+ * parameters.
+ */
+void wcmSetFilterMode(WacomDevicePtr priv, enum WacomFilterMode mode)
+{
+	priv->filterMode = mode;
+	priv->filterParams[0] = filterEngines[mode].params[0];
+	priv->filterParams[1] = filterEngines[mode].params[1];
+}
+
+/*****************************************************************************
+ * wcmFilterCoord -- provide noise correction to all transducers
+ ****************************************************************************/
+
+int wcmFilterCoord(WacomDevicePtr priv, WacomChannelPtr pChannel,
+	WacomDeviceStatePtr ds)
+{
+	WacomCommonPtr common = priv->common;
+	WacomFilterState *state = &pChannel->rawFilter;
+	Bool tilt = HANDLE_TILT(common) && (ds->device_type == STYLUS_ID ||
+					    ds->device_type == ERASER_ID);
+	double dt;
+
+	DBG(10, common, "filter = %s, common->wcmRawSample = %d \n",
+	    filterEngines[priv->filterMode].name, common->wcmRawSample);
+
+	/* start over when the filter was switched */
+	if (state->mode != priv->filterMode)
+	{
+		state->mode = priv->filterMode;
+		state->npoints = 0;
+	}
+
+	dt = (ds->time_us - state->time) / 1000000.0;
+	if (!state->npoints || dt <= 0)
+		dt = FILTER_DEFAULT_DT;
+	state->time = ds->time_us;
+
+	filterEngines[priv->filterMode].Filter(priv, state, ds, tilt, dt);
+
+	if (tilt)
 	{
-		ds->tiltx = tx / common->wcmRawSample;
 		if (ds->tiltx > common->wcmTiltMaxX)
 			ds->tiltx = common->wcmTiltMaxX;
 		else if (ds->tiltx < common->wcmTiltMinX)
 			ds->tiltx = common->wcmTiltMinX;
 
-		ds->tilty = ty / common->wcmRawSample;
 		if (ds->tilty > common->wcmTiltMaxY)
 			ds->tilty = common->wcmTiltMaxY;
 		else if (ds->tilty < common->wcmTiltMinY)
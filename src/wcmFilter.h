@@ -24,10 +24,21 @@
 
 /****************************************************************************/
 
+Bool wcmCheckPressureCurve(const int *ctrl, int n);
 void wcmSetPressureCurve(WacomDevicePtr pDev, int x0, int y0,
 	int x1, int y1);
-int wcmFilterCoord(WacomCommonPtr common, WacomChannelPtr pChannel,
+void wcmSetPressureCurvePoints(WacomDevicePtr pDev, const int *ctrl, int n);
+Bool wcmSetToolPressureCurve(WacomCommonPtr common, unsigned int serial,
+	const int *ctrl, int n);
+void wcmSelectToolPressureCurve(WacomDevicePtr priv, unsigned int serial);
+void wcmFreeCurveProfiles(WacomCommonPtr common);
+void wcmReleasePressureCurve(WacomPressureCurve *curve);
+int wcmApplyPressureCurve(const WacomPressureCurve *curve, int p);
+int wcmFilterCoord(WacomDevicePtr priv, WacomChannelPtr pChannel,
 	WacomDeviceStatePtr ds);
+int wcmFilterModeFromName(const char *name);
+void wcmSetFilterMode(WacomDevicePtr priv, enum WacomFilterMode mode);
+Bool wcmCheckFilterParams(enum WacomFilterMode mode, const int *params);
 void wcmResetSampleCounter(const WacomChannelPtr pChannel);
 
 /****************************************************************************/
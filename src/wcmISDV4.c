@@ -28,6 +28,9 @@
 #include "isdv4.h"
 #include <unistd.h>
 #include <fcntl.h>
+#include <ctype.h>
+#include <limits.h>
+#include <strings.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -55,15 +58,52 @@
    have one model).
 
    5. isdv4InitISDV4 - do whatever device-specific init is necessary
-   6. isdv4GetRanges - Query axis ranges
+   6. isdv4GetRanges - Query axis ranges, see isdv4RunInit
 
    --- end of PreInit ---
 
    isdv4StartTablet is called in DEVICE_ON
-   isdv4Parse is called during ReadInput.
+   isdv4ReadPacket is called during ReadInput.
+
+   The STOP/QUERY/SAMPLING handshake with the tablet is a state machine
+   (see isdv4InitInput and isdv4InitTimeout) that never waits on the
+   tablet itself. During PreInit isdv4RunInit pumps it since the axis
+   ranges are needed to set up the device. When the devices are enabled
+   again (VT switch, resume) it runs from the read callback and
+   priv->init_timer, so the server carries on while the tablet answers.
 
  */
 
+#ifndef ISDV4_CACHE_DIR
+#define ISDV4_CACHE_DIR "/var/cache/xf86-input-wacom"
+#endif
+#define ISDV4_CACHE_VERSION 1
+
+/* delay for the tablet to settle after STOP, in ms */
+#define ISDV4_STOP_DELAY	250
+/* time for the tablet to answer a query, in ms */
+#define ISDV4_QUERY_TIMEOUT	1000
+
+/* state of the init handshake */
+enum ISDV4InitState {
+	ISDV4_INIT_IDLE,
+	ISDV4_INIT_STOP,        /* STOP sent, waiting for the line to settle */
+	ISDV4_INIT_QUERY,       /* waiting for the pen query reply */
+	ISDV4_INIT_TOUCH_QUERY, /* waiting for the touch query reply */
+	ISDV4_INIT_DONE,
+	ISDV4_INIT_FAILED,
+};
+
+/* The query replies as stored in the cache file, see isdv4LoadCache */
+typedef struct {
+	char magic[4];
+	int version;
+	int baudrate;               /* baud rate the tablet answered at */
+	int touch;                  /* touch_reply is valid */
+	unsigned char reply[ISDV4_PKGLEN_TPCCTL];
+	unsigned char touch_reply[ISDV4_PKGLEN_TPCCTL];
+} ISDV4QueryCache;
+
 typedef struct {
 	/* Counter for dependent devices. We can only send one QUERY command to
 	   the tablet and we must not send the SAMPLING command until the last
@@ -72,6 +112,29 @@ typedef struct {
 	/* QUERY can only be run once */
 	int tablet_initialized;
 	int baudrate;
+	/* packet framer, see isdv4Frame */
+	unsigned char pktlen[128];  /* packet length by header byte & 0x7f */
+	int framed;                 /* bytes of the buffered partial packet
+				       already checked */
+	/* init handshake, see isdv4InitInput */
+	enum ISDV4InitState init_state;
+	InputInfoPtr init_pInfo;    /* device running the handshake */
+	Bool init_async;            /* driven by the read callback and
+				       init_timer, ends with SAMPLING */
+	int init_baud;              /* baud rate being tried */
+	int init_tries;             /* queries left at init_baud */
+	CARD32 init_deadline;       /* timeout of the current state */
+	unsigned char reply[ISDV4_PKGLEN_TPCCTL]; /* control packet so far */
+	int replylen;
+	/* query replies, kept on disk across restarts */
+	ISDV4QueryCache query;
+	Bool use_cache;
+	Bool cached;                /* ranges came from the cache and still
+				       need to be checked with the tablet */
+	char cache_path[PATH_MAX];  /* empty if there's no cache */
+	int64_t time;               /* CLOCK_MONOTONIC µs of the current read */
+	const ISDV4TouchLayout *layout; /* touch packet layout */
+	unsigned int touching;      /* bitmask of contacts down */
 } wcmISDV4Data;
 
 static Bool isdv4Detect(InputInfoPtr);
@@ -81,11 +144,10 @@ static int isdv4ProbeKeys(InputInfoPtr pInfo);
 static void isdv4InitISDV4(WacomCommonPtr, const char* id, float version);
 static int isdv4GetRanges(InputInfoPtr);
 static int isdv4StartTablet(InputInfoPtr);
-static int isdv4StopTablet(InputInfoPtr);
-static int isdv4Parse(InputInfoPtr, const unsigned char* data, int len);
-static int wcmSerialValidate(InputInfoPtr pInfo, const unsigned char* data);
-static int wcmWaitForTablet(InputInfoPtr pInfo, char * data, int size);
+static Bool isdv4ReadPacket(InputInfoPtr pInfo);
+static void isdv4StopTablet(InputInfoPtr pInfo);
 static int wcmWriteWait(InputInfoPtr pInfo, const char* request);
+static Bool get_sysfs_id(InputInfoPtr pInfo, char *buf, int buf_size);
 
 	WacomDeviceClass gWacomISDV4Device =
 	{
@@ -102,8 +164,10 @@ static int wcmWriteWait(InputInfoPtr pInfo, const char* request);
 		NULL,                 /* resolution not queried */
 		isdv4GetRanges,       /* query ranges */
 		isdv4StartTablet,     /* start tablet */
-		isdv4Parse,
+		NULL,                 /* framed by isdv4ReadPacket */
 		NULL,
+		isdv4ReadPacket,
+		isdv4StopTablet,
 	};
 
 static void memdump(InputInfoPtr pInfo, char *buffer, unsigned int len)
@@ -127,72 +191,6 @@ static void memdump(InputInfoPtr pInfo, char *buffer, unsigned int len)
 }
 
 
-static int wcmWait(int t)
-{
-	int err = xf86WaitForInput(-1, ((t) * 1000));
-	if (err != -1)
-		return Success;
-
-	xf86Msg(X_ERROR, "Wacom select error : %s\n", strerror(errno));
-	return err;
-}
-
-/*****************************************************************************
- * wcmSkipInvalidBytes - returns the number of bytes to skip if the first
- * byte of data does not denote a valid header byte.
- * The ISDV protocol requires that the first byte of a new packet has the
- * HEADER_BIT set and subsequent packets do not.
- ****************************************************************************/
-static int wcmSkipInvalidBytes(const unsigned char* data, int len)
-{
-	int n = 0;
-
-	while(n < len && !(data[n] & HEADER_BIT))
-		n++;
-
-	return n;
-}
-
-
-
-/*****************************************************************************
- * wcmSerialValidate -- validates serial packet; returns 0 on success,
- *   positive number of bytes to skip on error.
- ****************************************************************************/
-
-static int wcmSerialValidate(InputInfoPtr pInfo, const unsigned char* data)
-{
-	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
-	WacomCommonPtr common = priv->common;
-
-	int n;
-
-	/* First byte must have header bit set, if not, skip until next
-	 * header byte */
-	if (!(data[0] & HEADER_BIT))
-	{
-		n = wcmSkipInvalidBytes(data, common->wcmPktLength);
-		LogMessageVerbSigSafe(X_WARNING, 0,
-			"%s: missing header bit. skipping %d bytes.\n",
-			pInfo->name, n);
-		return n;
-	}
-
-	/* Remainder must _not_ have header bit set, if not, skip to first
-	 * header byte. wcmSkipInvalidBytes gives us the number of bytes
-	 * without the header bit set, so use the next one.
-	 */
-	n = wcmSkipInvalidBytes(&data[1], common->wcmPktLength - 1);
-	n += 1; /* the header byte we already checked */
-	if (n != common->wcmPktLength) {
-		LogMessageVerbSigSafe(X_WARNING, 0, "%s: bad data at %d v=%x l=%d\n", pInfo->name,
-			n, data[n], common->wcmPktLength);
-		return n;
-	}
-
-	return 0;
-}
-
 /*****************************************************************************
  * isdv4Detect -- Test if the attached device is ISDV4.
  ****************************************************************************/
@@ -250,6 +248,8 @@ static Bool isdv4ParseOptions(InputInfoPtr pInfo)
 		isdv4data->baudrate = baud;
 		isdv4data->tablet_initialized = 0;
 		isdv4data->initialized_devices = 0;
+		isdv4data->init_state = ISDV4_INIT_IDLE;
+		isdv4data->use_cache = xf86SetBoolOption(pInfo->options, "QueryCache", TRUE);
 	}
 
 	return TRUE;
@@ -284,41 +284,6 @@ static Bool isdv4Init(InputInfoPtr pInfo, char* id, size_t id_len, float *versio
 	return Success;
 }
 
-/*****************************************************************************
- * isdv4Query -- Query the device
- ****************************************************************************/
-
-static int isdv4Query(InputInfoPtr pInfo, const char* query, char* data)
-{
-#ifdef DEBUG
-	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
-#endif
-
-	DBG(1, priv, "Querying ISDV4 tablet\n");
-
-	if (isdv4StopTablet(pInfo) != Success)
-		return !Success;
-
-	/* Send query command to the tablet */
-	if (!wcmWriteWait(pInfo, query))
-		return !Success;
-
-	/* Read the control data */
-	if (!wcmWaitForTablet(pInfo, data, ISDV4_PKGLEN_TPCCTL))
-		return !Success;
-
-	/* Control data bit check */
-	if ( !(data[0] & 0x40) )
-	{
-		/* Reread the control data since it may fail the first time */
-		wcmWaitForTablet(pInfo, data, ISDV4_PKGLEN_TPCCTL);
-		if ( !(data[0] & 0x40) )
-			return !Success;
-	}
-
-	return Success;
-}
-
 /*****************************************************************************
  * isdv4InitISDV4 -- Setup the device
  ****************************************************************************/
@@ -335,224 +300,688 @@ static void isdv4InitISDV4(WacomCommonPtr common, const char* id, float version)
 
 	/* tilt disabled */
 	common->wcmFlags &= ~TILT_ENABLED_FLAG;
+
+	/* the pen stays on channel 0, touch contacts are looked up */
+	common->wcmChannelMap.channels &= ~1u;
 }
 
 /*****************************************************************************
- * isdv4GetRanges -- get ranges of the device
+ * isdv4SetRanges -- take the pen ranges from a query reply
  ****************************************************************************/
 
-static int isdv4GetRanges(InputInfoPtr pInfo)
+static Bool isdv4SetRanges(InputInfoPtr pInfo, unsigned char *data)
 {
-	char data[BUFFER_SIZE];
 	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
 	WacomCommonPtr common =	priv->common;
 	wcmISDV4Data *isdv4data = common->private;
-	int ret = Success;
+	ISDV4QueryReply reply;
+	int rc;
 
-	DBG(2, priv, "getting ISDV4 Ranges\n");
+	rc = isdv4ParseQuery(data, ISDV4_PKGLEN_TPCCTL, &reply);
+	if (rc <= 0)
+	{
+		xf86Msg(X_ERROR, "%s: Error while parsing ISDV4 query.\n",
+				pInfo->name);
+		if (rc == 0)
+			DBG(2, common, "reply or len invalid.\n");
+		else
+			DBG(2, common, "header data corrupt.\n");
+		memdump(pInfo, (char*)data, ISDV4_PKGLEN_TPCCTL);
+		return FALSE;
+	}
 
-	if (isdv4data->tablet_initialized)
-		goto out;
+	/* transducer data */
+	common->wcmMaxZ = reply.pressure_max;
+	common->wcmMaxX = reply.x_max;
+	common->wcmMaxY = reply.y_max;
+	if (reply.tilt_x_max && reply.tilt_y_max)
+	{
+		common->wcmTiltOffX = 0 - reply.tilt_x_max / 2;
+		common->wcmTiltFactX = 1.0;
+		common->wcmTiltMinX = 0 + common->wcmTiltOffX;
+		common->wcmTiltMaxX = reply.tilt_x_max +
+				      common->wcmTiltOffX;
+
+		common->wcmTiltOffY = 0 - reply.tilt_y_max / 2;
+		common->wcmTiltFactY = 1.0;
+		common->wcmTiltMinY = 0 + common->wcmTiltOffY;
+		common->wcmTiltMaxY = reply.tilt_y_max +
+				      common->wcmTiltOffY;
+
+		common->wcmFlags |= TILT_ENABLED_FLAG;
+	}
 
-	/* Set baudrate to configured value */
-	if (xf86SetSerialSpeed(pInfo->fd, isdv4data->baudrate) < 0)
+	common->wcmVersion = reply.version;
+
+	/* default to no pen 2FGT if size is undefined */
+	if (!common->wcmMaxX || !common->wcmMaxY)
+		common->tablet_id = 0xE2;
+
+	DBG(2, priv, "Pen speed=%d "
+		"maxX=%d maxY=%d maxZ=%d resX=%d resY=%d \n",
+		isdv4data->init_baud, common->wcmMaxX, common->wcmMaxY,
+		common->wcmMaxZ, common->wcmResolX, common->wcmResolY);
+
+	return TRUE;
+}
+
+/*****************************************************************************
+ * isdv4SetTouchRanges -- take the touch ranges from a touch query reply
+ ****************************************************************************/
+
+static Bool isdv4SetTouchRanges(InputInfoPtr pInfo, unsigned char *data)
+{
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	WacomCommonPtr common =	priv->common;
+	wcmISDV4Data *isdv4data = common->private;
+	const ISDV4TouchLayout *layout;
+	ISDV4TouchQueryReply reply;
+	int rc;
+
+	rc = isdv4ParseTouchQuery(data, ISDV4_PKGLEN_TPCCTL, &reply);
+	if (rc <= 0)
 	{
-		ret = !Success;
-		goto out;
+		xf86Msg(X_ERROR, "%s: Error while parsing ISDV4 touch query.\n",
+				pInfo->name);
+		if (rc == 0)
+			DBG(2, common, "reply or len invalid.\n");
+		else
+			DBG(2, common, "header data corrupt.\n");
+		memdump(pInfo, (char*)data, ISDV4_PKGLEN_TPCCTL);
+		return FALSE;
 	}
 
-	/* Send query command to the tablet */
-	ret = isdv4Query(pInfo, ISDV4_QUERY, data);
-	if (ret != Success)
+	layout = isdv4TouchLayout(reply.sensor_id);
+	if (!layout)
 	{
-		int baud;
+		/* the tablet id from sysfs is all we know */
+		xf86Msg(X_WARNING, "%s: unknown touch sensor id 0x%x\n",
+			pInfo->name, reply.sensor_id);
+		layout = isdv4TouchLayoutByTablet(common->tablet_id);
+	}
+	/* multi-touch sensors only tell a penabled tablet apart, a
+	 * touch-only one keeps its id */
+	else if (layout->contacts == 1 || common->tablet_id == 0x90)
+		common->tablet_id = layout->tablet_id;
 
-		/* Try with the other baudrate */
-		baud = (isdv4data->baudrate == 38400)? 19200 : 38400;
+	isdv4data->layout = layout;
+	common->wcmPktLength = layout->pktlen;
+	common->wcmMaxContacts = min(layout->contacts, MAX_FINGERS);
 
-		xf86Msg(X_WARNING, "%s: Query failed with %d baud. Trying %d.\n",
-				   pInfo->name, isdv4data->baudrate, baud);
+	switch(reply.data_id)
+	{
+			/* single finger touch */
+		case 0x01:
+			if ((common->tablet_id != 0x93) &&
+				(common->tablet_id != 0x9A) &&
+				(common->tablet_id != 0x9F))
 
-		if (xf86SetSerialSpeed(pInfo->fd, baud) < 0)
-		{
-			ret = !Success;
-			goto out;
-		}
+			{
+			    xf86Msg(X_WARNING, "%s: tablet id(%x)"
+				    " mismatch with data id (0x01) \n",
+				    pInfo->name, common->tablet_id);
+			    return TRUE;
+			}
+			break;
+			/* 2FGT */
+		case 0x03:
+			if ((common->tablet_id != 0xE2) &&
+					(common->tablet_id != 0xE3))
+			{
+			    xf86Msg(X_WARNING, "%s: tablet id(%x)"
+				    " mismatch with data id (0x03) \n",
+				    pInfo->name, common->tablet_id);
+			    return TRUE;
+			}
+			break;
+	}
+
+	/* don't overwrite the default */
+	if (reply.x_max | reply.y_max)
+	{
+		common->wcmMaxTouchX = reply.x_max;
+		common->wcmMaxTouchY = reply.y_max;
+	}
+	else if (reply.panel_resolution)
+		common->wcmMaxTouchX = common->wcmMaxTouchY =
+			(1 << reply.panel_resolution);
 
-		ret = isdv4Query(pInfo, ISDV4_QUERY, data);
+	if (reply.panel_resolution)
+		common->wcmTouchResolX = common->wcmTouchResolY = ISDV4_TOUCH_RESOLUTION;
 
-		if (ret == Success) {
-			isdv4data->baudrate = baud;
-			/* xf86OpenSerial() takes the baud rate from the options */
-			xf86ReplaceIntOption(pInfo->options, "BaudRate", baud);
-		}
+	common->wcmVersion = reply.version;
+
+	DBG(2, priv, "touch speed=%d "
+		"maxTouchX=%d maxTouchY=%d TouchresX=%d TouchresY=%d \n",
+		isdv4data->init_baud, common->wcmMaxTouchX,
+		common->wcmMaxTouchY, common->wcmTouchResolX,
+		common->wcmTouchResolY);
+
+	return TRUE;
+}
 
+static CARD32 isdv4InitTimer(OsTimerPtr timer, CARD32 now, pointer arg);
+static void isdv4InitFinish(wcmISDV4Data *isdv4data, Bool success);
+
+/* set the deadline of the current handshake state */
+static void isdv4InitArm(wcmISDV4Data *isdv4data, CARD32 delay)
+{
+	InputInfoPtr pInfo = isdv4data->init_pInfo;
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+
+	isdv4data->init_deadline = GetTimeInMillis() + delay;
+	if (isdv4data->init_async)
+		priv->init_timer = TimerSet(priv->init_timer, 0, delay,
+					    isdv4InitTimer, pInfo);
+}
+
+/*****************************************************************************
+ * isdv4InitStop -- (re)start the init handshake at the given baud rate:
+ * stop the tablet and give it ISDV4_STOP_DELAY to settle. Whatever it
+ * sends in the meantime is dropped by isdv4InitInput.
+ ****************************************************************************/
+
+static void isdv4InitStop(wcmISDV4Data *isdv4data, int baud)
+{
+	InputInfoPtr pInfo = isdv4data->init_pInfo;
+
+	isdv4data->init_state = ISDV4_INIT_STOP;
+	isdv4data->init_baud = baud;
+	isdv4data->init_tries = MAXTRY;
+
+	if (xf86SetSerialSpeed(pInfo->fd, baud) < 0)
+	{
+		isdv4InitFinish(isdv4data, FALSE);
+		return;
 	}
 
-	if (ret == Success)
+	/* a failed write shows up as a query timeout */
+	wcmWriteWait(pInfo, ISDV4_STOP);
+	isdv4InitArm(isdv4data, ISDV4_STOP_DELAY);
+}
+
+/*****************************************************************************
+ * isdv4InitQuery -- send a query and wait for the reply
+ ****************************************************************************/
+
+static void isdv4InitQuery(wcmISDV4Data *isdv4data, enum ISDV4InitState state)
+{
+	InputInfoPtr pInfo = isdv4data->init_pInfo;
+
+	isdv4data->init_state = state;
+	isdv4data->replylen = 0;
+
+	wcmWriteWait(pInfo, (state == ISDV4_INIT_QUERY) ?
+			    ISDV4_QUERY : ISDV4_TOUCH_QUERY);
+	isdv4InitArm(isdv4data, ISDV4_QUERY_TIMEOUT);
+}
+
+/*****************************************************************************
+ * isdv4InitFinish -- end the handshake. An asynchronous handshake starts
+ * the tablet either way, it may just have missed our queries.
+ ****************************************************************************/
+
+static void isdv4InitFinish(wcmISDV4Data *isdv4data, Bool success)
+{
+	InputInfoPtr pInfo = isdv4data->init_pInfo;
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+
+	TimerCancel(priv->init_timer);
+	isdv4data->init_state = success ? ISDV4_INIT_DONE : ISDV4_INIT_FAILED;
+
+	if (!success)
 	{
-		ISDV4QueryReply reply;
-		int rc;
+		LogMessageVerbSigSafe(X_WARNING, 0,
+				      "%s: tablet did not answer the query.\n",
+				      pInfo->name);
+		xf86SetSerialSpeed(pInfo->fd, isdv4data->baudrate);
+	}
+	else if (isdv4data->init_baud != isdv4data->baudrate)
+	{
+		isdv4data->baudrate = isdv4data->init_baud;
+		/* xf86OpenSerial() takes the baud rate from the options,
+		 * which can't be touched from the input thread */
+		if (!isdv4data->init_async)
+			xf86ReplaceIntOption(pInfo->options, "BaudRate",
+					     isdv4data->baudrate);
+	}
 
-		rc = isdv4ParseQuery((unsigned char*)data, sizeof(data), &reply);
-		if (rc <= 0)
-		{
-			xf86Msg(X_ERROR, "%s: Error while parsing ISDV4 query.\n",
-					pInfo->name);
-			if (rc == 0)
-				DBG(2, common, "reply or len invalid.\n");
-			else
-				DBG(2, common, "header data corrupt.\n");
-			memdump(pInfo, data, sizeof(reply));
-			ret = BadAlloc;
-			goto out;
-		}
+	if (isdv4data->init_async)
+		wcmWriteWait(pInfo, ISDV4_SAMPLING);
+}
 
-		/* transducer data */
-		common->wcmMaxZ = reply.pressure_max;
-		common->wcmMaxX = reply.x_max;
-		common->wcmMaxY = reply.y_max;
-		if (reply.tilt_x_max && reply.tilt_y_max)
-		{
-			common->wcmTiltOffX = 0 - reply.tilt_x_max / 2;
-			common->wcmTiltFactX = 1.0;
-			common->wcmTiltMinX = 0 + common->wcmTiltOffX;
-			common->wcmTiltMaxX = reply.tilt_x_max +
-					      common->wcmTiltOffX;
-
-			common->wcmTiltOffY = 0 - reply.tilt_y_max / 2;
-			common->wcmTiltFactY = 1.0;
-			common->wcmTiltMinY = 0 + common->wcmTiltOffY;
-			common->wcmTiltMaxY = reply.tilt_y_max +
-					      common->wcmTiltOffY;
-
-			common->wcmFlags |= TILT_ENABLED_FLAG;
-		}
+/*****************************************************************************
+ * isdv4InitStale -- the tablet answered differently than during PreInit
+ ****************************************************************************/
+
+static void isdv4InitStale(wcmISDV4Data *isdv4data)
+{
+	InputInfoPtr pInfo = isdv4data->init_pInfo;
+
+	LogMessageVerbSigSafe(X_WARNING, 0,
+			      "%s: tablet ranges changed, restart the "
+			      "device to apply them.\n", pInfo->name);
+	if (isdv4data->cache_path[0])
+		unlink(isdv4data->cache_path);
+}
+
+/*****************************************************************************
+ * isdv4InitTimeout -- the deadline of the current handshake state passed
+ ****************************************************************************/
+
+static void isdv4InitTimeout(wcmISDV4Data *isdv4data)
+{
+	InputInfoPtr pInfo = isdv4data->init_pInfo;
+	int baud;
 
-		common->wcmVersion = reply.version;
+	switch (isdv4data->init_state)
+	{
+		case ISDV4_INIT_STOP:
+			isdv4InitQuery(isdv4data, ISDV4_INIT_QUERY);
+			break;
+		case ISDV4_INIT_QUERY:
+			if (--isdv4data->init_tries)
+			{
+				isdv4InitQuery(isdv4data, ISDV4_INIT_QUERY);
+				break;
+			}
+			if (isdv4data->init_baud != isdv4data->baudrate)
+			{
+				isdv4InitFinish(isdv4data, FALSE);
+				break;
+			}
 
-		/* default to no pen 2FGT if size is undefined */
-		if (!common->wcmMaxX || !common->wcmMaxY)
-			common->tablet_id = 0xE2;
+			/* Try with the other baudrate */
+			baud = (isdv4data->baudrate == 38400)? 19200 : 38400;
 
-		DBG(2, priv, "Pen speed=%d "
-			"maxX=%d maxY=%d maxZ=%d resX=%d resY=%d \n",
-			isdv4data->baudrate, common->wcmMaxX, common->wcmMaxY,
-			common->wcmMaxZ, common->wcmResolX, common->wcmResolY);
+			LogMessageVerbSigSafe(X_WARNING, 0,
+					      "%s: Query failed with %d baud. Trying %d.\n",
+					      pInfo->name, isdv4data->baudrate, baud);
+			isdv4InitStop(isdv4data, baud);
+			break;
+		case ISDV4_INIT_TOUCH_QUERY:
+			/* no touch sensor, but there was one before */
+			if (isdv4data->init_async)
+			{
+				isdv4InitStale(isdv4data);
+				isdv4data->cached = FALSE;
+			}
+			isdv4InitFinish(isdv4data, TRUE);
+			break;
+		default:
+			break;
 	}
+}
 
-	/* Touch might be supported. Send a touch query command */
-	if (isdv4data->baudrate == 38400 &&
-	    isdv4Query(pInfo, ISDV4_TOUCH_QUERY, data) == Success)
+static CARD32 isdv4InitTimer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	InputInfoPtr pInfo = arg;
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	wcmISDV4Data *isdv4data = priv->common->private;
+
+#if HAVE_THREADED_INPUT
+	input_lock();
+#else
+	int sigstate = xf86BlockSIGIO();
+#endif
+
+	if (isdv4data->init_pInfo == pInfo)
+		isdv4InitTimeout(isdv4data);
+
+#if HAVE_THREADED_INPUT
+	input_unlock();
+#else
+	xf86UnblockSIGIO(sigstate);
+#endif
+
+	return 0;
+}
+
+/*****************************************************************************
+ * isdv4InitReply -- a complete control packet arrived
+ ****************************************************************************/
+
+static void isdv4InitReply(wcmISDV4Data *isdv4data)
+{
+	InputInfoPtr pInfo = isdv4data->init_pInfo;
+	Bool ok;
+
+	isdv4data->replylen = 0;
+
+	/* a stray header byte means we caught the tail of something else */
+	if (!isdv4ValidPacket(isdv4data->reply, ISDV4_PKGLEN_TPCCTL))
+		return;
+
+	/* the ranges are only taken during PreInit, once the axes are
+	 * set up a reply just tells us the tablet is back. If the ranges
+	 * came from the cache, this is where we find out it's stale. */
+	if (isdv4data->init_async)
 	{
-		ISDV4TouchQueryReply reply;
-		int rc;
+		Bool pen = (isdv4data->init_state == ISDV4_INIT_QUERY);
 
-		rc = isdv4ParseTouchQuery((unsigned char*)data, sizeof(data), &reply);
-		if (rc <= 0)
+		if (memcmp(isdv4data->reply, pen ? isdv4data->query.reply :
+						   isdv4data->query.touch_reply,
+			   ISDV4_PKGLEN_TPCCTL))
+			isdv4InitStale(isdv4data);
+		else if (pen && isdv4data->query.touch)
 		{
-			xf86Msg(X_ERROR, "%s: Error while parsing ISDV4 touch query.\n",
-					pInfo->name);
-			if (rc == 0)
-				DBG(2, common, "reply or len invalid.\n");
-			else
-				DBG(2, common, "header data corrupt.\n");
-			memdump(pInfo, data, sizeof(reply));
-			ret = BadAlloc;
-			goto out;
+			isdv4InitQuery(isdv4data, ISDV4_INIT_TOUCH_QUERY);
+			return;
 		}
+		isdv4data->cached = FALSE;
+		isdv4InitFinish(isdv4data, TRUE);
+		return;
+	}
+
+	if (isdv4data->init_state == ISDV4_INIT_QUERY)
+	{
+		memcpy(isdv4data->query.reply, isdv4data->reply, ISDV4_PKGLEN_TPCCTL);
+		ok = isdv4SetRanges(pInfo, isdv4data->reply);
+		/* Touch might be supported. Send a touch query command */
+		if (ok && isdv4data->init_baud == 38400)
+			isdv4InitQuery(isdv4data, ISDV4_INIT_TOUCH_QUERY);
+		else
+			isdv4InitFinish(isdv4data, ok);
+	} else
+	{
+		memcpy(isdv4data->query.touch_reply, isdv4data->reply, ISDV4_PKGLEN_TPCCTL);
+		isdv4data->query.touch = 1;
+		isdv4InitFinish(isdv4data,
+				isdv4SetTouchRanges(pInfo, isdv4data->reply));
+	}
+}
+
+static Bool isdv4InitPending(wcmISDV4Data *isdv4data)
+{
+	return isdv4data->init_state == ISDV4_INIT_STOP ||
+	       isdv4data->init_state == ISDV4_INIT_QUERY ||
+	       isdv4data->init_state == ISDV4_INIT_TOUCH_QUERY;
+}
+
+/*****************************************************************************
+ * isdv4InitInput -- feed data read during the handshake. Everything but
+ * the control packet answering the pending query is dropped.
+ ****************************************************************************/
 
-		switch (reply.sensor_id)
+static void isdv4InitInput(wcmISDV4Data *isdv4data, const unsigned char *data, int len)
+{
+	int n;
+
+	while (len > 0 && (isdv4data->init_state == ISDV4_INIT_QUERY ||
+			   isdv4data->init_state == ISDV4_INIT_TOUCH_QUERY))
+	{
+		if (!isdv4data->replylen)
 		{
-			case 0x00: /* resistive touch & pen */
-				common->wcmPktLength = ISDV4_PKGLEN_TOUCH93;
-				common->tablet_id = 0x93;
-				break;
-			case 0x01: /* capacitive touch & pen */
-				common->wcmPktLength = ISDV4_PKGLEN_TOUCH9A;
-				common->tablet_id = 0x9A;
-				break;
-			case 0x02: /* resistive touch */
-				common->wcmPktLength = ISDV4_PKGLEN_TOUCH93;
-				common->tablet_id = 0x93;
-				break;
-			case 0x03: /* capacitive touch */
-				common->wcmPktLength = ISDV4_PKGLEN_TOUCH9A;
-				common->tablet_id = 0x9F;
-				break;
-			case 0x04: /* capacitive touch */
-				common->wcmPktLength = ISDV4_PKGLEN_TOUCH9A;
-				common->tablet_id = 0x9F;
-				break;
-			case 0x05:
-				common->wcmPktLength = ISDV4_PKGLEN_TOUCH2FG;
-				/* a penabled */
-				if (common->tablet_id == 0x90)
-					common->tablet_id = 0xE3;
+			for (n = 0; n < len; n++)
+				if ((data[n] & (HEADER_BIT | CONTROL_BIT)) ==
+				    (HEADER_BIT | CONTROL_BIT))
+					break;
+			data += n;
+			len -= n;
+			if (!len)
 				break;
 		}
 
-		switch(reply.data_id)
+		n = min(len, ISDV4_PKGLEN_TPCCTL - isdv4data->replylen);
+		memcpy(isdv4data->reply + isdv4data->replylen, data, n);
+		isdv4data->replylen += n;
+		data += n;
+		len -= n;
+
+		if (isdv4data->replylen == ISDV4_PKGLEN_TPCCTL)
+			isdv4InitReply(isdv4data);
+	}
+}
+
+/*****************************************************************************
+ * isdv4InitStart -- start the handshake. An asynchronous one is driven by
+ * isdv4ReadPacket and priv->init_timer and starts sampling when done.
+ ****************************************************************************/
+
+static void isdv4InitStart(InputInfoPtr pInfo, Bool async)
+{
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	wcmISDV4Data *isdv4data = priv->common->private;
+
+	DBG(1, priv, "Querying ISDV4 tablet\n");
+
+	isdv4data->init_pInfo = pInfo;
+	isdv4data->init_async = async;
+	if (!async)
+		isdv4data->query.touch = 0;
+	isdv4InitStop(isdv4data, isdv4data->baudrate);
+}
+
+/*****************************************************************************
+ * isdv4RunInit -- run the handshake during PreInit. The read callback
+ * isn't set up yet, so wait for the tablet here, never longer than the
+ * deadline of the current state.
+ ****************************************************************************/
+
+static Bool isdv4RunInit(InputInfoPtr pInfo)
+{
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	wcmISDV4Data *isdv4data = priv->common->private;
+	unsigned char buffer[BUFFER_SIZE];
+	int wait, len;
+
+	isdv4InitStart(pInfo, FALSE);
+
+	while (isdv4InitPending(isdv4data))
+	{
+		wait = (int)(isdv4data->init_deadline - GetTimeInMillis());
+		if (wait <= 0)
 		{
-				/* single finger touch */
-			case 0x01:
-				if ((common->tablet_id != 0x93) &&
-					(common->tablet_id != 0x9A) &&
-					(common->tablet_id != 0x9F))
-
-				{
-				    xf86Msg(X_WARNING, "%s: tablet id(%x)"
-					    " mismatch with data id (0x01) \n",
-					    pInfo->name, common->tablet_id);
-				    goto out;
-				}
-				break;
-				/* 2FGT */
-			case 0x03:
-				if ((common->tablet_id != 0xE2) &&
-						(common->tablet_id != 0xE3))
-				{
-				    xf86Msg(X_WARNING, "%s: tablet id(%x)"
-					    " mismatch with data id (0x03) \n",
-					    pInfo->name, common->tablet_id);
-				    goto out;
-				}
-				break;
+			isdv4InitTimeout(isdv4data);
+			continue;
 		}
 
-		/* don't overwrite the default */
-		if (reply.x_max | reply.y_max)
+		len = xf86WaitForInput(pInfo->fd, wait * 1000);
+		if (len < 0 && errno != EINTR)
+		{
+			xf86Msg(X_ERROR, "%s: Wacom select error : %s\n",
+				pInfo->name, strerror(errno));
+			isdv4InitFinish(isdv4data, FALSE);
+		} else if (len > 0)
 		{
-			common->wcmMaxTouchX = reply.x_max;
-			common->wcmMaxTouchY = reply.y_max;
+			len = xf86ReadSerial(pInfo->fd, buffer, sizeof(buffer));
+			if (len > 0)
+				isdv4InitInput(isdv4data, buffer, len);
 		}
-		else if (reply.panel_resolution)
-			common->wcmMaxTouchX = common->wcmMaxTouchY =
-				(1 << reply.panel_resolution);
+	}
 
-		if (reply.panel_resolution)
-			common->wcmTouchResolX = common->wcmTouchResolY = ISDV4_TOUCH_RESOLUTION;
+	return isdv4data->init_state == ISDV4_INIT_DONE;
+}
 
-		common->wcmVersion = reply.version;
-		ret = Success;
+/*****************************************************************************
+ * isdv4CachePath -- the query replies never change for a given tablet, so
+ * they are cached in ISDV4_CACHE_DIR under a name made from the device
+ * path and the sysfs id of the tablet. Without an id there is no cache,
+ * the port might have something else plugged in next time.
+ ****************************************************************************/
 
-		DBG(2, priv, "touch speed=%d "
-			"maxTouchX=%d maxTouchY=%d TouchresX=%d TouchresY=%d \n",
-			isdv4data->baudrate, common->wcmMaxTouchX,
-			common->wcmMaxTouchY, common->wcmTouchResolX,
-			common->wcmTouchResolY);
+static Bool isdv4CachePath(InputInfoPtr pInfo)
+{
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	WacomCommonPtr common =	priv->common;
+	wcmISDV4Data *isdv4data = common->private;
+	char id[15] = {0};
+	char *c;
+	int len;
+
+	isdv4data->cache_path[0] = '\0';
+
+	if (!isdv4data->use_cache || !common->device_path ||
+	    !get_sysfs_id(pInfo, id, sizeof(id)))
+		return FALSE;
+
+	len = snprintf(isdv4data->cache_path, sizeof(isdv4data->cache_path),
+		       "%s/", ISDV4_CACHE_DIR);
+	if (snprintf(isdv4data->cache_path + len,
+		     sizeof(isdv4data->cache_path) - len,
+		     "%s-%s", common->device_path, id) >=
+	    sizeof(isdv4data->cache_path) - len)
+	{
+		isdv4data->cache_path[0] = '\0';
+		return FALSE;
 	}
 
-	xf86Msg(X_INFO, "%s: serial tablet id 0x%X.\n", pInfo->name, common->tablet_id);
+	/* flatten the device path, drop the newline of the id */
+	for (c = isdv4data->cache_path + len; *c; c++)
+		if (!isalnum(*c) && *c != '-' && *c != '.')
+			*c = (*c == '\n') ? '\0' : '_';
 
-out:
-	if (ret == Success)
+	return TRUE;
+}
+
+/*****************************************************************************
+ * isdv4LoadCache -- take the ranges from the cached query replies instead
+ * of asking the tablet. The first handshake with the tablet checks them.
+ ****************************************************************************/
+
+static Bool isdv4LoadCache(InputInfoPtr pInfo)
+{
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	WacomCommonPtr common =	priv->common;
+	wcmISDV4Data *isdv4data = common->private;
+	ISDV4QueryCache *query = &isdv4data->query;
+	int fd, len;
+
+	if (!isdv4CachePath(pInfo))
+		return FALSE;
+
+	fd = open(isdv4data->cache_path, O_RDONLY);
+	if (fd < 0)
+		return FALSE;
+	len = read(fd, query, sizeof(*query));
+	close(fd);
+
+	if (len != sizeof(*query) || memcmp(query->magic, "ISDV", 4) ||
+	    query->version != ISDV4_CACHE_VERSION ||
+	    (query->baudrate != 19200 && query->baudrate != 38400))
+	{
+		DBG(1, priv, "ignoring invalid cache %s\n", isdv4data->cache_path);
+		return FALSE;
+	}
+
+	isdv4data->init_baud = query->baudrate;
+	if (!isdv4SetRanges(pInfo, query->reply) ||
+	    (query->touch && !isdv4SetTouchRanges(pInfo, query->touch_reply)))
+		return FALSE;
+
+	if (query->baudrate != isdv4data->baudrate)
+	{
+		if (xf86SetSerialSpeed(pInfo->fd, query->baudrate) < 0)
+			return FALSE;
+		isdv4data->baudrate = query->baudrate;
+		/* xf86OpenSerial() takes the baud rate from the options */
+		xf86ReplaceIntOption(pInfo->options, "BaudRate", query->baudrate);
+	}
+
+	xf86Msg(X_INFO, "%s: using cached query from %s\n", pInfo->name,
+		isdv4data->cache_path);
+	isdv4data->cached = TRUE;
+
+	return TRUE;
+}
+
+/*****************************************************************************
+ * isdv4SaveCache -- store the replies of a successful query
+ ****************************************************************************/
+
+static void isdv4SaveCache(InputInfoPtr pInfo)
+{
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	wcmISDV4Data *isdv4data = priv->common->private;
+	ISDV4QueryCache *query = &isdv4data->query;
+	char tmp[PATH_MAX];
+	int fd, len;
+
+	if (!isdv4data->cache_path[0] && !isdv4CachePath(pInfo))
+		return;
+
+	memcpy(query->magic, "ISDV", 4);
+	query->version = ISDV4_CACHE_VERSION;
+	query->baudrate = isdv4data->baudrate;
+
+	if (mkdir(ISDV4_CACHE_DIR, 0755) == -1 && errno != EEXIST)
+		goto fail;
+
+	/* write a temporary file and move it in place, a crash must not
+	 * leave half a cache behind */
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", isdv4data->cache_path) >= sizeof(tmp))
+		return;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto fail;
+	len = write(fd, query, sizeof(*query));
+	close(fd);
+	if (len != sizeof(*query) || rename(tmp, isdv4data->cache_path) == -1)
 	{
+		unlink(tmp);
+		goto fail;
+	}
+
+	DBG(1, priv, "cached query in %s\n", isdv4data->cache_path);
+	return;
+
+fail:
+	xf86Msg(X_WARNING, "%s: failed to write %s: %s\n", pInfo->name,
+		isdv4data->cache_path, strerror(errno));
+}
+
+/*****************************************************************************
+ * isdv4GetRanges -- get ranges of the device
+ ****************************************************************************/
+
+static int isdv4GetRanges(InputInfoPtr pInfo)
+{
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	WacomCommonPtr common =	priv->common;
+	wcmISDV4Data *isdv4data = common->private;
+
+	DBG(2, priv, "getting ISDV4 Ranges\n");
+
+	if (!isdv4data->tablet_initialized)
+	{
+		if (!isdv4LoadCache(pInfo))
+		{
+			if (!isdv4RunInit(pInfo))
+				return !Success;
+			isdv4SaveCache(pInfo);
+		}
+
+		xf86Msg(X_INFO, "%s: serial tablet id 0x%X.\n", pInfo->name, common->tablet_id);
 		isdv4data->tablet_initialized = 1;
-		isdv4data->initialized_devices++;
 	}
 
-	return ret;
+	isdv4data->initialized_devices++;
+
+	return Success;
+}
+
+/*****************************************************************************
+ * isdv4InitFramer -- set up the packet length table of the framer. The
+ * header byte alone determines the length: touch packets have the touch
+ * control bit set and their length depends on the sensor, everything else
+ * is a pen (or control) packet. If the touch query didn't tell us the
+ * sensor, the tablet id does.
+ ****************************************************************************/
+
+static void isdv4InitFramer(WacomCommonPtr common)
+{
+	wcmISDV4Data *isdv4data = common->private;
+	int i;
+
+	if (!isdv4data->layout)
+		isdv4data->layout = isdv4TouchLayoutByTablet(common->tablet_id);
+
+	for (i = 0; i < ARRAY_SIZE(isdv4data->pktlen); i++)
+		isdv4data->pktlen[i] = (i & TOUCH_CONTROL_BIT) ?
+					isdv4data->layout->pktlen :
+					ISDV4_PKGLEN_TPCPEN;
+
+	isdv4data->framed = 0;
 }
 
 static int isdv4StartTablet(InputInfoPtr pInfo)
@@ -561,121 +990,191 @@ static int isdv4StartTablet(InputInfoPtr pInfo)
 	WacomCommonPtr common =	priv->common;
 	wcmISDV4Data *isdv4data = common->private;
 
-	if (--isdv4data->initialized_devices)
+	isdv4InitFramer(common);
+
+	/* The tablet was stopped and queried in PreInit, start it once the
+	 * last device is enabled. */
+	if (isdv4data->initialized_devices > 0)
+	{
+		if (--isdv4data->initialized_devices)
+			return Success;
+
+		/* The ranges came from the cache, check them with the tablet
+		 * while the server goes on. The handshake starts sampling. */
+		if (isdv4data->cached)
+		{
+			isdv4InitStart(pInfo, TRUE);
+			return Success;
+		}
+
+		/* Tell the tablet to start sending coordinates */
+		if (!wcmWriteWait(pInfo, ISDV4_SAMPLING))
+			return !Success;
+
 		return Success;
+	}
 
-	/* Tell the tablet to start sending coordinates */
-	if (!wcmWriteWait(pInfo, ISDV4_SAMPLING))
-		return !Success;
+	/* Enabled again after all devices were off (VT switch, resume), the
+	 * tablet may have been reset meanwhile. The device reopening the fd
+	 * runs the handshake again without waiting for it here. */
+	if (common->fd_refs == 1)
+		isdv4InitStart(pInfo, TRUE);
 
 	return Success;
 }
 
-static int isdv4StopTablet(InputInfoPtr pInfo)
+/* The handshake only advances on the init_timer of the device running
+ * it. Hand it over to another device still reading the tablet, or drop it
+ * if this is the last one, the next DEVICE_ON runs it again. */
+static void isdv4StopTablet(InputInfoPtr pInfo)
 {
-#if DEBUG
 	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
 	WacomCommonPtr common = priv->common;
+	wcmISDV4Data *isdv4data = common->private;
+	WacomDevicePtr other;
+	int wait;
+
+#if HAVE_THREADED_INPUT
+	input_lock();
+#else
+	int sigstate = xf86BlockSIGIO();
 #endif
-	int fd_flags;
 
-	/* Send stop command to the tablet */
-	if (!wcmWriteWait(pInfo, ISDV4_STOP))
-		return !Success;
+	if (isdv4InitPending(isdv4data) && isdv4data->init_pInfo == pInfo)
+	{
+		TimerCancel(priv->init_timer);
 
-	/* Wait 250 mSecs */
-	if (wcmWait(250))
-		return !Success;
+		for (other = common->wcmDevices; other; other = other->next)
+			if (other != priv && other->pInfo->fd >= 0)
+				break;
 
-	/* discard potential data on the line */
-	fd_flags = fcntl(pInfo->fd, F_GETFL);
-	if (fcntl(pInfo->fd, F_SETFL, fd_flags | O_NONBLOCK) == 0)
-	{
-		char buffer[10];
-		while (read(pInfo->fd, buffer, sizeof(buffer)) > 0)
-			DBG(10, common, "discarding garbage data.\n");
-		(void)fcntl(pInfo->fd, F_SETFL, fd_flags);
+		if (other)
+		{
+			wait = (int)(isdv4data->init_deadline - GetTimeInMillis());
+			isdv4data->init_pInfo = other->pInfo;
+			isdv4InitArm(isdv4data, max(wait, 1));
+		} else
+		{
+			isdv4data->init_state = ISDV4_INIT_IDLE;
+			isdv4data->init_pInfo = NULL;
+		}
 	}
 
-	return Success;
+#if HAVE_THREADED_INPUT
+	input_unlock();
+#else
+	xf86UnblockSIGIO(sigstate);
+#endif
 }
+
 /**
- * Parse one touch packet.
+ * Decode one contact of a touch packet into its channel's state.
+ *
+ * @param data The touch packet
+ * @param layout The packet layout of the sensor
+ * @param contact The contact number, 0 for the first
+ * @param status Whether the contact is down
+ * @param time Timestamp of the read the packet came in
+ * @param last The contact's previous state
+ * @param[out] ds The contact's channel state, modified in place.
+ */
+static inline void isdv4DecodeContact(const unsigned char *data,
+				      const ISDV4TouchLayout *layout,
+				      int contact, int status, int64_t time,
+				      const WacomDeviceState *last,
+				      WacomDeviceState *ds)
+{
+	ds->x = status ? isdv4TouchX(data, layout, contact) : last->x;
+	ds->y = status ? isdv4TouchY(data, layout, contact) : last->y;
+	ds->proximity = status;
+	ds->device_type = TOUCH_ID;
+	ds->device_id = TOUCH_DEVICE_ID;
+	ds->serial_num = contact + 1;
+	wcmSetStateTime(ds, time);
+	/* time stamp for gesture events */
+	if (ds->proximity != last->proximity)
+		ds->sample = ds->time;
+}
+
+/**
+ * Parse one touch packet straight into the channel states and send an
+ * event for every contact that is down or just went up. Contacts are
+ * tracked on the channels wcmChooseChannel hands out, like USB touch.
  *
  * @param pInfo The device to parse the packet for
  * @param data Data read from the device
  * @param len Data length in bytes
- * @param[out] ds The device state, modified in place.
- *
- * @return The channel number of -1 on error.
  */
 
-static int isdv4ParseTouchPacket(InputInfoPtr pInfo, const unsigned char *data,
-				 int len, WacomDeviceState *ds)
+static void isdv4ParseTouchPacket(InputInfoPtr pInfo, const unsigned char *data,
+				  int len)
 {
 	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
 	WacomCommonPtr common = priv->common;
-	WacomDeviceState* last = &common->wcmChannel[0].valid.state;
-	WacomDeviceState* lastTemp = &common->wcmChannel[1].valid.state;
-	ISDV4TouchData touchdata;
-	int rc;
-	int channel = 0;
+	wcmISDV4Data *isdv4data = common->private;
+	const ISDV4TouchLayout *layout = isdv4data->layout;
+	int contacts = min(layout->contacts, MAX_FINGERS);
+	int i, channel, status;
 
-	rc = isdv4ParseTouchData(data, len, common->wcmPktLength, &touchdata);
-	if (rc <= 0)
+	for (i = 0; i < contacts; i++)
 	{
-		LogMessageVerbSigSafe(X_ERROR, 0, "%s: failed to parse touch data (err %d).\n",
-				      pInfo->name, rc);
-		return -1;
+		WacomChannelPtr pChannel;
+		WacomDeviceState *ds;
+
+		status = isdv4TouchStatus(data, layout, i);
+		if (!status && !(isdv4data->touching & (1u << i)))
+			continue;
+
+		channel = wcmChooseChannel(common, TOUCH_ID, i + 1);
+		if (channel < 0)
+			continue;
+
+		pChannel = &common->wcmChannel[channel];
+		ds = &pChannel->work;
+		RESET_RELATIVE(*ds);
+		isdv4DecodeContact(data, layout, i, status, isdv4data->time,
+				   wcmChannelState(pChannel, 0), ds);
+
+		if (status)
+			isdv4data->touching |= 1u << i;
+		else
+			isdv4data->touching &= ~(1u << i);
+
+		DBG(8, priv, "contact %d %s proximity \n", i, ds->proximity ? "in" : "out of");
+
+		wcmEvent(common, channel, ds);
 	}
+}
 
-	ds->x = touchdata.status ? touchdata.x : last->x;
-	ds->y = touchdata.status ? touchdata.y : last->y;
-	ds->proximity = touchdata.status;
-	ds->device_type = TOUCH_ID;
-	ds->device_id = TOUCH_DEVICE_ID;
-	ds->serial_num = 1;
-	ds->time = (int)GetTimeInMillis();
+/**
+ * Send a proximity out for all contacts that are down.
+ */
+static void isdv4TouchOut(WacomCommonPtr common)
+{
+	wcmISDV4Data *isdv4data = common->private;
+	int i, channel;
 
-	if (common->wcmPktLength == ISDV4_PKGLEN_TOUCH2FG)
+	while (isdv4data->touching)
 	{
-		if (touchdata.finger2.status ||
-		    (!touchdata.finger2.status && lastTemp->proximity))
-		{
-			/* Got 2FGT. Send the first one if received */
-			if (ds->proximity || (!ds->proximity && last->proximity))
-			{
-				/* time stamp for 2FGT gesture events */
-				if ((ds->proximity && !last->proximity) ||
-				    (!ds->proximity && last->proximity))
-					ds->sample = (int)GetTimeInMillis();
-				wcmEvent(common, channel, ds);
-			}
+		WacomDeviceState out = OUTPROX_STATE;
 
-			channel = 1;
-			ds = &common->wcmChannel[channel].work;
-			RESET_RELATIVE(*ds);
-			ds->x = touchdata.finger2.status ? touchdata.finger2.x : lastTemp->x;
-			ds->y = touchdata.finger2.status ? touchdata.finger2.y : lastTemp->y;
-			ds->device_type = TOUCH_ID;
-			ds->device_id = TOUCH_DEVICE_ID;
-			ds->serial_num = 2;
-			ds->proximity = touchdata.finger2.status;
-			ds->time = (int)GetTimeInMillis();
-			/* time stamp for 2FGT gesture events */
-			if ((ds->proximity && !lastTemp->proximity) ||
-			    (!ds->proximity && lastTemp->proximity))
-				ds->sample = (int)GetTimeInMillis();
-		}
-	}
+		i = ffs(isdv4data->touching) - 1;
+		isdv4data->touching &= ~(1u << i);
 
-	DBG(8, priv, "MultiTouch %s proximity \n", ds->proximity ? "in" : "out of");
+		channel = wcmChooseChannel(common, TOUCH_ID, i + 1);
+		if (channel < 0)
+			continue;
 
-	return channel;
+		out.device_type = TOUCH_ID;
+		out.serial_num = i + 1;
+		wcmSetStateTime(&out, isdv4data->time);
+		out.sample = out.time;
+		wcmEvent(common, channel, &out);
+	}
 }
 
 /**
- * Parse one pen packet.
+ * Parse one pen packet straight into the channel state.
  *
  * @param pInfo The device to parse the packet for
  * @param data Data read from the device
@@ -689,33 +1188,23 @@ static int isdv4ParsePenPacket(InputInfoPtr pInfo, const unsigned char *data,
 {
 	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
 	WacomCommonPtr common = priv->common;
-	WacomDeviceState* last = &common->wcmChannel[0].valid.state;
-	int rc;
-	ISDV4CoordinateData coord;
+	wcmISDV4Data *isdv4data = common->private;
+	WacomDeviceState* last = wcmChannelState(&common->wcmChannel[0], 0);
 	int channel = 0;
 	int cur_type;
 
-	rc = isdv4ParseCoordinateData(data, ISDV4_PKGLEN_TPCPEN, &coord);
-
-	if (rc == -1)
-	{
-		LogMessageVerbSigSafe(X_ERROR, 0,
-				      "%s: failed to parse coordinate data.\n", pInfo->name);
-		return -1;
-	}
-
-	ds->time = (int)GetTimeInMillis();
-	ds->proximity = coord.proximity;
+	wcmSetStateTime(ds, isdv4data->time);
+	ds->proximity = (data[0] >> 5) & 0x1;
 
 	/* x and y in "normal" orientetion (wide length is X) */
-	ds->x = coord.x;
-	ds->y = coord.y;
+	ds->x = isdv4PenX(data);
+	ds->y = isdv4PenY(data);
 
 	/* pressure */
-	ds->pressure = coord.pressure;
+	ds->pressure = isdv4PenPressure(data);
 
-	/* buttons */
-	ds->buttons = coord.tip | (coord.side << 1) | (coord.eraser << 2);
+	/* buttons: tip, side switch and eraser */
+	ds->buttons = data[0] & 0x7;
 
 	/* check which device we have */
 	cur_type = (ds->buttons & 4) ? ERASER_ID : STYLUS_ID;
@@ -757,35 +1246,21 @@ static int isdv4ParsePenPacket(InputInfoPtr pInfo, const unsigned char *data,
 }
 
 
-static int isdv4Parse(InputInfoPtr pInfo, const unsigned char* data, int len)
+/*****************************************************************************
+ * isdv4ParsePacket -- parse one complete and validated packet
+ ****************************************************************************/
+
+static void isdv4ParsePacket(InputInfoPtr pInfo, const unsigned char* data, int len)
 {
 	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
 	WacomCommonPtr common = priv->common;
-	WacomDeviceState* last = &common->wcmChannel[0].valid.state;
+	WacomDeviceState* last = wcmChannelState(&common->wcmChannel[0], 0);
 	WacomDeviceState* ds;
-	int n, channel = 0;
+	int channel = 0;
 
 	DBG(10, common, "\n");
 
-	if ((n = wcmSkipInvalidBytes(data, len)) > 0)
-		return n;
-
-	/* choose wcmPktLength if it is not an out-prox event */
-	if (data[0])
-		common->wcmPktLength = ISDV4_PKGLEN_TPCPEN;
-
-	if ( data[0] & 0x10 )
-	{
-		/* set touch PktLength */
-		common->wcmPktLength = ISDV4_PKGLEN_TOUCH93;
-		if ((common->tablet_id == 0x9A) || (common->tablet_id == 0x9F))
-			common->wcmPktLength = ISDV4_PKGLEN_TOUCH9A;
-		if ((common->tablet_id == 0xE2) || (common->tablet_id == 0xE3))
-			common->wcmPktLength = ISDV4_PKGLEN_TOUCH2FG;
-	}
-
-	if (len < common->wcmPktLength)
-		return 0;
+	common->wcmPktLength = len;
 
 	/* determine the type of message (touch or stylus) */
 	if (data[0] & TOUCH_CONTROL_BIT) /* a touch data */
@@ -794,107 +1269,174 @@ static int isdv4Parse(InputInfoPtr pInfo, const unsigned char* data, int len)
 				 last->proximity ) || !common->wcmTouch)
 		{
 			/* ignore touch event */
-			return common->wcmPktLength;
+			return;
 		}
 	}
 	else
 	{
-		/* touch was in control */
-		if (last->proximity && last->device_id == TOUCH_DEVICE_ID)
-		{
-			/* let touch go */
-			WacomDeviceState out = OUTPROX_STATE;
-			out.device_type = TOUCH_ID;
-			out.serial_num = 1;
-			wcmEvent(common, channel, &out);
-		}
+		/* touch was in control, let it go */
+		isdv4TouchOut(common);
 	}
 
 	/* Coordinate data bit check */
 	if (data[0] & CONTROL_BIT) /* control data */
-		return common->wcmPktLength;
-	else if ((n = wcmSerialValidate(pInfo,data)) > 0)
-		return n;
+		return;
+
+	if (data[0] & TOUCH_CONTROL_BIT)
+	{
+		isdv4ParseTouchPacket(pInfo, data, len);
+		return;
+	}
 
 	/* pick up where we left off, minus relative values */
 	ds = &common->wcmChannel[channel].work;
 	RESET_RELATIVE(*ds);
 
-	if (common->wcmPktLength == ISDV4_PKGLEN_TPCPEN)
-		channel = isdv4ParsePenPacket(pInfo, data, len, ds);
-	else { /* a touch */
-		channel = isdv4ParseTouchPacket(pInfo, data, len, ds);
-		if (channel >= 0)
-			ds = &common->wcmChannel[channel].work;
-	}
-
-	if (channel < 0)
-		return 0;
+	channel = isdv4ParsePenPacket(pInfo, data, len, ds);
 
 	wcmEvent(common, channel, ds);
-	return common->wcmPktLength;
 }
 
 /*****************************************************************************
- * wcmWriteWait --
- *   send a request
+ * isdv4Frame -- split the received bytes into packets.
+ *
+ * The ISDV4 protocol marks the first byte of a packet with HEADER_BIT and
+ * no other byte has it set. Each byte is looked at once: while checking
+ * the body of a packet for stray header bits we also find where to resync
+ * if one shows up. Complete packets are handed to isdv4ParsePacket, a
+ * trailing partial packet is kept for the next read.
  ****************************************************************************/
 
-static int wcmWriteWait(InputInfoPtr pInfo, const char* request)
+static void isdv4Frame(InputInfoPtr pInfo)
 {
-	int len, maxtry = MAXTRY;
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	WacomCommonPtr common = priv->common;
+	wcmISDV4Data *isdv4data = common->private;
+	unsigned char *buf = common->buffer;
+	int end = common->bufpos;
+	int start = 0;                       /* start of the current packet */
+	int pos = isdv4data->framed;         /* next byte to check */
+	int len, n;
 
-	/* send request string */
-	do
+	while (start < end)
 	{
-		len = xf86WriteSerial(pInfo->fd, request, strlen(request));
-		if ((len == -1) && (errno != EAGAIN))
+		if (!(buf[start] & HEADER_BIT))
 		{
-			xf86Msg(X_ERROR, "%s: wcmWriteWait error : %s\n",
-					pInfo->name, strerror(errno));
-			return 0;
+			n = isdv4FindHeader(buf + start, end - start);
+			common->wcmEventStats.resyncs++;
+			LOG_RATELIMITED(common, X_WARNING,
+				"%s: missing header bit. skipping %d bytes.\n",
+				pInfo->name, n);
+			start += n;
+			continue;
 		}
 
-		maxtry--;
+		len = isdv4data->pktlen[buf[start] & ~HEADER_BIT];
+		if (pos <= start)
+			pos = start + 1;
 
-	} while ((len <= 0) && maxtry);
+		pos += isdv4FindHeader(buf + pos, min(end, start + len) - pos);
 
-	if (!maxtry)
-		xf86Msg(X_WARNING, "%s: Failed to issue command '%s' "
-				   "after %d tries.\n", pInfo->name, request, MAXTRY);
+		if (pos == start + len)
+		{
+			isdv4ParsePacket(pInfo, buf + start, len);
+			start = pos;
+		}
+		else if (pos == end)
+			break; /* incomplete, wait for more data */
+		else
+		{
+			common->wcmEventStats.resyncs++;
+			LOG_RATELIMITED(common, X_WARNING, "%s: bad data at %d v=%x l=%d\n",
+				pInfo->name, pos - start, buf[pos], len);
+			start = pos;
+		}
+	}
 
-	return maxtry;
+	/* keep a partial packet for the next read */
+	len = end - start;
+	if (len && start)
+	{
+		DBG(7, common, "MOVE %d bytes\n", len);
+		memmove(buf, buf + start, len);
+	}
+	common->bufpos = len;
+	isdv4data->framed = len ? pos - start : 0;
+}
+
+/*****************************************************************************
+ * isdv4ReadPacket -- read what the tablet sent and parse all complete
+ * packets in it.
+ ****************************************************************************/
+
+static Bool isdv4ReadPacket(InputInfoPtr pInfo)
+{
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	WacomCommonPtr common = priv->common;
+	wcmISDV4Data *isdv4data = common->private;
+	int len;
+
+	len = wcmRead(pInfo, common->buffer + common->bufpos,
+		      sizeof(common->buffer) - common->bufpos);
+	if (len <= 0)
+		return FALSE;
+
+	/* while the handshake runs, the data is its reply. Whichever device
+	 * reads it takes over the timeout, the one that started the
+	 * handshake may have been disabled since. */
+	if (isdv4InitPending(isdv4data))
+	{
+		if (isdv4data->init_pInfo != pInfo)
+		{
+			int wait = (int)(isdv4data->init_deadline - GetTimeInMillis());
+
+			isdv4data->init_pInfo = pInfo;
+			isdv4InitArm(isdv4data, max(wait, 1));
+		}
+		isdv4InitInput(isdv4data, common->buffer + common->bufpos, len);
+		common->bufpos = 0;
+		isdv4data->framed = 0;
+		return TRUE;
+	}
+
+	common->bufpos += len;
+	DBG(10, common, "buffer has %d bytes\n", common->bufpos);
+
+	/* all packets of one read share a timestamp. The serial protocol
+	 * carries none, so this is as close to the hardware as it gets */
+	isdv4data->time = wcmMonotonicTime();
+	isdv4Frame(pInfo);
+
+	return TRUE;
 }
 
 /*****************************************************************************
- * wcmWaitForTablet --
- *   wait for tablet data
+ * wcmWriteWait --
+ *   send a request
  ****************************************************************************/
 
-static int wcmWaitForTablet(InputInfoPtr pInfo, char* answer, int size)
+static int wcmWriteWait(InputInfoPtr pInfo, const char* request)
 {
 	int len, maxtry = MAXTRY;
 
-	/* Read size bytes of the answer */
+	/* send request string */
 	do
 	{
-		if ((len = xf86WaitForInput(pInfo->fd, 1000000)) > 0)
+		len = xf86WriteSerial(pInfo->fd, request, strlen(request));
+		if ((len == -1) && (errno != EAGAIN))
 		{
-			len = xf86ReadSerial(pInfo->fd, answer, size);
-			if ((len == -1) && (errno != EAGAIN))
-			{
-				xf86Msg(X_ERROR, "%s: xf86ReadSerial error : %s\n",
-						pInfo->name, strerror(errno));
-				return 0;
-			}
+			xf86Msg(X_ERROR, "%s: wcmWriteWait error : %s\n",
+					pInfo->name, strerror(errno));
+			return 0;
 		}
+
 		maxtry--;
+
 	} while ((len <= 0) && maxtry);
 
 	if (!maxtry)
-		xf86Msg(X_WARNING, "%s: Waited too long for answer "
-				   "(failed after %d tries).\n",
-				   pInfo->name, MAXTRY);
+		xf86Msg(X_WARNING, "%s: Failed to issue command '%s' "
+				   "after %d tries.\n", pInfo->name, request, MAXTRY);
 
 	return maxtry;
 }
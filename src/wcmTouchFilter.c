@@ -65,7 +65,7 @@ static WacomChannelPtr getContactNumber(WacomCommonPtr common, int num)
 	for (i = 0; i < MAX_CHANNELS; i++)
 	{
 		WacomChannelPtr channel = common->wcmChannel+i;
-		WacomDeviceState state  = channel->valid.state;
+		WacomDeviceState state  = *wcmChannelState(channel, 0);
 		if (state.device_type == TOUCH_ID && state.serial_num == num + 1)
 			return channel;
 	}
@@ -89,15 +89,33 @@ static void getStateHistory(WacomCommonPtr common, WacomDeviceState states[], in
 	for (i = 0; i < num; i++)
 	{
 		WacomChannelPtr channel = getContactNumber(common, i);
-		if (channel == NULL || i > ARRAY_SIZE(channel->valid.states))
+		if (channel == NULL || age >= MAX_SAMPLES)
 		{
 			DBG(7, common, "Could not get state history for contact %d, age %d.\n", i, age);
 			continue;
 		}
-		states[i] = channel->valid.states[age];
+		states[i] = *wcmChannelState(channel, age);
 	}
 }
 
+/**
+ * Returns the time of the event that triggered gesture processing. Gesture
+ * timing is measured against it rather than against the time the event
+ * happens to be processed at.
+ *
+ * @param[in] common
+ * @param[in] num     Contact number of the triggering contact
+ * @return            The event time in ms, on the GetTimeInMillis clock
+ */
+static CARD32 getEventTime(WacomCommonPtr common, int num)
+{
+	WacomChannelPtr channel = getContactNumber(common, num);
+
+	if (channel == NULL)
+		return GetTimeInMillis();
+	return wcmChannelState(channel, 0)->time;
+}
+
 /**
  * Send a touch event for the provided contact ID. This makes use of
  * the multitouch API available in XI2.2.
@@ -113,8 +131,8 @@ wcmSendTouchEvent(WacomDevicePtr priv, WacomChannelPtr channel, Bool no_update)
 {
 #if GET_ABI_MAJOR(ABI_XINPUT_VERSION) >= 16
 	ValuatorMask *mask = priv->common->touch_mask;
-	WacomDeviceState state = channel->valid.state;
-	WacomDeviceState oldstate = channel->valid.states[1];
+	WacomDeviceState state = *wcmChannelState(channel, 0);
+	WacomDeviceState oldstate = *wcmChannelState(channel, 1);
 	int type = -1;
 
 	wcmRotateAndScaleCoordinates (priv->pInfo, &state.x, &state.y);
@@ -164,7 +182,7 @@ wcmFingerMultitouch(WacomDevicePtr priv, int contact_id) {
 
 	for (i = 0; i < MAX_CHANNELS; i++) {
 		WacomChannelPtr channel = priv->common->wcmChannel+i;
-		WacomDeviceState state  = channel->valid.state;
+		WacomDeviceState state  = *wcmChannelState(channel, 0);
 		if (state.device_type != TOUCH_ID)
 			continue;
 
@@ -248,7 +266,7 @@ static void wcmSendButtonClick(WacomDevicePtr priv, int button, int state)
  *   translate second finger tap to right click
  ****************************************************************************/
 
-static void wcmFingerTapToClick(WacomDevicePtr priv)
+static void wcmFingerTapToClick(WacomDevicePtr priv, CARD32 ms)
 {
 	WacomCommonPtr common = priv->common;
 	WacomDeviceState ds[2] = {}, dsLast[2] = {};
@@ -263,8 +281,7 @@ static void wcmFingerTapToClick(WacomDevicePtr priv)
 
 	/* process second finger tap if matched */
 	if ((ds[0].sample < ds[1].sample) &&
-	    ((GetTimeInMillis() -
-	    dsLast[1].sample) <= common->wcmGestureParameters.wcmTapTime) &&
+	    ((ms - dsLast[1].sample) <= common->wcmGestureParameters.wcmTapTime) &&
 	    !ds[1].proximity && dsLast[1].proximity)
 	{
 		/* send left up before sending right down */
@@ -351,8 +368,8 @@ static void wcmSingleFingerPress(WacomDevicePtr priv)
 	WacomCommonPtr common = priv->common;
 	WacomChannelPtr firstChannel = getContactNumber(common, 0);
 	WacomChannelPtr secondChannel = getContactNumber(common, 1);
-	Bool firstInProx = firstChannel && firstChannel->valid.states[0].proximity;
-	Bool secondInProx = secondChannel && secondChannel->valid.states[0].proximity;
+	Bool firstInProx = firstChannel && wcmChannelState(firstChannel, 0)->proximity;
+	Bool secondInProx = secondChannel && wcmChannelState(secondChannel, 0)->proximity;
 
 	DBG(10, priv, "\n");
 
@@ -364,11 +381,11 @@ static void wcmSingleFingerPress(WacomDevicePtr priv)
 		return;
 
 	if (firstInProx && !secondInProx) {
-		firstChannel->valid.states[0].buttons |= 1;
+		wcmChannelState(firstChannel, 0)->buttons |= 1;
 		common->wcmGestureMode = GESTURE_DRAG_MODE;
 	}
 	else {
-		firstChannel->valid.states[0].buttons &= ~1;
+		wcmChannelState(firstChannel, 0)->buttons &= ~1;
 		common->wcmGestureMode = GESTURE_NONE_MODE;
 	}
 }
@@ -396,6 +413,7 @@ void wcmGestureFilter(WacomDevicePtr priv, int touch_id)
 {
 	WacomCommonPtr common = priv->common;
 	WacomDeviceState ds[2] = {}, dsLast[2] = {};
+	CARD32 ms = getEventTime(common, touch_id);
 
 	getStateHistory(common, ds, ARRAY_SIZE(ds), 0);
 	getStateHistory(common, dsLast, ARRAY_SIZE(dsLast), 1);
@@ -405,7 +423,7 @@ void wcmGestureFilter(WacomDevicePtr priv, int touch_id)
 	if (!IsTouch(priv))
 	{
 		/* this should never happen */
-		LogMessageVerbSigSafe(X_ERROR, 0, "WACOM: No touch device found for %s \n",
+		LOG_RATELIMITED(common, X_ERROR, "WACOM: No touch device found for %s \n",
 			 common->device_path);
 		return;
 	}
@@ -449,8 +467,6 @@ void wcmGestureFilter(WacomDevicePtr priv, int touch_id)
 	 */
 	else if (dsLast[0].proximity && common->wcmGestureMode != GESTURE_DRAG_MODE)
 	{
-		CARD32 ms = GetTimeInMillis();
-
 		if ((ms - ds[0].sample) < WACOM_GESTURE_LAG_TIME)
 		{
 			/* Must have recently come into proximity.  Change
@@ -518,7 +534,7 @@ void wcmGestureFilter(WacomDevicePtr priv, int touch_id)
 	}
 
 	if (!(common->wcmGestureMode & (GESTURE_SCROLL_MODE | GESTURE_ZOOM_MODE)) && touch_id == 1)
-		wcmFingerTapToClick(priv);
+		wcmFingerTapToClick(priv, ms);
 
 	/* Change mode happens only when both fingers are out */
 	if (common->wcmGestureMode & GESTURE_TAP_MODE)
@@ -539,7 +555,6 @@ void wcmGestureFilter(WacomDevicePtr priv, int touch_id)
 
 	/* process complex two finger gestures */
 	else {
-		CARD32 ms = GetTimeInMillis();
 		int taptime = common->wcmGestureParameters.wcmTapTime;
 
 		if (ds[0].proximity && ds[1].proximity &&
@@ -0,0 +1,133 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Latency trace of the input path. Every probe stamps the time it was
+ * reached relative to the read that delivered the data, keeps the record
+ * in a ring and counts it in a per-stage log2 histogram. Only the input
+ * thread writes, readers (the property handlers) copy the ring without
+ * locking and may see a record that is being overwritten.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "xf86Wacom.h"
+
+#if WCM_TRACE
+
+static int wcmTraceBucket(unsigned int latency)
+{
+	int bucket = 0;
+
+	while (latency && bucket < TRACE_BUCKETS - 1)
+	{
+		latency >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+static void wcmTraceRecord(WacomTrace *trace, int stage, int64_t time,
+			   int64_t latency)
+{
+	unsigned int head = trace->head;
+	WacomTraceRecord *rec = &trace->ring[head & (TRACE_RING - 1)];
+
+	if (latency < 0)
+		latency = 0;
+
+	rec->time = time;
+	rec->latency = latency;
+	rec->stage = stage;
+	trace->hist[stage][wcmTraceBucket(rec->latency)]++;
+
+	/* publish the record only once it is complete */
+	__atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Record that the input path reached the given stage. TRACE_READ starts a
+ * new batch, all later stages are timed against it.
+ */
+void wcmTraceProbe(WacomCommonPtr common, enum WacomTraceStage stage)
+{
+	WacomTrace *trace = &common->wcmTrace;
+	int64_t now = wcmMonotonicTime();
+
+	if (stage == TRACE_READ)
+		trace->start = now;
+
+	wcmTraceRecord(trace, stage, now, now - trace->start);
+}
+
+/**
+ * Record how long a frame the kernel stamped at the given time waited
+ * before the driver read it.
+ */
+void wcmTraceKernel(WacomCommonPtr common, int64_t time)
+{
+	WacomTrace *trace = &common->wcmTrace;
+
+	wcmTraceRecord(trace, TRACE_KERNEL, time, trace->start - time);
+}
+
+/**
+ * Copy the latency histograms, TRACE_BUCKETS counts per stage in the
+ * order of enum WacomTraceStage. Bucket n counts latencies below 2^n µs,
+ * the last one everything above.
+ *
+ * @return The number of values written.
+ */
+int wcmTraceHistogram(WacomCommonPtr common, int *values, int nvalues)
+{
+	const WacomTrace *trace = &common->wcmTrace;
+	int i, n = 0;
+
+	for (i = 0; i < TRACE_STAGES * TRACE_BUCKETS && n < nvalues; i++)
+		values[n++] = trace->hist[i / TRACE_BUCKETS][i % TRACE_BUCKETS];
+
+	return n;
+}
+
+/**
+ * Copy the trace ring, oldest record first, as triplets of stage, time in
+ * µs (truncated to 32 bits) and latency in µs.
+ *
+ * @return The number of values written.
+ */
+int wcmTraceLog(WacomCommonPtr common, int *values, int nvalues)
+{
+	const WacomTrace *trace = &common->wcmTrace;
+	unsigned int head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	unsigned int i = head > TRACE_RING ? head - TRACE_RING : 0;
+	int n = 0;
+
+	for (; i != head && n + 3 <= nvalues; i++)
+	{
+		const WacomTraceRecord *rec = &trace->ring[i & (TRACE_RING - 1)];
+
+		values[n++] = rec->stage;
+		values[n++] = (int)rec->time;
+		values[n++] = rec->latency;
+	}
+
+	return n;
+}
+
+#endif /* WCM_TRACE */
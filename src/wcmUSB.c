@@ -26,9 +26,12 @@
 #include <asm/types.h>
 #include <linux/input.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include <linux/version.h>
 
 #define MAX_USB_EVENTS 32
+#define USB_READ_EVENTS 64	/* events fetched per read() */
+#define USB_HW_TIME_SLACK 20000	/* µs hardware and kernel time may drift apart */
 
 typedef struct {
 	int wcmLastToolSerial;
@@ -42,6 +45,14 @@ typedef struct {
 	int npadkeys;                /* number of pad keys in the above array */
 	int padkey_code[WCM_MAX_BUTTONS];/* hardware codes for buttons */
 	int lastChannel;
+	Bool wcmSynDropped;          /* dropping events until next SYN_REPORT */
+	int64_t wcmEventTime;        /* µs time of the frame being dispatched */
+	int64_t wcmKernelTime;       /* µs kernel time of its SYN_REPORT */
+	Bool wcmMonotonic;           /* kernel stamps events on CLOCK_MONOTONIC */
+	unsigned int wcmHwStamp;     /* MSC_TIMESTAMP of the current frame */
+	Bool wcmHwFrame;             /* current frame carried an MSC_TIMESTAMP */
+	unsigned int wcmHwLast;      /* MSC_TIMESTAMP of the last stamped frame */
+	int64_t wcmHwTime;           /* frame time wcmHwLast was mapped to, 0 if none */
 } wcmUSBData;
 
 static Bool usbDetect(InputInfoPtr);
@@ -53,14 +64,15 @@ static void usbInitProtocol5(WacomCommonPtr common, const char* id,
 static void usbInitProtocol4(WacomCommonPtr common, const char* id,
 	float version);
 int usbWcmGetRanges(InputInfoPtr pInfo);
-static int usbParse(InputInfoPtr pInfo, const unsigned char* data, int len);
+static Bool usbReadPacket(InputInfoPtr pInfo);
 static int usbDetectConfig(InputInfoPtr pInfo);
 static void usbParseEvent(InputInfoPtr pInfo,
 	const struct input_event* event);
 static void usbParseSynEvent(InputInfoPtr pInfo,
 			     const struct input_event *event);
 static void usbDispatchEvents(InputInfoPtr pInfo);
-static int usbChooseChannel(WacomCommonPtr common, int device_type, unsigned int serial);
+static void usbDispatchChannels(WacomCommonPtr common);
+static void usbResync(InputInfoPtr pInfo);
 
 	WacomDeviceClass gWacomUSBDevice =
 	{
@@ -78,8 +90,9 @@ static struct _WacomModel mname =		\
 	.GetResolution = NULL,			\
 	.GetRanges = usbWcmGetRanges,		\
 	.Start = usbStart,			\
-	.Parse = usbParse,			\
+	.Parse = NULL,				\
 	.DetectConfig = usbDetectConfig,	\
+	.ReadPacket = usbReadPacket,		\
 }
 
 DEFINE_MODEL(usbUnknown,	"Unknown USB",		5);
@@ -136,8 +149,19 @@ static Bool usbDetect(InputInfoPtr pInfo)
 static int
 usbStart(InputInfoPtr pInfo)
 {
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	wcmUSBData *private = priv->common->private;
+	int clock = CLOCK_MONOTONIC;
 	int err;
 
+	/* evdev stamps events with CLOCK_REALTIME unless told otherwise,
+	 * which jumps with the wall clock */
+	SYSCALL(err = ioctl(pInfo->fd, EVIOCSCLOCKID, &clock));
+	private->wcmMonotonic = (err == 0);
+	private->wcmHwTime = 0;
+	if (!private->wcmMonotonic)
+		DBG(1, priv, "no monotonic event time, using read time\n");
+
 	if (xf86CheckBoolOption(pInfo->options, "GrabDevice", 0))
 	{
 		/* Try to grab the event device so that data don't leak to /dev/input/mice */
@@ -831,18 +855,26 @@ static int usbDetectConfig(InputInfoPtr pInfo)
 	return TRUE;
 }
 
-static int usbParse(InputInfoPtr pInfo, const unsigned char* data, int len)
+/**
+ * Read as many events as the kernel has queued (up to USB_READ_EVENTS) and
+ * hand them to usbParseEvent in place. evdev only ever returns whole
+ * struct input_events, so unlike the generic byte-stream path there is
+ * never a partial record left to carry over to the next read.
+ */
+static Bool usbReadPacket(InputInfoPtr pInfo)
 {
-	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
-	WacomCommonPtr common = priv->common;
-	struct input_event event;
+	struct input_event events[USB_READ_EVENTS];
+	int len, i, count;
 
-	if (len < sizeof(struct input_event))
-		return 0;
+	len = wcmRead(pInfo, events, sizeof(events));
+	if (len <= 0)
+		return FALSE;
+
+	count = len / sizeof(struct input_event);
+	for (i = 0; i < count; i++)
+		usbParseEvent(pInfo, &events[i]);
 
-	memcpy(&event, data, sizeof(event));
-	usbParseEvent(pInfo, &event);
-	return common->wcmPktLength;
+	return TRUE;
 }
 
 /**
@@ -879,85 +911,50 @@ static int protocol5Serial(int device_type, unsigned int serial) {
 }
 
 /**
- * Find an appropriate channel to track the specified tool's state in.
- * If the tool is already in proximity, the channel currently being used
- * to store its state will be returned. Otherwise, an arbitrary available
- * channel will be cleaned and returned. Up to MAX_CHANNEL tools can be
- * tracked concurrently by driver.
+ * Work out the time of the frame ended by the given SYN_REPORT. The
+ * kernel's timestamp is taken when the USB report arrived, so unlike the
+ * time we read it at it does not include any queueing in the server. If
+ * the device sends MSC_TIMESTAMP, the frame time advances by the hardware's
+ * own interval instead, which is free of USB polling jitter. That time is
+ * anchored to the kernel time and re-anchored when the two drift apart.
  *
- * @param[in] common
- * @param[in] device_type  Type of tool (e.g. STYLUS_ID, TOUCH_ID, PAD_ID)
- * @param[in] serial       Serial number of tool
- * @return                 Channel number to track the tool's state
+ * @return The frame time in µs on CLOCK_MONOTONIC.
  */
-static int usbChooseChannel(WacomCommonPtr common, int device_type, unsigned int serial)
+static int64_t usbFrameTime(wcmUSBData *private, const struct input_event *event)
 {
-	/* figure out the channel to use based on serial number */
-	int i, channel = -1;
+	int64_t now, hw;
 
-	/* force events from PAD device to PAD_CHANNEL */
-	if (serial == -1)
-		channel = PAD_CHANNEL;
+	if (private->wcmMonotonic)
+		now = (int64_t)event->input_event_sec * 1000000 +
+		      event->input_event_usec;
+	else
+		now = wcmMonotonicTime();
+	private->wcmKernelTime = now;
 
-	/* find existing channel */
-	if (channel < 0)
-	{
-		for (i=0; i<MAX_CHANNELS; i++)
-		{
-			if (common->wcmChannel[i].work.proximity &&
-			    common->wcmChannel[i].work.device_type == device_type &&
-			    common->wcmChannel[i].work.serial_num == serial)
-			{
-				channel = i;
-				break;
-			}
-		}
-	}
+	if (!private->wcmHwFrame)
+		return now;
 
-	/* find and clean an empty channel */
-	if (channel < 0)
-	{
-		for (i=0; i<MAX_CHANNELS; i++)
-		{
-			if (i == PAD_CHANNEL)
-				continue;
+	private->wcmHwFrame = FALSE;
 
-			if (!common->wcmChannel[i].work.proximity)
-			{
-				channel = i;
-				memset(&common->wcmChannel[channel],0, sizeof(WacomChannel));
-				break;
-			}
-		}
-	}
+	/* unsigned arithmetic copes with the stamp wrapping */
+	hw = private->wcmHwTime +
+	     (unsigned int)(private->wcmHwStamp - private->wcmHwLast);
+	if (!private->wcmHwTime ||
+	    hw < now - USB_HW_TIME_SLACK || hw > now + USB_HW_TIME_SLACK)
+		hw = now;
 
-	/* fresh out of channels */
-	if (channel < 0)
-	{
-		/* This should never happen in normal use.
-		 * Let's start over again. Force prox-out for all channels.
-		 */
-		for (i=0; i<MAX_CHANNELS; i++)
-		{
-			if (i == PAD_CHANNEL)
-				continue;
+	private->wcmHwLast = private->wcmHwStamp;
+	private->wcmHwTime = hw;
 
-			if (common->wcmChannel[i].work.proximity &&
-			    (common->wcmChannel[i].work.serial_num != -1))
-			{
-				common->wcmChannel[i].work.proximity = 0;
-				/* dispatch event */
-				wcmEvent(common, i, &common->wcmChannel[i].work);
-				DBG(2, common, "free channels: dropping %u\n",
-						common->wcmChannel[i].work.serial_num);
-			}
-		}
-		DBG(1, common, "device with serial number: %u"
-		    " at %d: Exceeded channel count; ignoring the events.\n",
-		    serial, (int)GetTimeInMillis());
-	}
+	return hw;
+}
 
-	return channel;
+/* @return The time of the frame being dispatched, in µs */
+static inline int64_t usbEventTime(WacomCommonPtr common)
+{
+	wcmUSBData *private = common->private;
+
+	return private->wcmEventTime;
 }
 
 static void usbParseEvent(InputInfoPtr pInfo,
@@ -969,6 +966,28 @@ static void usbParseEvent(InputInfoPtr pInfo,
 
 	DBG(10, common, "\n");
 
+	/* after a SYN_DROPPED the stream resumes somewhere in the middle of
+	 * a frame. Ignore everything up to the next SYN_REPORT, then ask
+	 * the kernel for the current state instead */
+	if (private->wcmSynDropped)
+	{
+		if (event->type == EV_SYN && event->code == SYN_REPORT)
+		{
+			private->wcmSynDropped = FALSE;
+			private->wcmEventTime = usbFrameTime(private, event);
+			usbResync(pInfo);
+		}
+		return;
+	}
+
+	/* the hardware timestamp only times the frame, it carries no state */
+	if (event->type == EV_MSC && event->code == MSC_TIMESTAMP)
+	{
+		private->wcmHwStamp = event->value;
+		private->wcmHwFrame = TRUE;
+		return;
+	}
+
 	/* store events until we receive the MSC_SERIAL containing
 	 * the serial number or a SYN_REPORT.
 	 */
@@ -976,8 +995,9 @@ static void usbParseEvent(InputInfoPtr pInfo,
 	/* space left? bail if not. */
 	if (private->wcmEventCnt >= ARRAY_SIZE(private->wcmEvents))
 	{
-		LogMessageVerbSigSafe(X_ERROR, 0, "%s: usbParse: Exceeded event queue (%d) \n",
-				      pInfo->name, private->wcmEventCnt);
+		common->wcmEventStats.overflows++;
+		LOG_RATELIMITED(common, X_ERROR, "%s: usbParse: Exceeded event queue (%d) \n",
+				pInfo->name, private->wcmEventCnt);
 		private->wcmEventCnt = 0;
 		return;
 	}
@@ -1008,9 +1028,9 @@ static void usbParseSynEvent(InputInfoPtr pInfo,
 		 * but we never report a serial number with a value of 0 */
 		if (event->value == 0)
 		{
-			LogMessageVerbSigSafe(X_ERROR, 0,
-					      "%s: usbParse: Ignoring event from invalid serial 0\n",
-					      pInfo->name);
+			LOG_RATELIMITED(common, X_ERROR,
+					"%s: usbParse: Ignoring event from invalid serial 0\n",
+					pInfo->name);
 			goto skipEvent;
 		}
 
@@ -1023,6 +1043,16 @@ static void usbParseSynEvent(InputInfoPtr pInfo,
 	{
 		/* end of record. fall through to dispatch */
 	}
+	else if ((event->type == EV_SYN) && (event->code == SYN_DROPPED))
+	{
+		/* the kernel's buffer overflowed, we're not keeping up.
+		 * Whatever is queued is an incomplete frame. */
+		common->wcmReadStats.syn_dropped++;
+		private->wcmSynDropped = TRUE;
+		private->wcmHwFrame = FALSE;
+		private->wcmHwTime = 0;
+		goto skipEvent;
+	}
 	else
 	{
 		/* not an SYN_REPORT and not an SYN_REPORT, bail out */
@@ -1046,6 +1076,7 @@ static void usbParseSynEvent(InputInfoPtr pInfo,
 	}
 
 	/* dispatch all queued events */
+	private->wcmEventTime = usbFrameTime(private, event);
 	usbDispatchEvents(pInfo);
 
 skipEvent:
@@ -1237,7 +1268,7 @@ static void usbParseAbsEvent(WacomCommonPtr common,
 			change = 0;
 	}
 
-	ds->time = (int)GetTimeInMillis();
+	wcmSetStateTime(ds, usbEventTime(common));
 	channel->dirty |= change;
 }
 
@@ -1257,9 +1288,9 @@ mod_buttons(int buttons, int btn, int state)
 
 	if (btn >= sizeof(int) * 8)
 	{
-		LogMessageVerbSigSafe(X_ERROR, 0,
-				      "%s: Invalid button number %d. Insufficient storage\n",
-				      __func__, btn);
+		LOG_RATELIMITED(NULL, X_ERROR,
+				"%s: Invalid button number %d. Insufficient storage\n",
+				__func__, btn);
 		return buttons;
 	}
 
@@ -1286,7 +1317,7 @@ static void usbParseAbsMTEvent(WacomCommonPtr common, struct input_event *event)
 		case ABS_MT_SLOT:
 			if (event->value >= 0) {
 				int serial = event->value + 1;
-				private->wcmMTChannel = usbChooseChannel(common, TOUCH_ID, serial);
+				private->wcmMTChannel = wcmChooseChannel(common, TOUCH_ID, serial);
 				if (private->wcmMTChannel < 0)
 					return;
 				ds = &common->wcmChannel[private->wcmMTChannel].work;
@@ -1299,7 +1330,7 @@ static void usbParseAbsMTEvent(WacomCommonPtr common, struct input_event *event)
 			/* set this here as type for this channel doesn't get set in usbDispatchEvent() */
 			ds->device_type = TOUCH_ID;
 			ds->device_id = TOUCH_DEVICE_ID;
-			ds->sample = (int)GetTimeInMillis();
+			ds->sample = (int)(usbEventTime(common) / 1000);
 			break;
 
 		case ABS_MT_POSITION_X:
@@ -1318,7 +1349,7 @@ static void usbParseAbsMTEvent(WacomCommonPtr common, struct input_event *event)
 			change = 0;
 	}
 
-	ds->time = (int)GetTimeInMillis();
+	wcmSetStateTime(ds, usbEventTime(common));
 	(&common->wcmChannel[private->wcmMTChannel])->dirty |= change;
 }
 
@@ -1328,7 +1359,7 @@ static void usbParseKeyEvent(WacomCommonPtr common,
 	int change = 1;
 	WacomChannel *channel = &common->wcmChannel[channel_number];
 	WacomDeviceState *ds = &channel->work;
-	WacomDeviceState *dslast = &channel->valid.state;
+	WacomDeviceState *dslast = wcmChannelState(channel, 0);
 
 	/* BTN_TOOL_* are sent to indicate when a specific tool is going
 	 * in our out of proximity.  When going in proximity, here we
@@ -1410,7 +1441,7 @@ static void usbParseKeyEvent(WacomCommonPtr common,
 			/* time stamp for 2FGT gesture events */
 			if ((ds->proximity && !dslast->proximity) ||
 			    (!ds->proximity && dslast->proximity))
-				ds->sample = (int)GetTimeInMillis();
+				ds->sample = (int)(usbEventTime(common) / 1000);
 			break;
 
 		case BTN_TOOL_TRIPLETAP:
@@ -1422,7 +1453,7 @@ static void usbParseKeyEvent(WacomCommonPtr common,
 			/* time stamp for 2GT gesture events */
 			if ((ds->proximity && !dslast->proximity) ||
 			    (!ds->proximity && dslast->proximity))
-				ds->sample = (int)GetTimeInMillis();
+				ds->sample = (int)(usbEventTime(common) / 1000);
 			/* Second finger events will be considered in
 			 * combination with the first finger data */
 			break;
@@ -1431,7 +1462,7 @@ static void usbParseKeyEvent(WacomCommonPtr common,
 			change = 0;
 	}
 
-	ds->time = (int)GetTimeInMillis();
+	wcmSetStateTime(ds, usbEventTime(common));
 	channel->dirty |= change;
 
 	if (change)
@@ -1458,7 +1489,7 @@ static void usbParseKeyEvent(WacomCommonPtr common,
 			change = 0;
 	}
 
-	ds->time = (int)GetTimeInMillis();
+	wcmSetStateTime(ds, usbEventTime(common));
 	channel->dirty |= change;
 }
 
@@ -1509,7 +1540,7 @@ static void usbParseBTNEvent(WacomCommonPtr common,
 				change = 0;
 	}
 
-	ds->time = (int)GetTimeInMillis();
+	wcmSetStateTime(ds, usbEventTime(common));
 	channel->dirty |= change;
 }
 
@@ -1694,16 +1725,18 @@ static Bool usbIsTabletToolInProx(int device_type, int proximity)
 
 static void usbDispatchEvents(InputInfoPtr pInfo)
 {
-	int i, c;
+	int i;
 	WacomDeviceState *ds;
 	struct input_event* event;
 	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
 	WacomCommonPtr common = priv->common;
 	int channel;
 	wcmUSBData* private = common->private;
-	WacomDeviceState dslast = common->wcmChannel[private->lastChannel].valid.state;
+	WacomDeviceState dslast = *wcmChannelState(&common->wcmChannel[private->lastChannel], 0);
 
 	DBG(6, common, "%d events received\n", private->wcmEventCnt);
+	WCM_TRACE_KERNEL(common, private->wcmKernelTime);
+	WCM_TRACE_PROBE(common, TRACE_DISPATCH);
 
 	private->wcmDeviceType = usbInitToolType(common, pInfo->fd,
 	                                         private->wcmEvents,
@@ -1728,7 +1761,7 @@ static void usbDispatchEvents(InputInfoPtr pInfo)
 	}
 
 	private->wcmLastToolSerial = protocol5Serial(private->wcmDeviceType, private->wcmLastToolSerial);
-	channel = usbChooseChannel(common, private->wcmDeviceType, private->wcmLastToolSerial);
+	channel = wcmChooseChannel(common, private->wcmDeviceType, private->wcmLastToolSerial);
 
 	/* couldn't decide channel? invalid data */
 	if (channel == -1) {
@@ -1737,12 +1770,12 @@ static void usbDispatchEvents(InputInfoPtr pInfo)
 	}
 
 	ds = &common->wcmChannel[channel].work;
-	dslast = common->wcmChannel[channel].valid.state;
+	dslast = *wcmChannelState(&common->wcmChannel[channel], 0);
 
 	if (ds->device_type && ds->device_type != private->wcmDeviceType)
-		LogMessageVerbSigSafe(X_ERROR, 0,
-				      "usbDispatchEvents: Device Type mismatch - %d -> %d. This is a BUG.\n",
-				      ds->device_type, private->wcmDeviceType);
+		LOG_RATELIMITED(common, X_ERROR,
+				"usbDispatchEvents: Device Type mismatch - %d -> %d. This is a BUG.\n",
+				ds->device_type, private->wcmDeviceType);
 	/* no device type? */
 	if (!ds->device_type && private->wcmDeviceType) {
 		ds->device_type = private->wcmDeviceType;
@@ -1792,13 +1825,13 @@ static void usbDispatchEvents(InputInfoPtr pInfo)
 			if (event->code == REL_WHEEL)
 			{
 				ds->relwheel = -event->value;
-				ds->time = (int)GetTimeInMillis();
+				wcmSetStateTime(ds, usbEventTime(common));
 				common->wcmChannel[channel].dirty |= TRUE;
 			}
 			else
-				LogMessageVerbSigSafe(X_ERROR, 0,
-						      "%s: rel event recv'd (%d)!\n",
-						      pInfo->name, event->code);
+				LOG_RATELIMITED(common, X_ERROR,
+						"%s: rel event recv'd (%d)!\n",
+						pInfo->name, event->code);
 		}
 		else if (event->type == EV_KEY)
 		{
@@ -1848,6 +1881,15 @@ static void usbDispatchEvents(InputInfoPtr pInfo)
 
 	private->lastChannel = channel;
 
+	usbDispatchChannels(common);
+}
+
+/* Send the work state of every channel that changed to wcmEvent */
+static void usbDispatchChannels(WacomCommonPtr common)
+{
+	WacomDeviceState *ds;
+	int c;
+
 	for (c = 0; c < MAX_CHANNELS; c++) {
 		ds = &common->wcmChannel[c].work;
 
@@ -1862,6 +1904,272 @@ static void usbDispatchEvents(InputInfoPtr pInfo)
 	}
 }
 
+/**
+ * Check the kernel's key state for a BTN_TOOL_* (or BTN_TOUCH) that keeps
+ * a tool of the given type in proximity.
+ */
+static Bool usbToolInProx(WacomCommonPtr common, const unsigned long *keys,
+			  int device_type)
+{
+	static const int tool_codes[] = {
+		BTN_TOOL_PEN, BTN_TOOL_PENCIL, BTN_TOOL_BRUSH,
+		BTN_TOOL_AIRBRUSH, BTN_TOOL_RUBBER, BTN_TOOL_MOUSE,
+		BTN_TOOL_LENS, BTN_TOOL_FINGER, BTN_TOOL_DOUBLETAP,
+		BTN_TOOL_TRIPLETAP, BTN_TOUCH
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tool_codes); i++)
+	{
+		if (ISBITSET(keys, tool_codes[i]) &&
+		    deviceTypeFromEvent(common, EV_KEY, tool_codes[i], 0) == device_type)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Feed the kernel's current state of a key through the given parser */
+static void usbResyncKey(WacomCommonPtr common, const unsigned long *keys,
+			 int code, int channel,
+			 void (*parse)(WacomCommonPtr, struct input_event *, int))
+{
+	struct input_event event = { .type = EV_KEY, .code = code };
+
+	event.value = ISBITSET(keys, code) ? 1 : 0;
+	parse(common, &event, channel);
+}
+
+/* Feed the kernel's current value of an axis through usbParseAbsEvent */
+static void usbResyncAbs(InputInfoPtr pInfo, const unsigned long *abs,
+			 int code, int channel)
+{
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	struct input_event event = { .type = EV_ABS, .code = code };
+	struct input_absinfo absinfo;
+
+	if (!ISBITSET(abs, code) ||
+	    ioctl(pInfo->fd, EVIOCGABS(code), &absinfo) < 0)
+		return;
+
+	event.value = absinfo.value;
+	usbParseAbsEvent(priv->common, &event, channel);
+}
+
+/* Force a channel out of proximity, releasing anything still held */
+static void usbResyncProxOut(WacomCommonPtr common, int channel)
+{
+	wcmUSBData *private = common->private;
+	WacomDeviceState *ds = &common->wcmChannel[channel].work;
+
+	DBG(2, common, "resync: channel %d (serial %u) left proximity\n",
+	    channel, ds->serial_num);
+
+	if (ds->serial_num == private->wcmLastToolSerial)
+		private->wcmLastToolSerial = 0;
+
+	ds->proximity = 0;
+	ds->buttons = 0;
+	ds->pressure = 0;
+	wcmSetStateTime(ds, usbEventTime(common));
+	common->wcmChannel[channel].dirty = TRUE;
+}
+
+/**
+ * Resync the touch channels of a multitouch device from the kernel's
+ * slot state. Contacts that went away are sent out of proximity, the
+ * remaining ones get their current position.
+ */
+static void usbResyncMT(InputInfoPtr pInfo, const unsigned long *abs)
+{
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	WacomCommonPtr common = priv->common;
+	wcmUSBData *private = common->private;
+	struct {
+		__u32 code;
+		__s32 values[MAX_FINGERS];
+	} tracking, x, y, pressure;
+	struct input_absinfo absinfo;
+	int nslots = min(common->wcmMaxContacts, MAX_FINGERS);
+	int c, slot;
+
+	tracking.code = ABS_MT_TRACKING_ID;
+	x.code = ABS_MT_POSITION_X;
+	y.code = ABS_MT_POSITION_Y;
+	pressure.code = ABS_MT_PRESSURE;
+
+	if (ioctl(pInfo->fd, EVIOCGMTSLOTS(sizeof(tracking)), &tracking) < 0 ||
+	    ioctl(pInfo->fd, EVIOCGMTSLOTS(sizeof(x)), &x) < 0 ||
+	    ioctl(pInfo->fd, EVIOCGMTSLOTS(sizeof(y)), &y) < 0)
+	{
+		DBG(1, common, "unable to retrieve MT slot state\n");
+		return;
+	}
+
+	if (!ISBITSET(abs, ABS_MT_PRESSURE) ||
+	    ioctl(pInfo->fd, EVIOCGMTSLOTS(sizeof(pressure)), &pressure) < 0)
+		memset(pressure.values, 0, sizeof(pressure.values));
+
+	/* contacts that lifted while we weren't looking */
+	for (c = 0; c < MAX_CHANNELS; c++)
+	{
+		WacomDeviceState *ds = &common->wcmChannel[c].work;
+
+		if (!ds->proximity || ds->device_type != TOUCH_ID)
+			continue;
+
+		slot = ds->serial_num - 1;
+		if (slot < 0 || slot >= nslots || tracking.values[slot] == -1)
+			usbResyncProxOut(common, c);
+	}
+
+	/* contacts that are still, or newly, down */
+	for (slot = 0; slot < nslots; slot++)
+	{
+		WacomDeviceState *ds;
+
+		if (tracking.values[slot] == -1)
+			continue;
+
+		c = wcmChooseChannel(common, TOUCH_ID, slot + 1);
+		if (c < 0)
+			continue;
+
+		ds = &common->wcmChannel[c].work;
+		if (!ds->proximity)
+		{
+			ds->proximity = 1;
+			ds->device_type = TOUCH_ID;
+			ds->device_id = TOUCH_DEVICE_ID;
+			ds->serial_num = slot + 1;
+			ds->sample = (int)(usbEventTime(common) / 1000);
+		}
+		ds->x = x.values[slot];
+		ds->y = y.values[slot];
+		ds->pressure = pressure.values[slot];
+		wcmSetStateTime(ds, usbEventTime(common));
+		common->wcmChannel[c].dirty = TRUE;
+	}
+
+	/* events following the resync apply to the current slot */
+	if (ioctl(pInfo->fd, EVIOCGABS(ABS_MT_SLOT), &absinfo) == 0 &&
+	    absinfo.value >= 0)
+	{
+		c = wcmChooseChannel(common, TOUCH_ID, absinfo.value + 1);
+		if (c >= 0)
+		{
+			private->wcmMTChannel = c;
+			common->wcmChannel[c].work.serial_num = absinfo.value + 1;
+		}
+	}
+}
+
+/**
+ * Re-read the device state after the kernel signalled SYN_DROPPED. The
+ * events that were lost may have included prox-outs and button releases,
+ * so rather than trusting the channels we compare them against the
+ * key, axis and MT slot state from the kernel, synthesize whatever
+ * changed and dispatch it as if it had been a regular frame.
+ */
+static void usbResync(InputInfoPtr pInfo)
+{
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	WacomCommonPtr common = priv->common;
+	wcmUSBData *private = common->private;
+	unsigned long keys[NBITS(KEY_MAX)] = { 0 };
+	unsigned long abs[NBITS(ABS_MAX)] = { 0 };
+	static const int tool_axes[] = {
+		ABS_X, ABS_Y, ABS_PRESSURE, ABS_DISTANCE,
+		ABS_TILT_X, ABS_TILT_Y
+	};
+	int c, i;
+
+	DBG(1, common, "%s: SYN_DROPPED, resyncing with the kernel\n",
+	    pInfo->name);
+
+	if (ioctl(pInfo->fd, EVIOCGKEY(sizeof(keys)), keys) < 0 ||
+	    ioctl(pInfo->fd, EVIOCGBIT(EV_ABS, sizeof(abs)), abs) < 0)
+	{
+		LOG_RATELIMITED(common, X_ERROR,
+				"%s: unable to resync device state: %s\n",
+				pInfo->name, strerror(errno));
+		return;
+	}
+
+	for (c = 0; c < MAX_CHANNELS; c++)
+	{
+		WacomDeviceState *ds = &common->wcmChannel[c].work;
+
+		if (!ds->proximity)
+			continue;
+
+		switch (ds->device_type)
+		{
+			case STYLUS_ID:
+			case ERASER_ID:
+			case CURSOR_ID:
+				if (!usbToolInProx(common, keys, ds->device_type))
+				{
+					usbResyncProxOut(common, c);
+					break;
+				}
+
+				for (i = 0; i < ARRAY_SIZE(tool_axes); i++)
+					usbResyncAbs(pInfo, abs, tool_axes[i], c);
+
+				if (ds->device_type == CURSOR_ID)
+				{
+					for (i = 0; i < ARRAY_SIZE(mouse_codes); i++)
+						usbResyncKey(common, keys, mouse_codes[i],
+							     c, usbParseBTNEvent);
+				}
+				else
+				{
+					usbResyncKey(common, keys, BTN_STYLUS, c,
+						     usbParseKeyEvent);
+					usbResyncKey(common, keys, BTN_STYLUS2, c,
+						     usbParseKeyEvent);
+				}
+				break;
+
+			case TOUCH_ID:
+				/* MT contacts are handled per slot below */
+				if (private->wcmUseMT)
+					break;
+
+				if (!usbToolInProx(common, keys, TOUCH_ID))
+				{
+					usbResyncProxOut(common, c);
+					break;
+				}
+				usbResyncAbs(pInfo, abs, ABS_X, c);
+				usbResyncAbs(pInfo, abs, ABS_Y, c);
+				break;
+
+			case PAD_ID:
+				if (common->wcmProtocolLevel != WCM_PROTOCOL_GENERIC &&
+				    !usbToolInProx(common, keys, PAD_ID))
+				{
+					usbResyncProxOut(common, c);
+					break;
+				}
+
+				for (i = 0; i < ARRAY_SIZE(mouse_codes); i++)
+					usbResyncKey(common, keys, mouse_codes[i],
+						     c, usbParseBTNEvent);
+				for (i = 0; i < private->npadkeys; i++)
+					usbResyncKey(common, keys, private->padkey_code[i],
+						     c, usbParseBTNEvent);
+				break;
+		}
+	}
+
+	if (private->wcmUseMT)
+		usbResyncMT(pInfo, abs);
+
+	usbDispatchChannels(common);
+}
+
 /* Quirks to unify the tool and tablet types for GENERIC protocol tablet PCs
  *
  * @param[in,out] keys Contains keys queried from hardware. If a
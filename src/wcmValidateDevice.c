@@ -25,6 +25,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <math.h>
 
 /* wcmCheckSource - Check if there is another source defined this device
  * before or not: don't add the tool by hal/udev if user has defined at least
@@ -871,20 +873,98 @@ Bool wcmPreInitParseOptions(InputInfoPtr pInfo, Bool is_primary,
 	 * Linear curve is 0,0,100,100
 	 * Slightly depressed curve might be 5,0,100,95
 	 * Slightly raised curve might be 0,5,95,100
+	 * Three or more points x,y give a curve through those points,
+	 * e.g. 0,0,30,15,70,60,100,100
 	 */
 	s = xf86SetStrOption(pInfo->options, "PressCurve", "0,0,100,100");
 	if (s && (IsPen(priv) || IsTouch(priv)))
 	{
-		int a,b,c,d;
-		if ((sscanf(s,"%d,%d,%d,%d",&a,&b,&c,&d) != 4) ||
-				!wcmCheckPressureCurveValues(a, b, c, d))
+		int ctrl[2 * PRESSURE_CURVE_KNOTS + 1];
+		int n = 0, len;
+		const char *p = s;
+
+		while (n < ARRAY_SIZE(ctrl) &&
+		       sscanf(p, "%d%n", &ctrl[n], &len) == 1)
+		{
+			n++;
+			p += len;
+			if (*p != ',')
+				break;
+			p++;
+		}
+
+		if (*p || !wcmCheckPressureCurve(ctrl, n))
 			xf86Msg(X_CONFIG, "%s: PressCurve not valid\n",
 				pInfo->name);
 		else
-			wcmSetPressureCurve(priv,a,b,c,d);
+			wcmSetPressureCurvePoints(priv, ctrl, n);
 	}
 	free(s);
 
+	s = xf86SetStrOption(pInfo->options, "Filter", NULL);
+	if (s)
+	{
+		int mode = wcmFilterModeFromName(s);
+
+		if (mode < 0)
+			xf86Msg(X_CONFIG, "%s: Filter '%s' not valid\n",
+				pInfo->name, s);
+		else
+			wcmSetFilterMode(priv, mode);
+		free(s);
+	}
+
+	s = xf86SetStrOption(pInfo->options, "FilterParams", NULL);
+	if (s)
+	{
+		int params[2];
+
+		if (sscanf(s, "%d,%d", &params[0], &params[1]) != 2 ||
+		    !wcmCheckFilterParams(priv->filterMode, params))
+			xf86Msg(X_CONFIG, "%s: FilterParams not valid\n",
+				pInfo->name);
+		else
+		{
+			priv->filterParams[0] = params[0];
+			priv->filterParams[1] = params[1];
+		}
+		free(s);
+	}
+
+	s = xf86SetStrOption(pInfo->options, "CalibrationMatrix", NULL);
+	if (s)
+	{
+		double m[9];
+		int matrix[9];
+		int i, n;
+
+		n = sscanf(s, "%lf %lf %lf %lf %lf %lf %lf %lf %lf",
+			   &m[0], &m[1], &m[2], &m[3], &m[4], &m[5],
+			   &m[6], &m[7], &m[8]);
+		for (i = 0; i < n; i++)
+		{
+			/* the property is fixed point, keep to what it can hold */
+			if (!(fabs(m[i]) <= (double)INT_MAX / (1 << WCM_TRANSFORM_SHIFT)))
+				break;
+			matrix[i] = lround(m[i] * (1 << WCM_TRANSFORM_SHIFT));
+		}
+
+		if (n != 9 || i != 9 || !wcmCheckCalibration(matrix))
+			xf86Msg(X_CONFIG, "%s: CalibrationMatrix not valid\n",
+				pInfo->name);
+		else
+			memcpy(priv->calibMatrix, matrix, sizeof(priv->calibMatrix));
+		free(s);
+	}
+
+	priv->prediction = xf86SetIntOption(pInfo->options, "Prediction", 0);
+	if (priv->prediction < 0 || priv->prediction > MAX_PREDICTION)
+	{
+		xf86Msg(X_ERROR, "%s: Prediction setting '%d' out of range [0..%d]. Disabling.\n",
+			pInfo->name, priv->prediction, MAX_PREDICTION);
+		priv->prediction = 0;
+	}
+
 	if (xf86SetBoolOption(pInfo->options, "Pressure2K", 0)) {
 		xf86Msg(X_CONFIG, "%s: Using 2K pressure levels\n", pInfo->name);
 		priv->maxCurve = 2048;
@@ -1005,6 +1085,16 @@ Bool wcmPreInitParseOptions(InputInfoPtr pInfo, Bool is_primary,
 		common->wcmPressureRecalibration
 			= xf86SetBoolOption(pInfo->options,
 					    "PressureRecalibration", 1);
+
+		/* the first pen device with a store loads it for all */
+		if (!common->wcmPressureStore)
+		{
+			common->wcmPressureStore =
+				xf86SetStrOption(pInfo->options,
+						 "PressureStore", NULL);
+			if (common->wcmPressureStore)
+				wcmLoadPenPressure(common);
+		}
 	}
 
 	/* Swap stylus buttons 2 and 3 for Tablet PCs */
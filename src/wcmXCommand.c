@@ -82,7 +82,9 @@ int wcmDevSwitchMode(ClientPtr client, DeviceIntPtr dev, int mode)
 static Atom prop_devnode;
 static Atom prop_rotation;
 static Atom prop_tablet_area;
+static Atom prop_calibration;
 static Atom prop_pressurecurve;
+static Atom prop_tool_pressurecurve;
 static Atom prop_serials;
 static Atom prop_serial_binding;
 static Atom prop_strip_buttons;
@@ -90,6 +92,8 @@ static Atom prop_wheel_buttons;
 static Atom prop_cursorprox;
 static Atom prop_threshold;
 static Atom prop_suppress;
+static Atom prop_filter;
+static Atom prop_prediction;
 static Atom prop_touch;
 static Atom prop_hardware_touch;
 static Atom prop_gesture;
@@ -99,10 +103,19 @@ static Atom prop_tooltype;
 static Atom prop_btnactions;
 static Atom prop_product_id;
 static Atom prop_pressure_recal;
+static Atom prop_read_stats;
+static Atom prop_event_stats;
+#if WCM_TRACE
+static Atom prop_trace_hist;
+static Atom prop_trace_log;
+#endif
 #ifdef DEBUG
 static Atom prop_debuglevels;
 #endif
 
+/* TRUE while wcmGetProperty refreshes a read-only statistics property */
+static Bool wcmUpdatingStats;
+
 /**
  * Calculate a user-visible pressure level from a driver-internal pressure
  * level. Pressure settings exposed to the user assume a range of 0-2047
@@ -125,17 +138,46 @@ static inline int wcmUserToInternalPressure(InputInfoPtr pInfo, int pressure)
 	return pressure * (priv->maxCurve / 2048);
 }
 
+/**
+ * Look up the program for an action array and put it in place of the old
+ * one, which the input thread may still be running.
+ *
+ * @return FALSE if out of memory, the old program stays in place.
+ */
+static Bool wcmUpdateActionProgram(WacomAction **prog, const unsigned int *keys,
+				   int nkeys)
+{
+	WacomAction *new_prog, *old;
+
+	new_prog = wcmGetAction(keys, nkeys);
+	if (!new_prog)
+		return FALSE;
+
+#if HAVE_THREADED_INPUT
+	input_lock();
+#endif
+	old = *prog;
+	*prog = new_prog;
+#if HAVE_THREADED_INPUT
+	input_unlock();
+#endif
+	wcmReleaseAction(old);
+
+	return TRUE;
+}
+
 /**
  * Resets an arbitrary Action property, given a pointer to the old
  * handler and information about the new Action.
  */
 static void wcmResetAction(InputInfoPtr pInfo, const char *name, int index,
-                           Atom *handler, unsigned int (*action)[256],
+                           Atom *handler, WacomAction **prog,
                            unsigned int (*new_action)[256], Atom prop, int nprop)
 {
 	handler[index] = MakeAtom(name, strlen(name), TRUE);
-	memset(action[index], 0, sizeof(action[index]));
-	memcpy(action[index], *new_action, sizeof(*new_action));
+	if (!wcmUpdateActionProgram(&prog[index], *new_action, ARRAY_SIZE(*new_action)))
+		xf86Msg(X_ERROR, "%s: unable to allocate memory for '%s'\n",
+			pInfo->name, name);
 	XIChangeDeviceProperty(pInfo->dev, handler[index], XA_INTEGER, 32,
 			       PropModeReplace, 1, (char*)new_action, FALSE);
 }
@@ -149,7 +191,7 @@ static void wcmResetButtonAction(InputInfoPtr pInfo, int button, int nbuttons)
 
 	sprintf(name, "Wacom button action %d", button);
 	new_action[0] = AC_BUTTON | AC_KEYBTNPRESS | x11_button;
-	wcmResetAction(pInfo, name, button, priv->btn_actions, priv->keys, &new_action, prop_btnactions, nbuttons);
+	wcmResetAction(pInfo, name, button, priv->btn_actions, priv->btn_prog, &new_action, prop_btnactions, nbuttons);
 }
 
 static void wcmResetStripAction(InputInfoPtr pInfo, int index)
@@ -161,7 +203,7 @@ static void wcmResetStripAction(InputInfoPtr pInfo, int index)
 	sprintf(name, "Wacom strip action %d", index);
 	new_action[0] =	AC_BUTTON | AC_KEYBTNPRESS | (priv->strip_default[index]);
 	new_action[1] = AC_BUTTON | (priv->strip_default[index]);
-	wcmResetAction(pInfo, name, index, priv->strip_actions, priv->strip_keys, &new_action, prop_strip_buttons, 4);
+	wcmResetAction(pInfo, name, index, priv->strip_actions, priv->strip_prog, &new_action, prop_strip_buttons, 4);
 }
 
 static void wcmResetWheelAction(InputInfoPtr pInfo, int index)
@@ -173,7 +215,7 @@ static void wcmResetWheelAction(InputInfoPtr pInfo, int index)
 	sprintf(name, "Wacom wheel action %d", index);
 	new_action[0] = AC_BUTTON | AC_KEYBTNPRESS | (priv->wheel_default[index]);
 	new_action[1] = AC_BUTTON | (priv->wheel_default[index]);
-	wcmResetAction(pInfo, name, index, priv->wheel_actions, priv->wheel_keys, &new_action, prop_wheel_buttons, 6);
+	wcmResetAction(pInfo, name, index, priv->wheel_actions, priv->wheel_prog, &new_action, prop_wheel_buttons, 6);
 }
 
 /**
@@ -226,6 +268,54 @@ static Atom InitWcmAtom(DeviceIntPtr dev, const char *name, Atom type, int forma
 	return atom;
 }
 
+static void wcmReadStatsValues(WacomCommonPtr common, int *values)
+{
+	const WacomReadStats *stats = &common->wcmReadStats;
+
+	values[0] = stats->wakeups;
+	values[1] = stats->reads;
+	values[2] = stats->bytes;
+	values[3] = stats->max_reads;
+	values[4] = stats->max_bytes;
+	values[5] = stats->loop_cap;
+	values[6] = stats->syn_dropped;
+}
+
+static void wcmEventStatsValues(WacomCommonPtr common, int *values)
+{
+	const WacomEventStats *stats = &common->wcmEventStats;
+	int age = (int)GetTimeInMillis() - stats->window_start;
+
+	values[0] = stats->posted;
+	/* nothing was posted in the last full second if the window is old */
+	values[1] = age >= 2000 ? 0 : age >= 1000 ? stats->window : stats->rate;
+	values[2] = stats->suppressed;
+	values[3] = stats->overflows;
+	values[4] = stats->no_channel;
+	values[5] = stats->resyncs;
+}
+
+#if WCM_TRACE
+/* Refresh one of the read-only trace properties from the trace ring */
+static int wcmUpdateTraceProperty(DeviceIntPtr dev, Atom property,
+				  WacomCommonPtr common)
+{
+	int values[TRACE_RING * 3];
+	int n, rc;
+
+	if (property == prop_trace_hist)
+		n = wcmTraceHistogram(common, values, ARRAY_SIZE(values));
+	else
+		n = wcmTraceLog(common, values, ARRAY_SIZE(values));
+
+	wcmUpdatingStats = TRUE;
+	rc = XIChangeDeviceProperty(dev, property, XA_INTEGER, 32,
+				    PropModeReplace, n, values, FALSE);
+	wcmUpdatingStats = FALSE;
+	return rc;
+}
+#endif
+
 void InitWcmDeviceProperties(InputInfoPtr pInfo)
 {
 	WacomDevicePtr priv = (WacomDevicePtr) pInfo->private;
@@ -247,6 +337,9 @@ void InitWcmDeviceProperties(InputInfoPtr pInfo)
 		values[2] = priv->bottomX;
 		values[3] = priv->bottomY;
 		prop_tablet_area = InitWcmAtom(pInfo->dev, WACOM_PROP_TABLET_AREA, XA_INTEGER, 32, 4, values);
+
+		memcpy(values, priv->calibMatrix, sizeof(priv->calibMatrix));
+		prop_calibration = InitWcmAtom(pInfo->dev, WACOM_PROP_CALIBRATION, XA_INTEGER, 32, 9, values);
 	}
 
 	values[0] = common->wcmRotate;
@@ -255,11 +348,13 @@ void InitWcmDeviceProperties(InputInfoPtr pInfo)
 	}
 
 	if (IsPen(priv) || IsTouch(priv)) {
-		values[0] = priv->nPressCtrl[0];
-		values[1] = priv->nPressCtrl[1];
-		values[2] = priv->nPressCtrl[2];
-		values[3] = priv->nPressCtrl[3];
-		prop_pressurecurve = InitWcmAtom(pInfo->dev, WACOM_PROP_PRESSURECURVE, XA_INTEGER, 32, 4, values);
+		memcpy(values, priv->nPressCtrl, priv->nPressCtrlCount * sizeof(int));
+		prop_pressurecurve = InitWcmAtom(pInfo->dev, WACOM_PROP_PRESSURECURVE, XA_INTEGER, 32, priv->nPressCtrlCount, values);
+	}
+
+	if (IsPen(priv)) {
+		/* tool curves are only ever written */
+		prop_tool_pressurecurve = InitWcmAtom(pInfo->dev, WACOM_PROP_TOOL_PRESSURECURVE, XA_INTEGER, 32, 0, values);
 	}
 
 	values[0] = common->tablet_id;
@@ -285,6 +380,16 @@ void InitWcmDeviceProperties(InputInfoPtr pInfo)
 	values[1] = common->wcmRawSample;
 	prop_suppress = InitWcmAtom(pInfo->dev, WACOM_PROP_SAMPLE, XA_INTEGER, 32, 2, values);
 
+	if (!IsPad(priv)) {
+		values[0] = priv->filterMode;
+		values[1] = priv->filterParams[0];
+		values[2] = priv->filterParams[1];
+		prop_filter = InitWcmAtom(pInfo->dev, WACOM_PROP_FILTER, XA_INTEGER, 32, 3, values);
+
+		values[0] = priv->prediction;
+		prop_prediction = InitWcmAtom(pInfo->dev, WACOM_PROP_PREDICTION, XA_INTEGER, 32, 1, values);
+	}
+
 	values[0] = common->wcmTouch;
 	prop_touch = InitWcmAtom(pInfo->dev, WACOM_PROP_TOUCH, XA_INTEGER, 8, 1, values);
 
@@ -336,6 +441,18 @@ void InitWcmDeviceProperties(InputInfoPtr pInfo)
 						  XA_INTEGER, 8, 1, values);
 	}
 
+	wcmReadStatsValues(common, values);
+	prop_read_stats = InitWcmAtom(pInfo->dev, WACOM_PROP_READ_STATS, XA_INTEGER, 32, 7, values);
+
+	wcmEventStatsValues(common, values);
+	prop_event_stats = InitWcmAtom(pInfo->dev, WACOM_PROP_EVENT_STATS, XA_INTEGER, 32, 6, values);
+
+#if WCM_TRACE
+	/* both are filled in when queried */
+	prop_trace_hist = InitWcmAtom(pInfo->dev, WACOM_PROP_TRACE_HISTOGRAM, XA_INTEGER, 32, 0, values);
+	prop_trace_log = InitWcmAtom(pInfo->dev, WACOM_PROP_TRACE_LOG, XA_INTEGER, 32, 0, values);
+#endif
+
 	values[0] = common->vendor_id;
 	values[1] = common->tablet_id;
 	prop_product_id = InitWcmAtom(pInfo->dev, XI_PROP_PRODUCT_ID, XA_INTEGER, 32, 2, values);
@@ -369,11 +486,12 @@ static int wcmFindProp(Atom property, Atom *prop_list, int nprops)
  * @param priv          The device whose handler lists should be searched
  * @param property      The Action property that should be searched for
  * @param[out] handler  Returns a pointer to the property's handler
- * @param[out] action   Returns a pointer to the property's action list
+ * @param[out] prog     Returns a pointer to the property's action program
  * @return              'true' if the property was found. Neither out parameter
  *                      will be null if this is the case.
  */
-static BOOL wcmFindActionHandler(WacomDevicePtr priv, Atom property, Atom **handler, unsigned int (**action)[256])
+static BOOL wcmFindActionHandler(WacomDevicePtr priv, Atom property, Atom **handler,
+				 WacomAction ***prog)
 {
 	int offset;
 
@@ -381,7 +499,7 @@ static BOOL wcmFindActionHandler(WacomDevicePtr priv, Atom property, Atom **hand
 	if (offset >=0)
 	{
 		*handler = &priv->btn_actions[offset];
-		*action  = &priv->keys[offset];
+		*prog    = &priv->btn_prog[offset];
 		return TRUE;
 	}
 
@@ -389,7 +507,7 @@ static BOOL wcmFindActionHandler(WacomDevicePtr priv, Atom property, Atom **hand
 	if (offset >= 0)
 	{
 		*handler = &priv->wheel_actions[offset];
-		*action  = &priv->wheel_keys[offset];
+		*prog    = &priv->wheel_prog[offset];
 		return TRUE;
 	}
 
@@ -397,7 +515,7 @@ static BOOL wcmFindActionHandler(WacomDevicePtr priv, Atom property, Atom **hand
 	if (offset >= 0)
 	{
 		*handler = &priv->strip_actions[offset];
-		*action  = &priv->strip_keys[offset];
+		*prog    = &priv->strip_prog[offset];
 		return TRUE;
 	}
 
@@ -468,22 +586,23 @@ static int wcmCheckActionProperty(WacomDevicePtr priv, Atom property, XIProperty
  * An 'Action' property (such as an element of "Wacom Button Actions")
  * defines an action to be performed for some event. The property is
  * validated, and then saved for later use. Both the property itself
- * (as 'handler') and the data it references (as 'action') are saved.
+ * (as 'handler') and the data it references, compiled (as 'prog'), are
+ * saved.
  *
  * @param dev        The device being modified
  * @param property   The Action property being set
  * @param prop       The data contained in 'property'
  * @param checkonly  'true' if the property should only be checked for validity
  * @param handler    Pointer to the handler that must be updated
- * @param action     Pointer to the action list that must be updated
+ * @param prog       Pointer to the action program that must be updated
  */
 static int wcmSetActionProperty(DeviceIntPtr dev, Atom property,
 				XIPropertyValuePtr prop, BOOL checkonly,
-				Atom *handler, unsigned int (*action)[256])
+				Atom *handler, WacomAction **prog)
 {
 	InputInfoPtr pInfo = (InputInfoPtr) dev->public.devicePrivate;
 	WacomDevicePtr priv = (WacomDevicePtr) pInfo->private;
-	int rc, i;
+	int rc;
 
 	DBG(5, priv, "%s new actions for Atom %d\n", checkonly ? "Checking" : "Setting", property);
 
@@ -501,10 +620,11 @@ static int wcmSetActionProperty(DeviceIntPtr dev, Atom property,
 
 	if (!checkonly)
 	{
-		memset(action, 0, sizeof(*action));
-		for (i = 0; i < prop->size; i++)
-			(*action)[i] = ((unsigned int*)prop->data)[i];
 		*handler = property;
+
+		if (!wcmUpdateActionProgram(prog, (unsigned int*)prop->data,
+					    prop->size))
+			return BadAlloc;
 	}
 
 	return Success;
@@ -546,11 +666,11 @@ static int wcmCheckActionsProperty(DeviceIntPtr dev, Atom property, XIPropertyVa
  * @param checkonly  'true' if the property should only be checked for validity
  * @param size       Expected number of elements in 'prop'
  * @param handlers   List of handlers that must be updated
- * @param actions    List of actions that must be updated
+ * @param progs      List of action programs that must be updated
  */
 static int wcmSetActionsProperty(DeviceIntPtr dev, Atom property,
                                  XIPropertyValuePtr prop, BOOL checkonly,
-                                 int size, Atom* handlers, unsigned int (*actions)[256])
+                                 int size, Atom* handlers, WacomAction **progs)
 {
 	InputInfoPtr pInfo = (InputInfoPtr) dev->public.devicePrivate;
 	WacomDevicePtr priv = (WacomDevicePtr) pInfo->private;
@@ -599,7 +719,7 @@ static int wcmSetActionsProperty(DeviceIntPtr dev, Atom property,
 		else
 		{
 			XIGetDeviceProperty(dev, subproperty, &subprop);
-			rc = wcmSetActionProperty(dev, subproperty, subprop, checkonly, &handlers[index], &actions[index]);
+			rc = wcmSetActionProperty(dev, subproperty, subprop, checkonly, &handlers[index], &progs[index]);
 			if (rc != Success)
 				return rc;
 		}
@@ -748,26 +868,63 @@ int wcmSetProperty(DeviceIntPtr dev, Atom property, XIPropertyValuePtr prop,
 			priv->topY = values[1];
 			priv->bottomX = values[2];
 			priv->bottomY = values[3];
+			wcmUpdateTransform(pInfo);
+		}
+	} else if (property == prop_calibration)
+	{
+		INT32 *values = (INT32*)prop->data;
+
+		if (prop->size != 9 || prop->format != 32)
+			return BadValue;
+
+		if (!wcmCheckCalibration(values))
+			return BadValue;
+
+		if (!checkonly)
+		{
+			memcpy(priv->calibMatrix, values, sizeof(priv->calibMatrix));
+			wcmUpdateCalibration(priv);
 		}
 	} else if (property == prop_pressurecurve)
 	{
-		INT32 *pcurve;
+		int pcurve[2 * PRESSURE_CURVE_KNOTS];
+		int i;
 
-		if (prop->size != 4 || prop->format != 32)
+		if (prop->size > ARRAY_SIZE(pcurve) || prop->format != 32)
 			return BadValue;
 
-		pcurve = (INT32*)prop->data;
+		for (i = 0; i < prop->size; i++)
+			pcurve[i] = ((INT32*)prop->data)[i];
 
-		if (!wcmCheckPressureCurveValues(pcurve[0], pcurve[1],
-						 pcurve[2], pcurve[3]))
+		if (!wcmCheckPressureCurve(pcurve, prop->size))
 			return BadValue;
 
 		if (IsCursor(priv) || IsPad (priv))
 			return BadValue;
 
 		if (!checkonly)
-			wcmSetPressureCurve (priv, pcurve[0], pcurve[1],
-					pcurve[2], pcurve[3]);
+			wcmSetPressureCurvePoints(priv, pcurve, prop->size);
+	} else if (property == prop_tool_pressurecurve)
+	{
+		int pcurve[2 * PRESSURE_CURVE_KNOTS];
+		CARD32 serial;
+		int i, n;
+
+		if (prop->size < 1 || prop->size > ARRAY_SIZE(pcurve) + 1 ||
+		    prop->format != 32)
+			return BadValue;
+
+		serial = ((CARD32*)prop->data)[0];
+		n = prop->size - 1;
+		for (i = 0; i < n; i++)
+			pcurve[i] = ((INT32*)prop->data)[i + 1];
+
+		if (n && !wcmCheckPressureCurve(pcurve, n))
+			return BadValue;
+
+		if (!checkonly &&
+		    !wcmSetToolPressureCurve(common, serial, pcurve, n))
+			return BadAlloc;
 	} else if (property == prop_suppress)
 	{
 		CARD32 *values;
@@ -788,6 +945,47 @@ int wcmSetProperty(DeviceIntPtr dev, Atom property, XIPropertyValuePtr prop,
 			common->wcmSuppress = values[0];
 			common->wcmRawSample = values[1];
 		}
+	} else if (property == prop_filter)
+	{
+		CARD32 *values;
+		int params[2];
+
+		if (prop->size != 3 || prop->format != 32)
+			return BadValue;
+
+		values = (CARD32*)prop->data;
+
+		if (values[0] >= FILTER_MODES)
+			return BadValue;
+
+		if (values[1] > INT_MAX || values[2] > INT_MAX)
+			return BadValue;
+
+		params[0] = values[1];
+		params[1] = values[2];
+		if (!wcmCheckFilterParams(values[0], params))
+			return BadValue;
+
+		if (!checkonly)
+		{
+			priv->filterMode = values[0];
+			priv->filterParams[0] = params[0];
+			priv->filterParams[1] = params[1];
+		}
+	} else if (property == prop_prediction)
+	{
+		CARD32 value;
+
+		if (prop->size != 1 || prop->format != 32)
+			return BadValue;
+
+		value = *(CARD32*)prop->data;
+
+		if (value > MAX_PREDICTION)
+			return BadValue;
+
+		if (!checkonly)
+			priv->prediction = value;
 	} else if (property == prop_rotation)
 	{
 		CARD8 value;
@@ -813,6 +1011,17 @@ int wcmSetProperty(DeviceIntPtr dev, Atom property, XIPropertyValuePtr prop,
 				return Success;
 
 		return BadValue; /* Read-only */
+	} else if (property == prop_read_stats || property == prop_event_stats)
+	{
+		/* Read-only, but refreshed from wcmGetProperty */
+		if (!wcmUpdatingStats)
+			return BadValue;
+#if WCM_TRACE
+	} else if (property == prop_trace_hist || property == prop_trace_log)
+	{
+		if (!wcmUpdatingStats)
+			return BadValue;
+#endif
 	} else if (property == prop_serial_binding)
 	{
 		unsigned int serial;
@@ -826,9 +1035,9 @@ int wcmSetProperty(DeviceIntPtr dev, Atom property, XIPropertyValuePtr prop,
 			wcmBindToSerial(pInfo, serial);
 		}
 	} else if (property == prop_strip_buttons)
-		return wcmSetActionsProperty(dev, property, prop, checkonly, ARRAY_SIZE(priv->strip_actions), priv->strip_actions, priv->strip_keys);
+		return wcmSetActionsProperty(dev, property, prop, checkonly, ARRAY_SIZE(priv->strip_actions), priv->strip_actions, priv->strip_prog);
 	else if (property == prop_wheel_buttons)
-		return wcmSetActionsProperty(dev, property, prop, checkonly, ARRAY_SIZE(priv->wheel_actions), priv->wheel_actions, priv->wheel_keys);
+		return wcmSetActionsProperty(dev, property, prop, checkonly, ARRAY_SIZE(priv->wheel_actions), priv->wheel_actions, priv->wheel_prog);
 	else if (property == prop_cursorprox)
 	{
 		CARD32 value;
@@ -956,7 +1165,7 @@ int wcmSetProperty(DeviceIntPtr dev, Atom property, XIPropertyValuePtr prop,
 	} else if (property == prop_btnactions)
 	{
 		int nbuttons = priv->nbuttons < 4 ? priv->nbuttons : priv->nbuttons + 4;
-		return wcmSetActionsProperty(dev, property, prop, checkonly, nbuttons, priv->btn_actions, priv->keys);
+		return wcmSetActionsProperty(dev, property, prop, checkonly, nbuttons, priv->btn_actions, priv->btn_prog);
 	} else if (property == prop_pressure_recal)
 	{
 		CARD8 *values = (CARD8*)prop->data;
@@ -975,9 +1184,9 @@ int wcmSetProperty(DeviceIntPtr dev, Atom property, XIPropertyValuePtr prop,
 	} else
 	{
 		Atom *handler = NULL;
-		unsigned int (*action)[256] = NULL;
-		if (wcmFindActionHandler(priv, property, &handler, &action))
-			return wcmSetActionProperty(dev, property, prop, checkonly, handler, action);
+		WacomAction **prog = NULL;
+		if (wcmFindActionHandler(priv, property, &handler, &prog))
+			return wcmSetActionProperty(dev, property, prop, checkonly, handler, prog);
 		/* backwards-compatible behavior silently ignores the not-found case */
 	}
 
@@ -1045,6 +1254,36 @@ int wcmGetProperty (DeviceIntPtr dev, Atom property)
 		                              PropModeReplace, ARRAY_SIZE(priv->wheel_actions),
 		                              priv->wheel_actions, FALSE);
 	}
+	else if (property == prop_read_stats)
+	{
+		int values[7];
+		int rc;
+
+		/* the counters keep moving in the input thread, so the
+		 * setter can't compare against them like prop_serials */
+		wcmReadStatsValues(common, values);
+		wcmUpdatingStats = TRUE;
+		rc = XIChangeDeviceProperty(dev, property, XA_INTEGER, 32,
+					    PropModeReplace, 7, values, FALSE);
+		wcmUpdatingStats = FALSE;
+		return rc;
+	}
+	else if (property == prop_event_stats)
+	{
+		int values[6];
+		int rc;
+
+		wcmEventStatsValues(common, values);
+		wcmUpdatingStats = TRUE;
+		rc = XIChangeDeviceProperty(dev, property, XA_INTEGER, 32,
+					    PropModeReplace, 6, values, FALSE);
+		wcmUpdatingStats = FALSE;
+		return rc;
+	}
+#if WCM_TRACE
+	else if (property == prop_trace_hist || property == prop_trace_log)
+		return wcmUpdateTraceProperty(dev, property, common);
+#endif
 
 	return Success;
 }
@@ -423,11 +423,14 @@ static int wcmDevInit(DeviceIntPtr pWcm)
 	if (!IsPad(priv))
 	{
 		wcmInitialToolSize(pInfo);
+		wcmUpdateCalibration(priv);
 	}
 
 	if (!wcmInitAxes(pWcm))
 		return FALSE;
 
+	wcmUpdateTransform(pInfo);
+
 	InitWcmDeviceProperties(pInfo);
 	XIRegisterPropertyHandler(pInfo->dev, wcmSetProperty, wcmGetProperty, wcmDeleteProperty);
 
@@ -555,6 +558,7 @@ static int wcmDevOpen(DeviceIntPtr pWcm)
 	WacomCommonPtr common = priv->common;
 	WacomModelPtr model = common->wcmModel;
 	struct stat st;
+	int fd_flags;
 
 	DBG(10, priv, "\n");
 
@@ -599,6 +603,12 @@ got_fd:
 	if (model->Start && (model->Start(pInfo) != Success))
 		return !Success;
 
+	/* with a non-blocking fd wcmDevReadInput can read until EAGAIN
+	 * instead of select()ing before every read */
+	fd_flags = fcntl(pInfo->fd, F_GETFL);
+	common->wcmReadDrain = (fd_flags != -1) &&
+		(fcntl(pInfo->fd, F_SETFL, fd_flags | O_NONBLOCK) == 0);
+
 	return TRUE;
 }
 
@@ -622,32 +632,74 @@ static int wcmReady(InputInfoPtr pInfo)
 
 static void wcmDevReadInput(InputInfoPtr pInfo)
 {
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	WacomCommonPtr common = priv->common;
+	WacomReadStats *stats = &common->wcmReadStats;
+	unsigned int bytes = stats->bytes;
 	int loop=0;
 	#define MAX_READ_LOOPS 10
 
-	/* move data until we exhaust the device */
+	/* move data until we exhaust the device. A non-blocking fd tells
+	 * us so by failing the read with EAGAIN, otherwise ask select() */
 	for (loop=0; loop < MAX_READ_LOOPS; ++loop)
 	{
 		/* verify that there is still data in pipe */
-		if (!wcmReady(pInfo)) break;
+		if (!common->wcmReadDrain && !wcmReady(pInfo)) break;
 
 		/* dispatch */
 		if (!wcmReadPacket(pInfo))
 			break;
 	}
 
-#ifdef DEBUG
 	/* report how well we're doing */
 	if (loop > 0)
 	{
-		WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+		bytes = stats->bytes - bytes;
+
+		stats->wakeups++;
+		if (loop > stats->max_reads)
+			stats->max_reads = loop;
+		if (bytes > stats->max_bytes)
+			stats->max_bytes = bytes;
 
 		if (loop >= MAX_READ_LOOPS)
+		{
+			stats->loop_cap++;
 			DBG(1, priv, "Can't keep up!!!\n");
+		}
 		else
 			DBG(10, priv, "Read (%d)\n",loop);
 	}
-#endif
+}
+
+/* Read from the device and account for it in the read statistics. Returns
+ * the number of bytes read, or <= 0 on error (including EAGAIN once a
+ * non-blocking fd has been drained). */
+int wcmRead(InputInfoPtr pInfo, void *buf, int len)
+{
+	WacomDevicePtr priv = (WacomDevicePtr)pInfo->private;
+	WacomCommonPtr common = priv->common;
+
+	len = xf86ReadSerial(pInfo->fd, buf, len);
+
+	if (len <= 0)
+	{
+		/* for all other errors, hope that the hotplugging code will
+		 * remove the device */
+		if (errno != EAGAIN && errno != EINTR)
+			LOG_RATELIMITED(common, X_ERROR,
+					"%s: Error reading wacom device : %s\n", pInfo->name, strerror(errno));
+		if (errno == ENODEV)
+			xf86RemoveEnabledDevice(pInfo);
+
+		return len;
+	}
+
+	common->wcmReadStats.reads++;
+	common->wcmReadStats.bytes += len;
+	WCM_TRACE_PROBE(common, TRACE_READ);
+
+	return len;
 }
 
 Bool wcmReadPacket(InputInfoPtr pInfo)
@@ -658,26 +710,19 @@ Bool wcmReadPacket(InputInfoPtr pInfo)
 
 	DBG(10, common, "fd=%d\n", pInfo->fd);
 
+	/* backends that read whole records themselves skip the byte
+	 * buffer entirely */
+	if (common->wcmModel->ReadPacket)
+		return common->wcmModel->ReadPacket(pInfo);
+
 	remaining = sizeof(common->buffer) - common->bufpos;
 
 	DBG(1, common, "pos=%d remaining=%d\n", common->bufpos, remaining);
 
 	/* fill buffer with as much data as we can handle */
-	len = xf86ReadSerial(pInfo->fd,
-		common->buffer + common->bufpos, remaining);
-
+	len = wcmRead(pInfo, common->buffer + common->bufpos, remaining);
 	if (len <= 0)
-	{
-		/* for all other errors, hope that the hotplugging code will
-		 * remove the device */
-		if (errno != EAGAIN && errno != EINTR)
-			LogMessageVerbSigSafe(X_ERROR, 0,
-					      "%s: Error reading wacom device : %s\n", pInfo->name, strerror(errno));
-		if (errno == ENODEV)
-			xf86RemoveEnabledDevice(pInfo);
-
 		return FALSE;
-	}
 
 	/* account for new data */
 	common->bufpos += len;
@@ -861,8 +906,14 @@ static int wcmDevProc(DeviceIntPtr pWcm, int what)
 			TimerCancel(priv->tap_timer);
 			TimerCancel(priv->serial_timer);
 			TimerCancel(priv->touch_timer);
+			if (priv->common->wcmModel->Stop)
+				priv->common->wcmModel->Stop(pInfo);
+			TimerCancel(priv->init_timer);
 			wcmDisableTool(pWcm);
 			wcmUnlinkTouchAndPen(pInfo);
+			if (IsPen(priv))
+				wcmSavePenPressure(priv->common);
+			wcmLogLimitFlush(priv->common);
 			if (pInfo->fd >= 0)
 			{
 				xf86RemoveEnabledDevice(pInfo);
@@ -69,6 +69,27 @@
 #define DBG(lvl, priv, ...)
 #endif
 
+/* Rate-limited logging for errors in the input path. Every call site logs
+ * at most LOG_LIMIT_BURST messages per LOG_LIMIT_INTERVAL ms and tablet,
+ * the ones dropped beyond that are counted and the count is logged once
+ * the interval is over, see wcmLogLimit. common may be NULL for messages
+ * not tied to a tablet. */
+#define LOG_RATELIMITED(common, type, ...) \
+	do { \
+		static const char wcm_log_site; \
+		if (wcmLogLimit(common, &wcm_log_site, __func__)) \
+			LogMessageVerbSigSafe(type, 0, __VA_ARGS__); \
+	} while (0)
+
+/* Latency probes, compiled out unless configured with --enable-trace */
+#if WCM_TRACE
+#define WCM_TRACE_PROBE(common, stage) wcmTraceProbe(common, stage)
+#define WCM_TRACE_KERNEL(common, time) wcmTraceKernel(common, time)
+#else
+#define WCM_TRACE_PROBE(common, stage) do {} while (0)
+#define WCM_TRACE_KERNEL(common, time) do {} while (0)
+#endif
+
 /******************************************************************************
  * WacomModule - all globals are packed in a single structure to keep the
  *               global namespaces as clean as possible.
@@ -122,8 +143,36 @@ int wcmInitTablet(InputInfoPtr pInfo, const char* id, float version);
 /* standard packet handler */
 Bool wcmReadPacket(InputInfoPtr pInfo);
 
+/* read() from the device fd, updating the read statistics */
+int wcmRead(InputInfoPtr pInfo, void *buf, int len);
+
 /* handles suppression, filtering, and dispatch. */
 void wcmEvent(WacomCommonPtr common, unsigned int channel, const WacomDeviceState* ds);
+int wcmChooseChannel(WacomCommonPtr common, int device_type, unsigned int serial);
+/* CLOCK_MONOTONIC in µs, the time base of WacomDeviceState.time_us */
+int64_t wcmMonotonicTime(void);
+
+/* see LOG_RATELIMITED */
+Bool wcmLogLimit(WacomCommonPtr common, const void *site, const char *func);
+void wcmLogLimitFlush(WacomCommonPtr common);
+
+/* button, strip and wheel actions */
+WacomAction *wcmGetAction(const unsigned int *keys, int nkeys);
+void wcmReleaseAction(WacomAction *prog);
+
+/* base pressures of worn pens, see rebasePressure */
+int wcmLookupPenPressure(const WacomCommonPtr common, unsigned int serial,
+			 int device_type);
+void wcmStorePenPressure(WacomCommonPtr common, unsigned int serial,
+			 int device_type, int pressure);
+void wcmLoadPenPressure(WacomCommonPtr common);
+void wcmSavePenPressure(WacomCommonPtr common);
+
+/* latency tracing, see WCM_TRACE_PROBE */
+void wcmTraceProbe(WacomCommonPtr common, enum WacomTraceStage stage);
+void wcmTraceKernel(WacomCommonPtr common, int64_t time);
+int wcmTraceHistogram(WacomCommonPtr common, int *values, int nvalues);
+int wcmTraceLog(WacomCommonPtr common, int *values, int nvalues);
 
 /* dispatches data to XInput event system */
 void wcmSendEvents(InputInfoPtr pInfo, const WacomDeviceState* ds);
@@ -154,6 +203,9 @@ extern void wcmCancelGesture(InputInfoPtr pInfo);
 
 extern void wcmRotateTablet(InputInfoPtr pInfo, int value);
 extern void wcmRotateAndScaleCoordinates(InputInfoPtr pInfo, int* x, int* y);
+extern void wcmUpdateTransform(InputInfoPtr pInfo);
+extern Bool wcmCheckCalibration(const int *matrix);
+extern void wcmUpdateCalibration(WacomDevicePtr priv);
 
 extern int wcmCheckPressureCurveValues(int x0, int y0, int x1, int y1);
 extern int wcmGetPhyDeviceID(WacomDevicePtr priv);
@@ -203,6 +255,7 @@ extern int getScrollDelta(int current, int old, int wrap, int flags);
 extern int getWheelButton(int delta, int action_up, int action_dn);
 extern int rebasePressure(const WacomDevicePtr priv, const WacomDeviceState *ds);
 extern int normalizePressure(const WacomDevicePtr priv, const int raw_pressure);
+extern void updatePressure(WacomDevicePtr priv, WacomDeviceStatePtr ds);
 extern enum WacomSuppressMode wcmCheckSuppress(WacomCommonPtr common,
 						const WacomDeviceState* dsOrig,
 						WacomDeviceState* dsNew);
@@ -93,6 +93,25 @@
 #define ABS_MT_SLOT 0x2f
 #endif
 
+/* 2.6.39 */
+
+#ifndef EVIOCSCLOCKID
+#define EVIOCSCLOCKID _IOW('E', 0xa0, int)
+#endif
+
+/* 4.3 */
+
+#ifndef MSC_TIMESTAMP
+#define MSC_TIMESTAMP 0x05
+#endif
+
+/* 4.16, input_event.time is not a timeval with 64 bit time_t on 32 bit */
+
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
 /******************************************************************************
  * Forward Declarations
  *****************************************************************************/
@@ -105,6 +124,9 @@ typedef struct _WacomCommonRec WacomCommonRec, *WacomCommonPtr;
 typedef struct _WacomFilterState WacomFilterState, *WacomFilterStatePtr;
 typedef struct _WacomDeviceClass WacomDeviceClass, *WacomDeviceClassPtr;
 typedef struct _WacomTool WacomTool, *WacomToolPtr;
+typedef struct _WacomPressureCurve WacomPressureCurve;
+typedef struct _WacomCurveProfile WacomCurveProfile;
+typedef struct _WacomAction WacomAction;
 
 /******************************************************************************
  * WacomModel - model-specific device capabilities
@@ -120,6 +142,12 @@ struct _WacomModel
 	int (*Start)(InputInfoPtr pInfo);
 	int (*Parse)(InputInfoPtr pInfo, const unsigned char* data, int len);
 	int (*DetectConfig)(InputInfoPtr pInfo);
+
+	/* optional: read and parse directly from the fd, bypassing the
+	 * byte-stream buffer and the Parse loop in wcmReadPacket */
+	Bool (*ReadPacket)(InputInfoPtr pInfo);
+	/* optional: the device is about to be disabled */
+	void (*Stop)(InputInfoPtr pInfo);
 };
 
 /******************************************************************************
@@ -181,6 +209,10 @@ struct _WacomModel
 #define IsUSBDevice(common) ((common)->wcmDevCls == &gWacomUSBDevice)
 
 #define FILTER_PRESSURE_RES	65536	/* maximum points in pressure curve */
+#define PRESSURE_CURVE_DEPTH	7	/* most Bezier subdivisions per curve */
+#define PRESSURE_CURVE_POINTS	((1 << PRESSURE_CURVE_DEPTH) + 1)
+#define PRESSURE_CURVE_KNOTS	16	/* most points of a multi-point curve */
+#define PRESSURE_STORE_SIZE	16	/* pens whose base pressure is kept */
 /* Tested result for setting the pressure threshold to a reasonable value */
 #define THRESHOLD_TOLERANCE (0.008f)
 #define DEFAULT_THRESHOLD (0.013f)
@@ -228,7 +260,8 @@ struct _WacomDeviceState
 	int throttle;
 	int proximity;
 	int sample;	/* wraps every 24 days */
-	int time;
+	int time;	/* ms, time_us / 1000 */
+	int64_t time_us; /* event time in µs on CLOCK_MONOTONIC */
 };
 
 static const struct _WacomDeviceState OUTPROX_STATE = {
@@ -236,6 +269,21 @@ static const struct _WacomDeviceState OUTPROX_STATE = {
   .abswheel2 = INT_MAX
 };
 
+/* how priv->calibMatrix is applied, see wcmUpdateCalibration */
+enum WacomCalibMode {
+	CALIB_NONE = 0,		/* identity, skipped */
+	CALIB_AFFINE,		/* fixed point, priv->calibFixed */
+	CALIB_PROJECTIVE	/* needs a division, priv->calib */
+};
+
+/* coordinate filters, see wcmFilterCoord */
+enum WacomFilterMode {
+	FILTER_AVERAGE = 0,	/* box average over RawSample samples */
+	FILTER_ONE_EURO,	/* adaptive low-pass (1 euro filter) */
+	FILTER_KALMAN,		/* constant-velocity Kalman filter */
+	FILTER_MODES
+};
+
 struct _WacomDeviceRec
 {
 	char *name;		/* Do not move, same offset as common->device_path. Used by DBG macro */
@@ -255,26 +303,22 @@ struct _WacomDeviceRec
 	int minY;	        /* tool physical minY in device coordinates */
 	int maxX;	        /* tool physical maxX in device coordinates */
 	int maxY;	        /* tool physical maxY in device coordinates */
+	/* tablet area to axis range transform including rotation, rows
+	 * x and y of an affine matrix in WCM_TRANSFORM_SHIFT fixed point.
+	 * Set up by wcmUpdateTransform. */
+	int64_t transform[2][3];
+	int transformClip[2][2]; /* min and max of the x and y axes */
+	/* user calibration applied in tablet coordinates, see
+	 * wcmUpdateCalibration */
+	int calibMatrix[9];     /* row-major 3x3 matrix on normalized
+				   coordinates, WCM_TRANSFORM_SHIFT fixed point */
+	enum WacomCalibMode calibMode;
+	int64_t calibFixed[2][3]; /* affine matrix in device coordinates */
+	double calib[3][3];     /* projective matrix in device coordinates */
 	unsigned int serial;	/* device serial number this device takes (if 0, any serial is ok) */
 	unsigned int cur_serial; /* current serial in prox */
 	int cur_device_id;	/* current device ID in prox */
 
-	/* button mapping information
-	 *
-	 * 'button' variables are indexed by physical button number (0..nbuttons)
-	 * 'strip' variables are indexed by STRIP_* defines
-	 * 'wheel' variables are indexed by WHEEL_* defines
-	 */
-	int button_default[WCM_MAX_BUTTONS]; /* Default mappings set by ourselves (possibly overridden by xorg.conf) */
-	int strip_default[4];
-	int wheel_default[6];
-	unsigned keys[WCM_MAX_BUTTONS][256]; /* Action codes to perform when the associated event occurs */
-	unsigned strip_keys[4][256];
-	unsigned wheel_keys[6][256];
-	Atom btn_actions[WCM_MAX_BUTTONS];   /* Action references so we can update the action codes when a client makes a change */
-	Atom strip_actions[4];
-	Atom wheel_actions[6];
-
 	int nbuttons;           /* number of buttons for this subdevice */
 	int naxes;              /* number of axes */
 				/* FIXME: always 6, and the code relies on that... */
@@ -286,31 +330,80 @@ struct _WacomDeviceRec
 	int oldCursorHwProx;	/* previous cursor hardware proximity */
 
 	int maxCurve;		/* maximum pressure curve value */
-	int *pPressCurve;       /* pressure curve */
-	int nPressCtrl[4];      /* control points for curve */
+	WacomPressureCurve *pPressCurve; /* pressure curve, NULL if linear */
+	WacomCurveProfile *pToolCurve; /* profile of the tool in proximity */
+	enum WacomFilterMode filterMode; /* coordinate filter for this tool */
+	int filterParams[2];    /* filter specific parameters */
+	int prediction;         /* position look-ahead in ms, 0 disables */
 	int minPressure;	/* the minimum pressure a pen may hold */
 	int oldMinPressure;     /* to record the last minPressure before going out of proximity */
 	unsigned int eventCnt;  /* count number of events while in proximity */
 	int maxRawPressure;     /* maximum 'raw' pressure seen until first button event */
+	int rawMinPressure;     /* lowest raw pressure of this proximity cycle */
+	Bool basePending;       /* storedBase not trusted yet, see rebasePressure */
+	int storedBase;         /* base pressure stored for the pen in proximity */
+	int entryPressure;      /* raw pressure the pen came in with */
 	WacomToolPtr tool;         /* The common tool-structure for this device */
 
+	/* the fields above are used by every event, the ones below only
+	 * when buttons change or the configuration does */
+
+	/* button mapping information
+	 *
+	 * 'button' variables are indexed by physical button number (0..nbuttons)
+	 * 'strip' variables are indexed by STRIP_* defines
+	 * 'wheel' variables are indexed by WHEEL_* defines
+	 */
+	int button_default[WCM_MAX_BUTTONS]; /* Default mappings set by ourselves (possibly overridden by xorg.conf) */
+	int strip_default[4];
+	int wheel_default[6];
+	WacomAction *btn_prog[WCM_MAX_BUTTONS]; /* Actions to perform when the associated event occurs, shared */
+	WacomAction *strip_prog[4];
+	WacomAction *wheel_prog[6];
+	Atom btn_actions[WCM_MAX_BUTTONS];   /* Action references so we can update the action codes when a client makes a change */
+	Atom strip_actions[4];
+	Atom wheel_actions[6];
+
+	int nPressCtrl[2 * PRESSURE_CURVE_KNOTS]; /* control points for curve */
+	int nPressCtrlCount;    /* values in nPressCtrl */
+
 	int isParent;		/* set to 1 if the device is not auto-hotplugged */
 
 	OsTimerPtr serial_timer; /* timer used for serial number property update */
 	OsTimerPtr tap_timer;   /* timer used for tap timing */
 	OsTimerPtr touch_timer; /* timer used for touch switch property update */
+	OsTimerPtr init_timer;  /* timer used for the backend init handshake */
 };
 
+#define WCM_TRANSFORM_SHIFT 16	/* fractional bits of priv->transform */
+
 #define MAX_SAMPLES	20
 #define DEFAULT_SAMPLES 4
+#define MAX_PREDICTION	50	/* maximum position look-ahead in ms */
+
+#define FILTER_AXES 4		/* x, y, tiltx, tilty */
+
+typedef struct {
+	double value;		/* filtered position */
+	double velocity;	/* filtered velocity in units/s */
+	double cov[3];		/* Kalman covariance: pos/pos, pos/vel, vel/vel */
+} WacomFilterAxis;
 
 struct _WacomFilterState
 {
         int npoints;
+        int pos;                /* index of the latest sample */
+        int window;             /* RawSample the sums were built for */
         int x[MAX_SAMPLES];
         int y[MAX_SAMPLES];
         int tiltx[MAX_SAMPLES];
         int tilty[MAX_SAMPLES];
+        /* running sums over the last window samples */
+        int sum_x, sum_y, sum_tiltx, sum_tilty;
+
+        enum WacomFilterMode mode; /* filter the state below was built by */
+        int64_t time;           /* time_us of the last sample */
+        WacomFilterAxis axis[FILTER_AXES];
 };
 
 struct _WacomChannel
@@ -323,19 +416,49 @@ struct _WacomChannel
 	WacomDeviceState work;                         /* next state */
 	Bool dirty;
 
-	/* the following union contains the current known state of the
+	/* the following ring buffer contains the current known state of the
 	 * device channel, as well as the previous MAX_SAMPLES states
-	 * for use in detecting hardware defects, jitter, trends, etc. */
-	union
+	 * for use in detecting hardware defects, jitter, trends, etc.
+	 * Use wcmChannelState() to access it. */
+	struct
 	{
-		WacomDeviceState state;                /* current state */
-		WacomDeviceState states[MAX_SAMPLES];  /* states 0..MAX */
+		WacomDeviceState states[MAX_SAMPLES];  /* ring of states */
+		int head;                              /* index of current state */
 	} valid;
 
 	int nSamples;
 	WacomFilterState rawFilter;
 };
 
+/* Stamp a state with its event time. time_us is what timing logic should
+ * use, the ms time is kept for the gesture timeouts that compare against
+ * GetTimeInMillis-based values. */
+static inline void wcmSetStateTime(WacomDeviceState *ds, int64_t us)
+{
+	ds->time_us = us;
+	ds->time = (int)(us / 1000);
+}
+
+/**
+ * Return the channel's valid state of the given age, zero being the
+ * current state and MAX_SAMPLES - 1 the oldest one kept.
+ */
+static inline WacomDeviceState *wcmChannelState(WacomChannelPtr channel, int age)
+{
+	return &channel->valid.states[(channel->valid.head + age) % MAX_SAMPLES];
+}
+
+/**
+ * Make ds the channel's current valid state. The oldest state is
+ * overwritten, all others age by one.
+ */
+static inline void wcmChannelPushState(WacomChannelPtr channel,
+				       const WacomDeviceState *ds)
+{
+	channel->valid.head = (channel->valid.head + MAX_SAMPLES - 1) % MAX_SAMPLES;
+	channel->valid.states[channel->valid.head] = *ds;
+}
+
 /******************************************************************************
  * WacomDeviceClass
  *****************************************************************************/
@@ -360,6 +483,26 @@ extern WacomDeviceClass gWacomISDV4Device;
 #define MAX_FINGERS 16
 #define MAX_CHANNELS (MAX_FINGERS+2) /* one channel for stylus/mouse. The other one for pad */
 #define PAD_CHANNEL (MAX_CHANNELS-1)
+/* channels wcmChooseChannel may hand out by default */
+#define WCM_CHANNELS (((1u << MAX_CHANNELS) - 1) & ~(1u << PAD_CHANNEL))
+
+#define CHANNEL_MAP_SIZE 32	/* power of two, larger than MAX_CHANNELS */
+#define CHANNEL_MAP_MASK (CHANNEL_MAP_SIZE - 1)
+
+/* one (device_type, serial) -> channel mapping */
+typedef struct {
+	unsigned int serial;
+	unsigned short device_type;
+	unsigned short channel;      /* channel + 1, 0 for an unused entry */
+} WacomChannelKey;
+
+/* open-addressed channel lookup, see wcmChooseChannel */
+typedef struct {
+	WacomChannelKey map[CHANNEL_MAP_SIZE];
+	WacomChannelKey key[MAX_CHANNELS]; /* the key each channel is mapped by */
+	unsigned int mapped;         /* bitmask of channels with a map entry */
+	unsigned int channels;       /* bitmask of channels to hand out */
+} WacomChannelMap;
 
 typedef struct {
 	int wcmZoomDistance;	       /* minimum distance for a zoom touch gesture */
@@ -370,6 +513,124 @@ typedef struct {
 	int wcmTapTime;	   	       /* minimum time between taps for a right click */
 } WacomGesturesParameters;
 
+/******************************************************************************
+ * WacomPressureCurve - a pressure curve as the corners of the polyline
+ * approximating it. Devices with the same curve share it, see wcmFilter.c
+ *****************************************************************************/
+
+struct _WacomPressureCurve {
+	struct _WacomPressureCurve *next;
+	int refs;
+	int max;			/* maxCurve the curve was built for */
+	int nctrl;			/* 4 for a Bezier, else 2 * knots */
+	int ctrl[2 * PRESSURE_CURVE_KNOTS]; /* as given by the user */
+	int npoints;
+	int x[PRESSURE_CURVE_POINTS];	/* ascending */
+	int y[PRESSURE_CURVE_POINTS];
+};
+
+/* An action array compiled for sendAction, shared between all devices
+ * with the same one and never changed once built, see wcmGetAction */
+struct _WacomAction {
+	struct _WacomAction *next;
+	int refs;
+	int npress;			/* actions run on press */
+	int nrelease;			/* actions run on release, after those */
+	unsigned int actions[];
+};
+
+/* The base pressure a pen last rested at, see wcmStorePenPressure */
+typedef struct _WacomPenPressure {
+	unsigned int serial;		/* 0 for an unused entry */
+	int device_type;		/* STYLUS_ID or ERASER_ID */
+	int pressure;			/* raw, as rebasePressure takes it */
+} WacomPenPressure;
+
+/* A pressure curve for one physical tool, see wcmSelectToolPressureCurve */
+struct _WacomCurveProfile {
+	struct _WacomCurveProfile *next;
+	unsigned int serial;
+	WacomPressureCurve *curve;	/* NULL for a linear curve */
+};
+
+/******************************************************************************
+ * WacomReadStats - read statistics of the input thread, see wcmDevReadInput
+ *****************************************************************************/
+
+typedef struct {
+	unsigned int wakeups;        /* read_input callbacks with data */
+	unsigned int reads;          /* successful read() calls */
+	unsigned int bytes;          /* bytes read from the device */
+	unsigned int max_reads;      /* most reads within a single wakeup */
+	unsigned int max_bytes;      /* most bytes within a single wakeup */
+	unsigned int loop_cap;       /* wakeups that hit MAX_READ_LOOPS */
+	unsigned int syn_dropped;    /* SYN_DROPPED events from the kernel */
+} WacomReadStats;
+
+/******************************************************************************
+ * WacomEventStats - event statistics of the tablet, see wcmEventStatsValues
+ *****************************************************************************/
+
+typedef struct {
+	unsigned int posted;         /* states posted by wcmSendEvents */
+	unsigned int suppressed;     /* states dropped by wcmCheckSuppress */
+	unsigned int overflows;      /* frames lost to a full event queue */
+	unsigned int no_channel;     /* tools that found no free channel */
+	unsigned int resyncs;        /* times the parser skipped bad data */
+	unsigned int rate;           /* states posted in the last full second */
+	unsigned int window;         /* states posted in the current second */
+	int window_start;            /* start of the current second, in ms */
+} WacomEventStats;
+
+/******************************************************************************
+ * WacomTrace - latency trace of the input path, see wcmTrace.c
+ *****************************************************************************/
+
+#define TRACE_RING 256		/* records kept, power of two */
+#define TRACE_BUCKETS 20	/* log2 µs latency buckets, up to ~0.5s */
+
+enum WacomTraceStage {
+	TRACE_KERNEL = 0,	/* kernel event time until read, USB only */
+	TRACE_READ,		/* wcmRead, starts a batch */
+	TRACE_DISPATCH,		/* usbDispatchEvents */
+	TRACE_EVENT,		/* wcmEvent */
+	TRACE_DEVICE,		/* commonDispatchDevice */
+	TRACE_SEND,		/* wcmSendEvents, posts the X events */
+	TRACE_STAGES
+};
+
+typedef struct {
+	int64_t time;		/* µs on CLOCK_MONOTONIC */
+	unsigned int latency;	/* µs since the batch was read */
+	int stage;
+} WacomTraceRecord;
+
+typedef struct {
+	int64_t start;		/* time of the last read */
+	unsigned int head;	/* records written so far */
+	WacomTraceRecord ring[TRACE_RING];
+	unsigned int hist[TRACE_STAGES][TRACE_BUCKETS];
+} WacomTrace;
+
+#define LOG_LIMIT_INTERVAL 5000
+#define LOG_LIMIT_BURST 10
+#define LOG_LIMIT_SITES 8	/* call sites tracked per tablet */
+
+typedef struct {
+	const void *site;	 /* call site, NULL if the entry is free */
+	const char *func;	 /* function logging, for the summary */
+	CARD32 start;		 /* start of the current interval */
+	unsigned int count;	 /* messages logged in the interval */
+	unsigned int suppressed; /* messages dropped and not reported yet */
+} WacomLogLimit;
+
+/* see LOG_RATELIMITED */
+typedef struct {
+	WacomLogLimit sites[LOG_LIMIT_SITES];
+	OsTimerPtr timer;	 /* reports the suppressed messages */
+	Bool pending;		 /* timer is armed */
+} WacomLogLimits;
+
 enum WacomProtocol {
 	WCM_PROTOCOL_GENERIC,
 	WCM_PROTOCOL_4,
@@ -443,6 +704,7 @@ struct _WacomCommonRec
 	int wcmRotate;               /* rotate screen (for TabletPC) */
 	int wcmThreshold;            /* Threshold for button pressure */
 	WacomChannel wcmChannel[MAX_CHANNELS]; /* channel device state */
+	WacomChannelMap wcmChannelMap; /* tool to channel lookup */
 
 	WacomDeviceClassPtr wcmDevCls; /* device class functions */
 	WacomModelPtr wcmModel;        /* model-specific functions */
@@ -461,6 +723,17 @@ struct _WacomCommonRec
 	int wcmRawSample;	     /* Number of raw data used to filter an event */
 	int wcmPressureRecalibration; /* Determine if pressure recalibration of
 					 worn pens should be performed */
+	WacomPenPressure wcmPenPressure[PRESSURE_STORE_SIZE]; /* most recent first */
+	Bool wcmPenPressureChanged;   /* store differs from its file */
+	char *wcmPressureStore;       /* file the store persists in, or NULL */
+
+	Bool wcmReadDrain;           /* fd is non-blocking, read until EAGAIN */
+	WacomReadStats wcmReadStats; /* always-on backlog counters */
+	WacomEventStats wcmEventStats; /* always-on event counters */
+	WacomLogLimits wcmLogLimits; /* see LOG_RATELIMITED */
+#if WCM_TRACE
+	WacomTrace wcmTrace;         /* latency probes, --enable-trace */
+#endif
 
 	int bufpos;                        /* position with buffer */
 	unsigned char buffer[BUFFER_SIZE]; /* data read from device */
@@ -469,6 +742,7 @@ struct _WacomCommonRec
 
 	WacomToolPtr wcmTool; /* List of unique tools */
 	WacomToolPtr serials; /* Serial numbers provided at startup*/
+	WacomCurveProfile *wcmCurveProfiles; /* per-tool pressure curves */
 
 	/* DO NOT TOUCH THIS. use wcmRefCommon() instead */
 	int refcnt;			/* number of devices sharing this struct */
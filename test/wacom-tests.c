@@ -22,6 +22,8 @@
 
 #include "fake-symbols.h"
 #include <xf86Wacom.h>
+#include <wcmFilter.h>
+#include <isdv4.h>
 
 /**
  * NOTE: this file may not contain tests that require static variables. The
@@ -146,7 +148,8 @@ test_rebase_pressure(void)
 	WacomDeviceRec priv = {0};
 	WacomDeviceRec base = {0};
 	WacomDeviceState ds = {0};
-	int pressure;
+	WacomCommonRec common = {0};
+	int pressure, i;
 
 	priv.minPressure = 4;
 	ds.pressure = 10;
@@ -171,6 +174,133 @@ test_rebase_pressure(void)
 	pressure = rebasePressure(&priv, &ds);
 	assert(pressure == priv.minPressure);
 	assert(memcmp(&priv, &base, sizeof(priv)) == 0);
+
+	/* A known pen starts out with the pressure it last rested at */
+	priv.common = &common;
+	priv.oldState.proximity = 0;
+	ds.serial_num = 0x1234;
+	ds.device_type = STYLUS_ID;
+	wcmStorePenPressure(&common, 0x1234, STYLUS_ID, 6);
+	priv.maxCurve = 2048;
+	common.wcmMaxZ = 2047;
+	common.wcmThreshold = 10;
+	assert(rebasePressure(&priv, &ds) == 6);
+
+	/* a pen resting well above what was stored wore further */
+	common.wcmThreshold = 2;
+	assert(rebasePressure(&priv, &ds) == ds.pressure);
+	common.wcmThreshold = 10;
+
+	/* the other end of the pen is not known */
+	ds.device_type = ERASER_ID;
+	assert(rebasePressure(&priv, &ds) == ds.pressure);
+
+	/* the pen seen longest ago is dropped first */
+	for (i = 1; i < PRESSURE_STORE_SIZE; i++)
+		wcmStorePenPressure(&common, i, STYLUS_ID, i);
+	assert(wcmLookupPenPressure(&common, 0x1234, STYLUS_ID) == 6);
+	wcmStorePenPressure(&common, 0x1234, STYLUS_ID, 7);
+	wcmStorePenPressure(&common, PRESSURE_STORE_SIZE, STYLUS_ID, 0);
+	assert(wcmLookupPenPressure(&common, 0x1234, STYLUS_ID) == 7);
+	assert(wcmLookupPenPressure(&common, 1, STYLUS_ID) == -1);
+}
+
+static void
+test_transform_clip(void)
+{
+	InputInfoRec pInfo = {0};
+	WacomDeviceRec priv = {0};
+	WacomCommonRec common = {0};
+	DeviceIntRec dev = {0};
+	ValuatorClassRec valuator = {0};
+	AxisInfo axes[2] = {{0}};
+	int x, y;
+
+	axes[0].max_value = 1000;
+	axes[1].max_value = 500;
+	valuator.axes = axes;
+	dev.valuator = &valuator;
+	pInfo.dev = &dev;
+	pInfo.private = &priv;
+	priv.pInfo = &pInfo;
+	priv.common = &common;
+
+	/* an Area smaller than the sensor */
+	priv.topX = 100;
+	priv.bottomX = 300;
+	priv.topY = 100;
+	priv.bottomY = 200;
+	wcmUpdateTransform(&pInfo);
+
+	x = 200;
+	y = 150;
+	wcmRotateAndScaleCoordinates(&pInfo, &x, &y);
+	assert(x == 500 && y == 250);
+
+	/* outside the area is the edge of the axis */
+	x = 50;
+	y = 400;
+	wcmRotateAndScaleCoordinates(&pInfo, &x, &y);
+	assert(x == 0 && y == 500);
+
+	common.wcmRotate = ROTATE_CW;
+	wcmUpdateTransform(&pInfo);
+	x = 400;
+	y = 0;
+	wcmRotateAndScaleCoordinates(&pInfo, &x, &y);
+	assert(x == 0 && y == 0);
+}
+
+/* feed a pen state through updatePressure like commonDispatchDevice does */
+static int
+update_pressure(WacomDevicePtr priv, WacomDeviceState *ds, int raw)
+{
+	WacomDeviceState filtered = *ds;
+
+	filtered.pressure = raw;
+	updatePressure(priv, &filtered);
+	priv->oldState = filtered;
+	return filtered.buttons & 1; /* the pressure button */
+}
+
+static void
+test_known_pen_pressure(void)
+{
+	WacomDeviceRec priv = {0};
+	WacomDeviceState ds = {0};
+	WacomCommonRec common = {0};
+	int i;
+
+	priv.common = &common;
+	priv.flags = STYLUS_ID;
+	priv.maxCurve = 2048;
+	common.wcmMaxZ = 2047;
+	common.wcmThreshold = 27;
+	common.wcmPressureRecalibration = 1;
+	ds.proximity = 1;
+	ds.serial_num = 0x1234;
+	ds.device_type = STYLUS_ID;
+	wcmStorePenPressure(&common, 0x1234, STYLUS_ID, 6);
+
+	/* resting at the stored pressure, pressing clicks right away */
+	assert(!update_pressure(&priv, &ds, 10));
+	assert(priv.minPressure == 6);
+	assert(update_pressure(&priv, &ds, 500));
+
+	/* pressed down as it came in, the click follows once it moves */
+	priv.oldState.proximity = 0;
+	priv.oldState.buttons = 0;
+	assert(!update_pressure(&priv, &ds, 500));
+	assert(update_pressure(&priv, &ds, 600));
+	assert(priv.minPressure == 6);
+
+	/* worn further, the steady rest pressure never clicks */
+	priv.oldState.proximity = 0;
+	priv.oldState.buttons = 0;
+	for (i = 0; i < 20; i++)
+		assert(!update_pressure(&priv, &ds, 60 + i % 2));
+	assert(!priv.basePending);
+	assert(priv.minPressure == 60);
 }
 
 static void
@@ -625,10 +755,211 @@ static void test_flag_set(void)
 	}
 }
 
+/* byte by byte reference for isdv4FindHeader */
+static size_t find_header_scalar(const unsigned char *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (data[i] & HEADER_BIT)
+			break;
+
+	return i;
+}
+
+static void test_isdv4_find_header(void)
+{
+	unsigned char buffer[96];
+	size_t offset, len;
+	int i, round;
+
+	srand(0x1234);
+
+	/* sparse and dense header bytes, all alignments and lengths */
+	for (round = 0; round < 64; round++)
+	{
+		int density = (round % 4) * 8 + 1;
+
+		for (i = 0; i < sizeof(buffer); i++)
+		{
+			buffer[i] = rand() & 0x7f;
+			if (rand() % (density * 4) == 0)
+				buffer[i] |= HEADER_BIT;
+		}
+
+		for (offset = 0; offset < 16; offset++)
+			for (len = 0; len <= sizeof(buffer) - offset; len++)
+				assert(isdv4FindHeader(buffer + offset, len) ==
+				       find_header_scalar(buffer + offset, len));
+	}
+
+	/* no header at all */
+	memset(buffer, 0x7f, sizeof(buffer));
+	assert(isdv4FindHeader(buffer, sizeof(buffer)) == sizeof(buffer));
+
+	/* packet validation */
+	buffer[0] = HEADER_BIT;
+	assert(isdv4ValidPacket(buffer, ISDV4_PKGLEN_TPCPEN));
+	buffer[ISDV4_PKGLEN_TPCPEN - 1] |= HEADER_BIT;
+	assert(!isdv4ValidPacket(buffer, ISDV4_PKGLEN_TPCPEN));
+	assert(isdv4ValidPacket(buffer, ISDV4_PKGLEN_TPCPEN - 1));
+	buffer[0] = 0;
+	assert(!isdv4ValidPacket(buffer, ISDV4_PKGLEN_TPCPEN - 1));
+	assert(!isdv4ValidPacket(buffer, 0));
+}
+
+static void test_isdv4_touch_layouts(void)
+{
+	/* 2FGT packet, first finger up at 0x1234/0x0567, second down at 0x0abc/0x0def */
+	unsigned char packet[ISDV4_PKGLEN_TOUCH2FG] = {
+		HEADER_BIT | TOUCH_CONTROL_BIT | 0x2,
+		0x24, 0x34, 0x0a, 0x67, 0, 0,
+		0x15, 0x3c, 0x1b, 0x6f, 0, 0
+	};
+	ISDV4TouchData touch;
+
+	assert(isdv4TouchPacketLength(0x00) == ISDV4_PKGLEN_TOUCH93);
+	assert(isdv4TouchPacketLength(0x01) == ISDV4_PKGLEN_TOUCH9A);
+	assert(isdv4TouchPacketLength(0x02) == ISDV4_PKGLEN_TOUCH93);
+	assert(isdv4TouchPacketLength(0x03) == ISDV4_PKGLEN_TOUCH9A);
+	assert(isdv4TouchPacketLength(0x04) == ISDV4_PKGLEN_TOUCH9A);
+	assert(isdv4TouchPacketLength(0x05) == ISDV4_PKGLEN_TOUCH2FG);
+	assert(isdv4TouchPacketLength(0x7f) == ISDV4_PKGLEN_TOUCH93);
+	assert(isdv4TouchLayout(0x7f) == NULL);
+
+	assert(isdv4TouchLayoutByTablet(0xE2)->pktlen == ISDV4_PKGLEN_TOUCH2FG);
+	assert(isdv4TouchLayoutByTablet(0x9F)->pktlen == ISDV4_PKGLEN_TOUCH9A);
+
+	assert(isdv4ParseTouchData(packet, sizeof(packet), sizeof(packet), &touch) ==
+	       ISDV4_PKGLEN_TOUCH2FG);
+	assert(touch.status == 0);
+	assert(touch.x == 0x1234 && touch.y == 0x0567);
+	assert(touch.finger2.status == 1);
+	assert(touch.finger2.x == 0x0abc && touch.finger2.y == 0x0def);
+}
+
+static void test_pressure_curve(void)
+{
+	WacomDeviceRec priv = {0}, priv2 = {0};
+	WacomCommonRec common = {0};
+	int knots[] = { 10, 20, 30, 25, 60, 80, 90, 90 };
+	int i, p, prev = 0;
+
+	priv.maxCurve = priv2.maxCurve = FILTER_PRESSURE_RES;
+
+	/* the default curve needs no table */
+	wcmSetPressureCurve(&priv, 0, 0, 100, 100);
+	assert(priv.pPressCurve == NULL);
+
+	/* control points on the diagonal are a straight line */
+	wcmSetPressureCurve(&priv, 25, 25, 75, 75);
+	assert(priv.pPressCurve);
+	assert(priv.pPressCurve->npoints == 2);
+	for (i = 0; i <= priv.maxCurve; i += 97)
+		assert(wcmApplyPressureCurve(priv.pPressCurve, i) == i);
+
+	/* identical curves are shared */
+	wcmSetPressureCurve(&priv, 0, 75, 25, 100);
+	wcmSetPressureCurve(&priv2, 0, 75, 25, 100);
+	assert(priv.pPressCurve == priv2.pPressCurve);
+	assert(priv.pPressCurve->refs == 2);
+	assert(priv.pPressCurve->npoints <= PRESSURE_CURVE_POINTS);
+
+	/* a soft curve stays within range and never decreases */
+	assert(wcmApplyPressureCurve(priv.pPressCurve, priv.maxCurve) == priv.maxCurve);
+	for (i = 0; i <= priv.maxCurve; i++)
+	{
+		p = wcmApplyPressureCurve(priv.pPressCurve, i);
+		assert(p >= prev && p <= priv.maxCurve);
+		assert(p >= i);
+		prev = p;
+	}
+
+	wcmSetPressureCurve(&priv2, 0, 0, 100, 100);
+	assert(priv.pPressCurve->refs == 1);
+	wcmSetPressureCurve(&priv, 0, 0, 100, 100);
+	assert(priv.pPressCurve == NULL);
+
+	/* points must ascend */
+	assert(!wcmCheckPressureCurve(knots, 6 - 1));
+	knots[2] = 5;
+	assert(!wcmCheckPressureCurve(knots, ARRAY_SIZE(knots)));
+	knots[2] = 30;
+
+	/* a curve through points is flat outside them, passes through them
+	 * and never decreases between them */
+	wcmSetPressureCurvePoints(&priv, knots, ARRAY_SIZE(knots));
+	assert(priv.pPressCurve && priv.nPressCtrlCount == ARRAY_SIZE(knots));
+	assert(wcmApplyPressureCurve(priv.pPressCurve, 0) == priv.maxCurve / 5);
+	assert(wcmApplyPressureCurve(priv.pPressCurve, priv.maxCurve) ==
+	       (int)(0.9 * priv.maxCurve));
+	for (i = 0; i < ARRAY_SIZE(knots); i += 2)
+	{
+		p = wcmApplyPressureCurve(priv.pPressCurve,
+					  knots[i] * priv.maxCurve / 100);
+		assert(abs(p - knots[i + 1] * priv.maxCurve / 100) <= 1);
+	}
+	for (i = 0, prev = 0; i <= priv.maxCurve; i++)
+	{
+		p = wcmApplyPressureCurve(priv.pPressCurve, i);
+		assert(p >= prev);
+		prev = p;
+	}
+
+	/* a tool's curve is picked when it comes into proximity */
+	priv.common = &common;
+	common.wcmDevices = &priv;
+	assert(wcmSetToolPressureCurve(&common, 0x1234, knots, ARRAY_SIZE(knots)));
+	wcmSelectToolPressureCurve(&priv, 0x1234);
+	assert(priv.pToolCurve && priv.pToolCurve->curve == priv.pPressCurve);
+	wcmSelectToolPressureCurve(&priv, 0x4321);
+	assert(priv.pToolCurve == NULL);
+	wcmSelectToolPressureCurve(&priv, 0x1234);
+	assert(wcmSetToolPressureCurve(&common, 0x1234, NULL, 0));
+	assert(priv.pToolCurve == NULL && common.wcmCurveProfiles == NULL);
+	assert(priv.pPressCurve->refs == 1);
+	wcmSetPressureCurve(&priv, 0, 0, 100, 100);
+}
+
+static void test_compile_action(void)
+{
+	/* ctrl down, a click, b down, then nothing */
+	unsigned int keys[256] = {
+		AC_KEY | AC_KEYBTNPRESS | 37,
+		AC_KEY | AC_KEYBTNPRESS | 38,
+		AC_KEY | 38,
+		AC_BUTTON | AC_KEYBTNPRESS | 2,
+	};
+	WacomAction *prog, *prog2;
+
+	/* a press runs the actions, a release lets go of what is still down */
+	prog = wcmGetAction(keys, ARRAY_SIZE(keys));
+	assert(prog->npress == 4);
+	assert(memcmp(prog->actions, keys, 4 * sizeof(*keys)) == 0);
+	assert(prog->nrelease == 2);
+	assert(prog->actions[4] == (AC_KEY | 37));
+	assert(prog->actions[5] == (AC_BUTTON | 2));
+
+	/* the same actions share a program */
+	prog2 = wcmGetAction(keys, 4);
+	assert(prog2 == prog && prog->refs == 2);
+	wcmReleaseAction(prog2);
+	assert(prog->refs == 1);
+	wcmReleaseAction(prog);
+
+	/* nothing to do for an empty array */
+	memset(keys, 0, sizeof(keys));
+	prog = wcmGetAction(keys, ARRAY_SIZE(keys));
+	assert(prog->npress == 0 && prog->nrelease == 0);
+	wcmReleaseAction(prog);
+}
+
 int main(int argc, char** argv)
 {
 	test_common_ref();
 	test_rebase_pressure();
+	test_known_pen_pressure();
+	test_transform_clip();
 	test_normalize_pressure();
 	test_suppress();
 	test_initial_size();
@@ -638,6 +969,10 @@ int main(int argc, char** argv)
 	test_flag_set();
 	test_get_scroll_delta();
 	test_get_wheel_button();
+	test_isdv4_find_header();
+	test_isdv4_touch_layouts();
+	test_pressure_curve();
+	test_compile_action();
 	return 0;
 }
 
@@ -197,10 +197,7 @@ void memdump(const unsigned char *buffer, int len)
 
 int skip_garbage(unsigned char *buffer, size_t len)
 {
-	int i;
-	for (i = 0; i < len; i++)
-		if (buffer[i] & HEADER_BIT)
-			break;
+	int i = isdv4FindHeader(buffer, len);
 
 	if (i != 0)
 		TRACE("skipping over %d bytes.\n", (i < len) ? i : -1);
@@ -436,7 +433,7 @@ int event_loop(int fd, int sensor_id)
 		{
 			packetlength = ISDV4_PKGLEN_TPCPEN;
 			if (buffer[0] & TOUCH_CONTROL_BIT)
-				packetlength = ISDV4PacketLengths[sensor_id];
+				packetlength = isdv4TouchPacketLength(sensor_id);
 		} else {
 			int bytes = skip_garbage(buffer, dlen);
 			if (bytes > 0) {
@@ -451,6 +448,14 @@ int event_loop(int fd, int sensor_id)
 			continue;
 		TRACE("Expecting packet sized %d\n", packetlength);
 
+		if (!isdv4ValidPacket(buffer, packetlength)) {
+			int bytes = 1 + isdv4FindHeader(&buffer[1], packetlength - 1);
+			TRACE("header bit inside packet, skipping %d bytes.\n", bytes);
+			dlen -= bytes;
+			memmove(buffer, &buffer[bytes], sizeof(buffer) - bytes);
+			continue;
+		}
+
 		if (buffer[0] & CONTROL_BIT) {
 			dlen -= packetlength;
 			continue;
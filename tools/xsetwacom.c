@@ -113,6 +113,11 @@ static void set_xydefault(Display *dpy, XDevice *dev, param_t *param, int argc,
 static void get_all(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
 static void get_param(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
 static void set_output(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
+static void set_calibration(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
+static void get_calibration(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
+static void get_stats(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
+static void set_int_list(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
+static void get_int_list(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
 
 /* NOTE: When removing or changing a parameter name, add to
  * deprecated_parameters.
@@ -128,6 +133,16 @@ static param_t parameters[] =
 		.prop_offset = 0,
 		.arg_count = 4,
 	},
+	{
+		.name = "CalibrationMatrix",
+		.x11name = "CalibrationMatrix",
+		.desc = "3x3 matrix applied to the normalized tablet coordinates, "
+		"row by row (default is 1 0 0 0 1 0 0 0 1). ",
+		.prop_name = WACOM_PROP_CALIBRATION,
+		.set_func = set_calibration,
+		.get_func = get_calibration,
+		.arg_count = 9,
+	},
 	{
 		.name = "Button",
 		.desc = "X11 event to which the given button should be mapped. ",
@@ -176,14 +191,49 @@ static param_t parameters[] =
 		.prop_offset = 1,
 		.arg_count = 1,
 	},
+	{
+		.name = "Filter",
+		.x11name = "Filter",
+		.desc = "Coordinate filter mode (0 average, 1 1euro, 2 kalman) "
+		"and its two parameters (default is 0 0 0). ",
+		.prop_name = WACOM_PROP_FILTER,
+		.prop_format = 32,
+		.prop_offset = 0,
+		.arg_count = 3,
+	},
+	{
+		.name = "Prediction",
+		.x11name = "Prediction",
+		.desc = "Milliseconds the position is extrapolated ahead "
+		"in absolute mode (default is 0, off). ",
+		.prop_name = WACOM_PROP_PREDICTION,
+		.prop_format = 32,
+		.prop_offset = 0,
+		.arg_count = 1,
+	},
 	{
 		.name = "PressureCurve",
 		.x11name = "PressCurve",
-		.desc = "Bezier curve for pressure (default is 0 0 100 100 [linear]). ",
+		.desc = "Bezier curve for pressure (default is 0 0 100 100 [linear]), "
+		"or 3 to 16 points x y the curve passes through. ",
 		.prop_name = WACOM_PROP_PRESSURECURVE,
 		.prop_format = 32,
 		.prop_offset = 0,
-		.arg_count = 4,
+		.set_func = set_int_list,
+		.get_func = get_int_list,
+		.arg_count = 32,
+	},
+	{
+		.name = "ToolPressureCurve",
+		.desc = "Tool serial followed by a pressure curve as for "
+		"PressureCurve, used whenever that tool is in proximity. "
+		"The serial alone removes the tool's curve. ",
+		.prop_name = WACOM_PROP_TOOL_PRESSURECURVE,
+		.prop_format = 32,
+		.prop_offset = 0,
+		.set_func = set_int_list,
+		.get_func = get_int_list,
+		.arg_count = 33,
 	},
 	{
 		.name = "Mode",
@@ -478,6 +528,15 @@ static param_t parameters[] =
 		.arg_count = 1,
 		.prop_flags = PROP_FLAG_WRITEONLY | PROP_FLAG_OUTPUT,
 	},
+	{
+		.name = "Stats",
+		.desc = "Returns the read and event counters of the tablet. ",
+		.prop_name = WACOM_PROP_EVENT_STATS,
+		.prop_format = 32,
+		.arg_count = 0,
+		.get_func = get_stats,
+		.prop_flags = PROP_FLAG_READONLY,
+	},
 	{
 		.name = "all",
 		.desc = "Get value for all parameters. ",
@@ -1674,6 +1733,68 @@ out:
 }
 
 
+/* the calibration property holds 16.16 fixed point values */
+#define CALIBRATION_ONE 65536.0
+
+static void set_calibration(Display *dpy, XDevice *dev, param_t* param, int argc, char **argv)
+{
+	Atom prop, type;
+	int format;
+	unsigned char* data;
+	unsigned long nitems, bytes_after;
+	long *values;
+	int i;
+
+	if (argc != param->arg_count)
+	{
+		fprintf(stderr, "'%s' requires exactly %d value(s).\n", param->name,
+			param->arg_count);
+		return;
+	}
+
+	prop = XInternAtom(dpy, param->prop_name, True);
+	if (!prop)
+	{
+		fprintf(stderr, "Property for '%s' not available.\n",
+			param->name);
+		return;
+	}
+
+	XGetDeviceProperty(dpy, dev, prop, 0, 1000, False, AnyPropertyType,
+				&type, &format, &nitems, &bytes_after, &data);
+
+	if (nitems != param->arg_count || format != 32)
+	{
+		fprintf(stderr, "Property for '%s' has no or wrong value - this is a bug.\n",
+			param->name);
+		goto out;
+	}
+
+	values = (long*)data;
+	for (i = 0; i < argc; i++)
+	{
+		char *end;
+		double v = strtod(argv[i], &end);
+
+		if (end == argv[i] || *end != '\0' || v <= -32768 || v >= 32768)
+		{
+			fprintf(stderr, "'%s' is not a valid value for the '%s' property.\n",
+				argv[i], param->name);
+			goto out;
+		}
+
+		values[i] = (long)(v * CALIBRATION_ONE + (v < 0 ? -0.5 : 0.5));
+	}
+
+	TRACE("Setting calibration for device %ld.\n", dev->device_id);
+
+	XChangeDeviceProperty(dpy, dev, prop, type, format,
+				PropModeReplace, data, nitems);
+	XFlush(dpy);
+out:
+	XFree(data);
+}
+
 /**
  * Performs intelligent string->int conversion. In addition to converting strings
  * of digits into their corresponding integer values, it converts special string
@@ -1885,6 +2006,182 @@ static void get_mode(Display *dpy, XDevice *dev, param_t* param, int argc, char
 	XFreeDeviceList(info);
 }
 
+static void get_calibration(Display *dpy, XDevice *dev, param_t* param, int argc, char **argv)
+{
+	Atom prop, type;
+	int format;
+	unsigned char* data;
+	unsigned long nitems, bytes_after;
+	long *values;
+
+	if (argc != 0)
+	{
+		fprintf(stderr, "Incorrect number of arguments supplied.\n");
+		return;
+	}
+
+	prop = XInternAtom(dpy, param->prop_name, True);
+	if (!prop)
+	{
+		fprintf(stderr, "Property for '%s' not available.\n",
+			param->name);
+		return;
+	}
+
+	TRACE("Getting calibration for device %ld.\n", dev->device_id);
+
+	XGetDeviceProperty(dpy, dev, prop, 0, 1000, False, AnyPropertyType,
+				&type, &format, &nitems, &bytes_after, &data);
+
+	if (nitems != param->arg_count || format != 32)
+	{
+		fprintf(stderr, "Property for '%s' has no or wrong value - this is a bug.\n",
+			param->name);
+		goto out;
+	}
+
+	values = (long*)data;
+	print_value(param, "%g %g %g %g %g %g %g %g %g",
+		    (int)values[0] / CALIBRATION_ONE, (int)values[1] / CALIBRATION_ONE,
+		    (int)values[2] / CALIBRATION_ONE, (int)values[3] / CALIBRATION_ONE,
+		    (int)values[4] / CALIBRATION_ONE, (int)values[5] / CALIBRATION_ONE,
+		    (int)values[6] / CALIBRATION_ONE, (int)values[7] / CALIBRATION_ONE,
+		    (int)values[8] / CALIBRATION_ONE);
+
+out:
+	XFree(data);
+}
+
+/* Fetch up to n values of a 32 bit integer property, returns the number
+ * of values fetched */
+static int get_int_property(Display *dpy, XDevice *dev, const char *name,
+			    long *values, int n)
+{
+	Atom prop, type;
+	int format, i;
+	unsigned char* data;
+	unsigned long nitems, bytes_after;
+
+	prop = XInternAtom(dpy, name, True);
+	if (!prop)
+		return 0;
+
+	XGetDeviceProperty(dpy, dev, prop, 0, n, False, XA_INTEGER,
+				&type, &format, &nitems, &bytes_after, &data);
+
+	if (format != 32)
+		nitems = 0;
+
+	for (i = 0; i < nitems && i < n; i++)
+		values[i] = ((long*)data)[i];
+
+	XFree(data);
+	return i;
+}
+
+/* Set a 32 bit integer property to 1 to arg_count values */
+static void set_int_list(Display *dpy, XDevice *dev, param_t* param, int argc, char **argv)
+{
+	Atom prop;
+	long data[64];
+	char **values;
+	int nvals = 0, i;
+
+	prop = XInternAtom(dpy, param->prop_name, True);
+	if (!prop)
+	{
+		fprintf(stderr, "Property for '%s' not available.\n",
+			param->name);
+		return;
+	}
+
+	values = strjoinsplit(argc, argv, &nvals);
+
+	if (nvals < 1 || nvals > param->arg_count || nvals > ARRAY_SIZE(data))
+	{
+		fprintf(stderr, "'%s' requires 1 to %d value(s).\n", param->name,
+			param->arg_count);
+		goto out;
+	}
+
+	for (i = 0; i < nvals; i++)
+	{
+		int val;
+
+		if (!convert_value_from_user(param, values[i], &val))
+		{
+			fprintf(stderr, "'%s' is not a valid value for the '%s' property.\n",
+				values[i], param->name);
+			goto out;
+		}
+		data[i] = val;
+	}
+
+	TRACE("Setting %d value(s) of '%s' for device %ld.\n", nvals,
+	      param->name, dev->device_id);
+
+	XChangeDeviceProperty(dpy, dev, prop, XA_INTEGER, 32,
+				PropModeReplace, (unsigned char*)data, nvals);
+	XFlush(dpy);
+out:
+	for (i = 0; i < nvals; i++)
+		free(values[i]);
+	free(values);
+}
+
+/* Print however many values a 32 bit integer property holds */
+static void get_int_list(Display *dpy, XDevice *dev, param_t* param, int argc, char **argv)
+{
+	long values[64];
+	char str[1024] = {0};
+	int nvals, i;
+
+	if (argc != 0)
+	{
+		fprintf(stderr, "Incorrect number of arguments supplied.\n");
+		return;
+	}
+
+	TRACE("Getting '%s' for device %ld.\n", param->name, dev->device_id);
+
+	nvals = get_int_property(dpy, dev, param->prop_name, values,
+				 ARRAY_SIZE(values));
+
+	for (i = 0; i < nvals; i++)
+		sprintf(&str[strlen(str)], i ? " %ld" : "%ld", values[i]);
+
+	print_value(param, "%s", str);
+}
+
+static void get_stats(Display *dpy, XDevice *dev, param_t* param, int argc, char **argv)
+{
+	long events[6], reads[7];
+
+	if (argc != 0)
+	{
+		fprintf(stderr, "Incorrect number of arguments supplied.\n");
+		return;
+	}
+
+	TRACE("Getting statistics for device %ld.\n", dev->device_id);
+
+	if (get_int_property(dpy, dev, param->prop_name, events, 6) != 6 ||
+	    get_int_property(dpy, dev, WACOM_PROP_READ_STATS, reads, 7) != 7)
+	{
+		fprintf(stderr, "Property for '%s' not available.\n",
+			param->name);
+		return;
+	}
+
+	print_value(param, "events=%ld events/s=%ld suppressed=%ld "
+		    "queue-overflows=%ld no-channel=%ld resyncs=%ld "
+		    "wakeups=%ld reads=%ld bytes=%ld max-reads=%ld "
+		    "max-bytes=%ld read-limit=%ld syn-dropped=%ld",
+		    events[0], events[1], events[2], events[3], events[4],
+		    events[5], reads[0], reads[1], reads[2], reads[3],
+		    reads[4], reads[5], reads[6]);
+}
+
 static void get_rotate(Display *dpy, XDevice *dev, param_t* param, int argc, char **argv)
 {
 	const char *rotation = NULL;
@@ -2979,7 +3276,7 @@ static void test_parameter_number(void)
 	 * deprecated them.
 	 * Numbers include trailing NULL entry.
 	 */
-	assert(ARRAY_SIZE(parameters) == 39);
+	assert(ARRAY_SIZE(parameters) == 44);
 	assert(ARRAY_SIZE(deprecated_parameters) == 17);
 }
 